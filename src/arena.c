@@ -0,0 +1,390 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Request memory: per-connection arenas and size-class buffer pools                        **
+**                                                                                           **
+**  An arena is a bump allocator owned by one connection: the frames of a request are        **
+**  carved from it and the whole arena is reset once the request is served. A request that   **
+**  does not fit chains a larger block; the reset folds the chain into one block of the      **
+**  combined size, so a connection soon serves every request from a single block.            **
+**  Reply buffers use pools of power of two size classes, 64 bytes to 1 MB. Each thread      **
+**  keeps its freed buffers for reuse without a lock; beyond POOLCACHEBYTES per class, and   **
+**  when the thread exits, they move to a shared depot the other threads refill from. Only   **
+**  a buffer larger than 1 MB or a class with nothing cached calls malloc.                   **
+**  Every allocation is counted by stats.c, along with those that had to call malloc.        **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        Arena* arenaCreate(int size);               // arena with a first block            **
+**        void* arenaAlloc(Arena *arena, int size);   // memory until the next reset         **
+**        void arenaReset(Arena *arena);              // release everything allocated        **
+**        void arenaDestroy(Arena *arena);            // free the arena and its blocks       **
+**        void* poolAlloc(int size);                  // buffer from a size-class pool       **
+**        void poolFree(void *buffer);                // give a buffer back to its pool      **
+**    - Internal:                                                                            **
+**        ArenaBlock* arenaBlock(int size);           // allocate an arena block             **
+**        int poolClass(int size);                    // smallest class holding size bytes   **
+**        PoolCache* poolCache();                     // buffer cache of the calling thread  **
+**        void poolRelease(void *cache);              // thread exits, cache goes to depot   **
+**        void poolKey();                             // key releasing caches of threads     **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define ARENAALIGN 16           // every arena allocation starts on 16 bytes
+#define POOLMINBITS 6           // smallest class: 64 bytes, header included
+#define POOLMAXBITS 20          // largest class: 1 MB, larger buffers are malloc'ed
+#define POOLCLASSES (POOLMAXBITS - POOLMINBITS + 1)
+#define POOLCACHEBYTES (256 << 10)    // a thread keeps up to 256 KB of each class, at least 1 buffer
+#define POOLDEPOTBYTES (16 << 20)     // the depot keeps up to 16 MB of each class
+#define POOLLARGE -1            // class of a malloc'ed buffer
+
+typedef struct ArenaBlock{
+	struct ArenaBlock *next;    // older blocks of the current request
+	int size;                   // bytes in data
+	int used;
+	_Alignas(ARENAALIGN) char data[];
+} ArenaBlock;
+
+typedef struct Arena{
+	ArenaBlock *block;          // newest block, allocations come from it
+} Arena;
+
+typedef struct PoolHeader{
+	struct PoolHeader *next;    // free list of a cache or the depot
+	int sizeClass;              // POOLLARGE or class index
+	_Alignas(ARENAALIGN) char data[];
+} PoolHeader;
+
+typedef struct{
+	PoolHeader *free[POOLCLASSES];
+	int count[POOLCLASSES];
+} PoolCache;
+
+static PoolHeader *depot[POOLCLASSES];      // buffers given back by other threads
+static int depotCount[POOLCLASSES];
+static pthread_mutex_t depotLock = PTHREAD_MUTEX_INITIALIZER;    // for depot and depotCount
+static pthread_key_t cacheKey;              // cache of a thread, moved to the depot when it exits
+static pthread_once_t cacheOnce = PTHREAD_ONCE_INIT;
+static __thread PoolCache *myCache;
+
+
+// function declare
+extern Arena* arenaCreate(int size);
+extern void* arenaAlloc(Arena *arena, int size);
+extern void arenaReset(Arena *arena);
+extern void arenaDestroy(Arena *arena);
+extern void* poolAlloc(int size);
+extern void poolFree(void *buffer);
+extern void statsAlloc(int system);               // external function (stats.c)
+static ArenaBlock* arenaBlock(int size);
+static int poolClass(int size);
+static PoolCache* poolCache();
+static void poolRelease(void *cache);
+static void poolKey();
+
+
+/****************************************************************
+* Func:   Arena with a first block                              *
+* Param:  int size, bytes of the first block                    *
+* Return: Arena*, empty arena                                   *
+****************************************************************/
+Arena* arenaCreate(int size)
+{
+	Arena *arena = (Arena *)malloc(sizeof(Arena));
+
+	if(arena == NULL)
+	{
+		printf("Allocate arena\n");
+		exit(1);
+	}
+	arena->block = arenaBlock(size);
+
+	return arena;
+}
+
+
+/****************************************************************
+* Func:   Memory from an arena, valid until arenaReset          *
+* Param:  Arena *arena, arena of the connection                 *
+*         int size, bytes                                       *
+* Return: void*, ARENAALIGN aligned memory                      *
+****************************************************************/
+void* arenaAlloc(Arena *arena, int size)
+{
+	ArenaBlock *block = arena->block;
+	void *memory;
+
+	size = (size + ARENAALIGN - 1) & ~(ARENAALIGN - 1);
+	if(block->used + size > block->size)    // chain a larger block, folded by arenaReset
+	{
+		ArenaBlock *more = arenaBlock(block->size * 2 > size ? block->size * 2 : size);
+
+		more->next = block;
+		arena->block = block = more;
+		statsAlloc(1);
+	}
+	else
+	{
+		statsAlloc(0);
+	}
+	memory = block->data + block->used;
+	block->used += size;
+
+	return memory;
+}
+
+
+/****************************************************************
+* Func:   Release everything allocated from an arena. Chained   *
+*         blocks become one block holding all of them           *
+* Param:  Arena *arena, arena of the connection                 *
+* Return: none                                                  *
+****************************************************************/
+void arenaReset(Arena *arena)
+{
+	ArenaBlock *block = arena->block, *next;
+	int size = 0;
+
+	if(block->next != NULL)
+	{
+		for(; block != NULL; block = next)
+		{
+			next = block->next;
+			size += block->size;
+			free(block);
+		}
+		arena->block = block = arenaBlock(size);
+	}
+	block->used = 0;
+}
+
+
+/****************************************************************
+* Func:   Free an arena and its blocks                          *
+* Param:  Arena *arena, arena of a closing connection           *
+* Return: none                                                  *
+****************************************************************/
+void arenaDestroy(Arena *arena)
+{
+	ArenaBlock *block, *next;
+
+	for(block = arena->block; block != NULL; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
+
+
+/****************************************************************
+* Func:   Buffer from the pool of its size class                *
+* Param:  int size, bytes                                       *
+* Return: void*, buffer, give it back with poolFree             *
+****************************************************************/
+void* poolAlloc(int size)
+{
+	int sizeClass = poolClass(size);
+	PoolCache *cache;
+	PoolHeader *buffer;
+
+	if(sizeClass == POOLLARGE)                // no pool, straight from malloc
+	{
+		buffer = (PoolHeader *)malloc(sizeof(PoolHeader) + size);
+		statsAlloc(1);
+	}
+	else
+	{
+		cache = poolCache();
+		if((buffer = cache->free[sizeClass]) != NULL)
+		{
+			cache->free[sizeClass] = buffer->next;
+			cache->count[sizeClass]--;
+		}
+		else                                  // one buffer another thread gave back, no hoarding
+		{
+			pthread_mutex_lock(&depotLock);
+			if((buffer = depot[sizeClass]) != NULL)
+			{
+				depot[sizeClass] = buffer->next;
+				depotCount[sizeClass]--;
+			}
+			pthread_mutex_unlock(&depotLock);
+		}
+
+		if(buffer != NULL)
+		{
+			statsAlloc(0);
+		}
+		else
+		{
+			buffer = (PoolHeader *)malloc((size_t)1 << (sizeClass + POOLMINBITS));
+			statsAlloc(1);
+		}
+	}
+	if(buffer == NULL)
+	{
+		printf("Allocate buffer\n");
+		exit(1);
+	}
+	buffer->sizeClass = sizeClass;
+
+	return buffer->data;
+}
+
+
+/****************************************************************
+* Func:   Give a buffer back to the pool of its size class      *
+* Param:  void *buffer, from poolAlloc (NULL: nothing)          *
+* Return: none                                                  *
+****************************************************************/
+void poolFree(void *buffer)
+{
+	PoolHeader *header;
+	PoolCache *cache;
+	int sizeClass;
+
+	if(buffer == NULL)
+		return;
+	header = (PoolHeader *)((char *)buffer - offsetof(PoolHeader, data));
+	if((sizeClass = header->sizeClass) == POOLLARGE)
+	{
+		free(header);
+		return;
+	}
+
+	cache = poolCache();
+	header->next = cache->free[sizeClass];
+	cache->free[sizeClass] = header;
+	if(++cache->count[sizeClass] << (sizeClass + POOLMINBITS) > POOLCACHEBYTES && cache->count[sizeClass] > 1)
+	{
+		header = cache->free[sizeClass];        // over the limit: the newest one goes to the depot
+		cache->free[sizeClass] = header->next;
+		cache->count[sizeClass]--;
+
+		pthread_mutex_lock(&depotLock);
+		if(depotCount[sizeClass] << (sizeClass + POOLMINBITS) < POOLDEPOTBYTES)
+		{
+			header->next = depot[sizeClass];
+			depot[sizeClass] = header;
+			depotCount[sizeClass]++;
+			header = NULL;
+		}
+		pthread_mutex_unlock(&depotLock);
+		free(header);
+	}
+}
+
+
+/****************************************************************
+* Func:   Allocate an arena block                               *
+* Param:  int size, bytes for allocations                       *
+* Return: ArenaBlock*, empty block                              *
+****************************************************************/
+ArenaBlock* arenaBlock(int size)
+{
+	ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + size);
+
+	if(block == NULL)
+	{
+		printf("Allocate arena block\n");
+		exit(1);
+	}
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+
+/****************************************************************
+* Func:   Smallest size class holding a buffer and its header   *
+* Param:  int size, bytes for the caller                        *
+* Return: int, class index                                      *
+*         POOLLARGE, larger than every class                    *
+****************************************************************/
+int poolClass(int size)
+{
+	size_t total = sizeof(PoolHeader) + size;
+	int sizeClass = 0;
+
+	while(((size_t)1 << (sizeClass + POOLMINBITS)) < total)
+	{
+		if(++sizeClass == POOLCLASSES)
+			return POOLLARGE;
+	}
+
+	return sizeClass;
+}
+
+
+/****************************************************************
+* Func:   Buffer cache of the calling thread                    *
+* Param:  none                                                  *
+* Return: PoolCache*, cache of the thread                       *
+****************************************************************/
+PoolCache* poolCache()
+{
+	if(myCache != NULL)
+		return myCache;
+
+	pthread_once(&cacheOnce, poolKey);
+	if((myCache = (PoolCache *)calloc(1, sizeof(PoolCache))) == NULL)
+	{
+		printf("Allocate buffer cache\n");
+		exit(1);
+	}
+	pthread_setspecific(cacheKey, myCache);
+
+	return myCache;
+}
+
+
+/****************************************************************
+* Func:   Owner thread exits, its buffers go to the depot       *
+* Param:  void *cache, cache of the thread (PoolCache *)        *
+* Return: none                                                  *
+****************************************************************/
+void poolRelease(void *cache)
+{
+	PoolCache *c = (PoolCache *)cache;
+	PoolHeader *buffer;
+	int i;
+
+	pthread_mutex_lock(&depotLock);
+	for(i = 0; i < POOLCLASSES; i++)
+	{
+		while((buffer = c->free[i]) != NULL)
+		{
+			c->free[i] = buffer->next;
+			if(depotCount[i] << (i + POOLMINBITS) >= POOLDEPOTBYTES)
+			{
+				free(buffer);
+				continue;
+			}
+			buffer->next = depot[i];
+			depot[i] = buffer;
+			depotCount[i]++;
+		}
+	}
+	pthread_mutex_unlock(&depotLock);
+	free(c);
+}
+
+
+/****************************************************************
+* Func:   Create the key that releases caches of exited threads *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void poolKey()
+{
+	pthread_key_create(&cacheKey, poolRelease);
+}
@@ -0,0 +1,121 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Broadcast log: messages for all known users ('5') or all connected users ('4')           **
+**                                                                                           **
+**  A broadcast is stored once, in a ring of BCASTSIZE records numbered by a sequence that   **
+**  only grows. Posting costs the same for 10 or 100000 users; each user keeps a read        **
+**  cursor into the log (server.c) and picks up what it is entitled to when it reads its     **
+**  messages. A user more than BCASTSIZE broadcasts behind misses the oldest ones.           **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        uint64_t bcastPost(int from, time_t time, int activeOnly, char *message);          **
+**                                                    // append a broadcast, return its seq  **
+**        int bcastRead(uint64_t seq, int *from, time_t *time, int *activeOnly,              **
+**                      char *message);               // copy a broadcast out of the log     **
+**        uint64_t bcastHead();                       // seq of the next broadcast           **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MESSAGELENGTH 80        // max 80 characters for a message
+#define BCASTSIZE 4096          // broadcasts kept in the log
+
+typedef struct{
+	int from;                   // sender location in known user table
+	time_t time;                // when the sender sends
+	int activeOnly;             // 1: '4', users connected at the time, 0: '5', all known users
+	char message[MESSAGELENGTH + 1];
+} Broadcast;
+
+static Broadcast bcastLog[BCASTSIZE];       // seq % BCASTSIZE
+static uint64_t bcastNext;                  // seq of the next broadcast
+static pthread_rwlock_t bcastLock = PTHREAD_RWLOCK_INITIALIZER;    // writer: post, readers: read
+
+
+// function declare
+extern uint64_t bcastPost(int from, time_t time, int activeOnly, char *message);
+extern int bcastRead(uint64_t seq, int *from, time_t *time, int *activeOnly, char *message);
+extern uint64_t bcastHead();
+
+
+/****************************************************************
+* Func:   Append a broadcast to the log, O(1)                   *
+* Param:  int from, sender location                             *
+*         time_t time, when the sender sends                    *
+*         int activeOnly, 1 for connected users, 0 for all      *
+*         char *message, text to be recorded                    *
+* Return: uint64_t, sequence number of the broadcast            *
+****************************************************************/
+uint64_t bcastPost(int from, time_t time, int activeOnly, char *message)
+{
+	Broadcast *cast;
+	uint64_t seq;
+
+	pthread_rwlock_wrlock(&bcastLock);
+	seq = bcastNext;
+	cast = &bcastLog[seq % BCASTSIZE];    // overwrites the oldest one
+	cast->from = from;
+	cast->time = time;
+	cast->activeOnly = activeOnly;
+	strncpy(cast->message, message, MESSAGELENGTH);
+	cast->message[MESSAGELENGTH] = '\0';
+	bcastNext = seq + 1;
+	pthread_rwlock_unlock(&bcastLock);
+
+	return seq;
+}
+
+
+/****************************************************************
+* Func:   Copy a broadcast out of the log                       *
+* Param:  uint64_t seq, sequence number                         *
+*         int *from, sender location                            *
+*         time_t *time, when the sender sent                    *
+*         int *activeOnly, 1 for connected users, 0 for all     *
+*         char *message, MESSAGELENGTH + 1 chars                *
+* Return: 1 success                                             *
+*         0 not posted yet, or already overwritten              *
+****************************************************************/
+int bcastRead(uint64_t seq, int *from, time_t *time, int *activeOnly, char *message)
+{
+	Broadcast *cast;
+
+	pthread_rwlock_rdlock(&bcastLock);
+	if(seq >= bcastNext || seq + BCASTSIZE < bcastNext)
+	{
+		pthread_rwlock_unlock(&bcastLock);
+		return 0;
+	}
+	cast = &bcastLog[seq % BCASTSIZE];
+	*from = cast->from;
+	*time = cast->time;
+	*activeOnly = cast->activeOnly;
+	strcpy(message, cast->message);
+	pthread_rwlock_unlock(&bcastLock);
+
+	return 1;
+}
+
+
+/****************************************************************
+* Func:   Sequence number of the next broadcast                 *
+* Param:  none                                                  *
+* Return: uint64_t, everything before it is posted              *
+****************************************************************/
+uint64_t bcastHead()
+{
+	uint64_t seq;
+
+	pthread_rwlock_rdlock(&bcastLock);
+	seq = bcastNext;
+	pthread_rwlock_unlock(&bcastLock);
+
+	return seq;
+}
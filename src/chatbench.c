@@ -0,0 +1,460 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Load generator and latency benchmark for the chat server                                 **
+**                                                                                           **
+**  Opens N simulated clients (one thread each), logs them in, then every client sends a     **
+**  random mix of commands 1..6 and waits for each reply (closed loop). Reports throughput   **
+**  and p50/p99/p999 latency per command. '3', '4' and '5' get no reply from the server,     **
+**  their latency is the time to hand the request to the socket. Each request leaves in one  **
+**  write with TCP_NODELAY, so Nagle's algorithm does not show up in the numbers.            **
+**                                                                                           **
+**  Usage: chatbench [-c clients] [-n requests] [-m mix] [-u users] [-2] [-z] [-s] host port **
+**         -c number of clients, default 10                                                  **
+**         -n requests per client, default 10000                                             **
+**         -m weights of commands 1..6, default 5,5,60,5,5,20                                **
+**         -u '3' goes to one of this many other users, most of them new to the server,      **
+**            so users are recorded while others look names up; default: the clients         **
+**         -2 ask for v2 frames at log in                                                    **
+**         -z ask for compressed frames too ("LZ", v2), compare the bytes received and the   **
+**            CPU time of both sides (with -s) to a run without it                           **
+**         -s print the statistics of the server afterwards (admin command 's')              **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        int connectToServer(char *hn, int port);    // client connect to server            **
+**        void* benchClient(void *arg);               // one simulated client                **
+**        char pickCommand(unsigned int *seed);       // random command by the mix           **
+**        long elapsed(struct timespec *start);       // nanoseconds since start             **
+**        int compareLong(const void *a, const void *b);                                     **
+**                                                    // qsort order of latencies            **
+**        void report(double seconds);                // print throughput and percentiles    **
+**        void serverStats();                         // print the statistics of the server  **
+**        void countBytes(int in, int out);           // bytes read and written by clients   **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#define NAMELENGTH 80           // each name is 80 characters maximum
+#define COMMANDS 6              // commands 1..6, 7 only at the end
+#define REPLYSIZE (1 << 20)     // largest v2 reply, e.g. a long user list
+#define MESSAGE "benchmark message, 80 characters at most"
+
+typedef struct{
+	int id;                     // client number, 0..clients-1
+	long *latency[COMMANDS];    // nanoseconds, one per request of that command
+	int count[COMMANDS];        // requests of each command
+	int failed;                 // 1: log in failed or connection lost
+} BenchClient;
+
+static char *host;
+static int port;
+static int clients = 10;
+static int requests = 10000;    // per client
+static int mix[COMMANDS] = {5, 5, 60, 5, 5, 20};
+static int mixTotal;
+static int version2 = 0;        // 1: log in with "V2"
+static int compress = 0;        // 1: log in with "LZ" too
+static atomic_long bytesIn, bytesOut;    // on the wire, all clients
+static int showStats = 0;       // 1: ask the server for its statistics at the end
+static int users = 0;           // recipients of '3', 0: the clients themselves
+static BenchClient *bench;
+static pthread_barrier_t start;    // everybody logged in before timing starts
+
+
+// function declare
+extern int writeStream(int sd, char *content);    // external function from communicate.c
+extern int readStream(int sd, char *content);     // external function from communicate.c
+extern int readFrame(int sd, int *opcode, int *flags, char *content, int size);    // external function from communicate.c
+extern void streamSetVersion(int sd, int version);    // external function from communicate.c
+extern void streamClose(int sd);                  // external function from communicate.c
+extern void streamCork(int sd);                   // external function from communicate.c
+extern int streamFlush(int sd);                   // external function from communicate.c
+extern void streamStats(void (*count)(int in, int out));    // external function from communicate.c
+
+static int connectToServer(char *hn, int port);   // client connect to server
+static void* benchClient(void *arg);              // one simulated client
+static char pickCommand(unsigned int *seed);      // random command by the mix
+static long elapsed(struct timespec *start);      // nanoseconds since start
+static int compareLong(const void *a, const void *b);    // qsort order of latencies
+static void report(double seconds);               // print throughput and percentiles
+static void serverStats();                        // print the statistics of the server
+static void countBytes(int in, int out);          // bytes read and written by clients
+
+
+/****************************************************************
+* Func:   Parse options, run the clients, report                *
+* Param:  int argc, arguments count                             *
+*         char *argv[], arguments value                         *
+* Return: 0 normal exit                                         *
+****************************************************************/
+int main(int argc, char *argv[])
+{
+	pthread_t *tid;
+	struct timespec begin;
+	int opt, usage = 0, i;
+
+	while((opt = getopt(argc, argv, "c:n:m:u:2zs")) != -1)
+	{
+		switch(opt)
+		{
+			case 'c':        // number of clients
+				if((clients = atoi(optarg)) <= 0)
+					usage = 1;
+				break;
+			case 'n':        // requests per client
+				if((requests = atoi(optarg)) <= 0)
+					usage = 1;
+				break;
+			case 'm':        // weights of commands 1..6
+				if(sscanf(optarg, "%d,%d,%d,%d,%d,%d", &mix[0], &mix[1], &mix[2], &mix[3], &mix[4], &mix[5]) != COMMANDS)
+					usage = 1;
+				break;
+			case 'u':        // recipients of '3'
+				if((users = atoi(optarg)) <= 0)
+					usage = 1;
+				break;
+			case '2':        // v2 frames
+				version2 = 1;
+				break;
+			case 'z':        // compressed v2 frames
+				version2 = compress = 1;
+				break;
+			case 's':        // server statistics at the end
+				showStats = 1;
+				break;
+			default:
+				usage = 1;
+				break;
+		}
+	}
+	for(i = 0, mixTotal = 0; i < COMMANDS; i++)
+	{
+		if(mix[i] < 0)
+			usage = 1;
+		mixTotal += mix[i];
+	}
+	if (usage || mixTotal == 0 || argc - optind != 2)
+	{
+		printf("Usage: chatbench [-c clients] [-n requests] [-m w1,w2,w3,w4,w5,w6] [-u users] [-2] [-z] [-s] host port\n");
+		exit(1);
+	}
+	host = argv[optind];
+	port = atoi(argv[optind + 1]);
+	streamStats(countBytes);
+
+	bench = (BenchClient *)calloc(clients, sizeof(BenchClient));
+	tid = (pthread_t *)malloc(sizeof(pthread_t) * clients);
+	pthread_barrier_init(&start, NULL, clients + 1);
+	for(i = 0; i < clients; i++)
+	{
+		bench[i].id = i;
+		if(pthread_create(&tid[i], NULL, benchClient, &bench[i]) != 0)
+		{
+			printf("Create client thread\n");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for(i = 0; i < clients; i++)
+		pthread_join(tid[i], NULL);
+
+	report(elapsed(&begin) / 1e9);
+	if(showStats)
+		serverStats();
+
+	free(tid);
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   One simulated client: log in, wait for the others,    *
+*         send the requests, log out                            *
+* Param:  void *arg, state of this client (BenchClient *)       *
+* Return: none                                                  *
+****************************************************************/
+void* benchClient(void *arg)
+{
+	BenchClient *me = (BenchClient *)arg;
+	char name[NAMELENGTH], recip[NAMELENGTH];
+	char *reply = (char *)malloc(sizeof(char) * REPLYSIZE);
+	unsigned int seed = time(NULL) ^ (me->id * 2654435761u);
+	int sd, i;
+
+	for(i = 0; i < COMMANDS; i++)
+		me->latency[i] = (long *)malloc(sizeof(long) * requests);
+
+	// unique names, several benchmarks may share a server
+	sprintf(name, "bench%d-%d", (int)getpid(), me->id);
+	sd = connectToServer(host, port);
+	if(sd != -1)
+	{
+		char login[NAMELENGTH + 8];
+
+		sprintf(login, "%s%s%s", name, version2 ? "\nV2" : "", compress ? "\nLZ" : "");
+		if(writeStream(sd, login) == -1 || readStream(sd, reply) == -1 || reply[0] != 'S')
+		{
+			me->failed = 1;
+		}
+		else if(strncmp(reply, "S\nV2", 4) == 0)    // "S\nV2\nLZ" with -z
+		{
+			streamSetVersion(sd, 2);
+		}
+	}
+	else
+	{
+		me->failed = 1;
+	}
+
+	pthread_barrier_wait(&start);
+	if(!me->failed)
+		streamCork(sd);          // frames of a request go out together
+
+	for(i = 0; i < requests && !me->failed; i++)
+	{
+		char command[2] = {pickCommand(&seed), '\0'};
+		struct timespec sent;
+		int result = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		result = writeStream(sd, command);
+		switch(command[0])
+		{
+			case '1':            // requests with a reply
+			case '2':
+			case '6':
+				if(result != -1)
+					result = readFrame(sd, NULL, NULL, reply, REPLYSIZE);    // flushes the request first
+				break;
+			case '3':            // recipient, message, no reply
+				if(users > 0)    // mostly unknown names: the server records them
+					sprintf(recip, "bench%d-u%d", (int)getpid(), rand_r(&seed) % users);
+				else
+					sprintf(recip, "bench%d-%d", (int)getpid(), rand_r(&seed) % clients);
+				if(result != -1)
+					result = writeStream(sd, recip);
+				if(result != -1)
+					result = writeStream(sd, MESSAGE);
+				if(result != -1)
+					result = streamFlush(sd);
+				break;
+			default:             // '4', '5': message, no reply
+				if(result != -1)
+					result = writeStream(sd, MESSAGE);
+				if(result != -1)
+					result = streamFlush(sd);
+				break;
+		}
+		if(result == -1)
+		{
+			me->failed = 1;
+			break;
+		}
+		me->latency[command[0] - '1'][me->count[command[0] - '1']++] = elapsed(&sent);
+	}
+
+	if(sd != -1)
+	{
+		writeStream(sd, "7");
+		streamClose(sd);
+	}
+	free(reply);
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Random command by the weights of the mix              *
+* Param:  unsigned int *seed, rand_r state of the client        *
+* Return: char, '1'..'6'                                        *
+****************************************************************/
+char pickCommand(unsigned int *seed)
+{
+	int r = rand_r(seed) % mixTotal, i;
+
+	for(i = 0; r >= mix[i]; i++)
+		r -= mix[i];
+
+	return '1' + i;
+}
+
+
+/****************************************************************
+* Func:   Nanoseconds since a point in time                     *
+* Param:  struct timespec *start, CLOCK_MONOTONIC time          *
+* Return: long, nanoseconds                                     *
+****************************************************************/
+long elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+
+/****************************************************************
+* Func:   qsort order of latencies                              *
+* Param:  const void *a, const void *b, long values             *
+* Return: int, <0, 0 or >0                                      *
+****************************************************************/
+int compareLong(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/****************************************************************
+* Func:   Merge the latencies of all clients, print throughput  *
+*         and percentiles for each command                      *
+* Param:  double seconds, time from start to the last client    *
+* Return: none                                                  *
+****************************************************************/
+void report(double seconds)
+{
+	struct rusage usage;
+	int c, i, total = 0, failed = 0;
+
+	for(i = 0; i < clients; i++)
+	{
+		failed += bench[i].failed;
+		for(c = 0; c < COMMANDS; c++)
+			total += bench[i].count[c];
+	}
+
+	printf("%d clients (%d failed), %d requests in %.3f s, %.0f requests/s\n", clients, failed, total, seconds, total / seconds);
+	printf("command      count    p50(us)    p99(us)   p999(us)\n");
+	for(c = 0; c < COMMANDS; c++)
+	{
+		long *all;
+		int n = 0;
+
+		for(i = 0; i < clients; i++)
+			n += bench[i].count[c];
+		if(n == 0)
+			continue;
+
+		all = (long *)malloc(sizeof(long) * n);
+		for(i = 0, n = 0; i < clients; i++)
+		{
+			memcpy(all + n, bench[i].latency[c], sizeof(long) * bench[i].count[c]);
+			n += bench[i].count[c];
+		}
+		qsort(all, n, sizeof(long), compareLong);
+
+		printf("%7d%s %10d %10.1f %10.1f %10.1f\n", c + 1, c >= 2 && c <= 4 ? "*" : " ", n,
+		       all[n / 2] / 1e3, all[(long)n * 99 / 100] / 1e3, all[(long)n * 999 / 1000] / 1e3);
+		free(all);
+	}
+	printf("* no reply from the server, time to send the request\n");
+
+	getrusage(RUSAGE_SELF, &usage);
+	for(c = 0, i = 0; c < clients; c++)
+		i += bench[c].count[0] + bench[c].count[1] + bench[c].count[5];
+	printf("bytes received %ld (%.0f per reply), sent %ld, client cpu user %.3f s, system %.3f s\n",
+	       atomic_load(&bytesIn), i > 0 ? (double)atomic_load(&bytesIn) / i : 0.0, atomic_load(&bytesOut),
+	       usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+}
+
+
+/****************************************************************
+* Func:   Ask the server for its statistics and print them      *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void serverStats()
+{
+	char name[NAMELENGTH];
+	char *reply = (char *)malloc(sizeof(char) * REPLYSIZE);
+	int sd = connectToServer(host, port);
+
+	sprintf(name, "bench%d-stats%s", (int)getpid(), version2 ? "\nV2" : "");
+	if(sd != -1 && writeStream(sd, name) == 0 && readStream(sd, reply) == 0 && reply[0] == 'S')
+	{
+		if(strncmp(reply, "S\nV2", 4) == 0)
+			streamSetVersion(sd, 2);
+		if(writeStream(sd, "s") == 0 && readFrame(sd, NULL, NULL, reply, REPLYSIZE) != -1)
+			printf("\nServer statistics:\n%s", reply);
+		writeStream(sd, "7");
+	}
+	if(sd != -1)
+		streamClose(sd);
+	free(reply);
+}
+
+
+/****************************************************************
+* Func:   Connect to server using socket                        *
+* Param:  char *hn, host name                                   *
+*         int port, port of the server                          *
+* Return: int sd, socket description                            *
+*         -1 error                                              *
+****************************************************************/
+int connectToServer(char *hn, int port)
+{
+	int sd;
+	struct sockaddr_in pin;
+	struct hostent hostbuf, *hp;
+	char buf[1024];
+	int herr, on = 1;
+
+	if (gethostbyname_r(hn, &hostbuf, buf, sizeof(buf), &hp, &herr) != 0 || hp == NULL)    // thread safe lookup
+	{
+		printf("Error on gethostbyname call\n");
+		return -1;
+	}
+
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)    // create an Internet domain stream socket
+	{
+		perror("Error creating socket");
+		return -1;
+	}
+
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));    // requests are whole writes already
+
+	memset(&pin, 0, sizeof(pin));
+	pin.sin_family = AF_INET;
+	pin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
+	pin.sin_port = htons(port);                          // convert to network byte order
+
+	if (connect(sd, (struct sockaddr *) &pin, sizeof(pin)) == -1)
+	{
+		perror("Error on connect call");
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+
+/****************************************************************
+* Func:   Count bytes read and written by the clients, called   *
+*         by communicate.c on every read and write              *
+* Param:  int in, bytes read                                    *
+*         int out, bytes written                                *
+* Return: none                                                  *
+****************************************************************/
+void countBytes(int in, int out)
+{
+	atomic_fetch_add_explicit(&bytesIn, in, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bytesOut, out, memory_order_relaxed);
+}
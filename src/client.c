@@ -1,365 +1,718 @@
-/**********************************************************************************************
-***********************************************************************************************
-**  Created by Yiheng Gao, 4/16/2018, for project 3                                          **
-**                                                                                           **
-**  Client for network communication using sockets                                           **
-**                                                                                           **
-**  Functions:                                                                               **
-**    - Internal:                                                                            **
-**        int connectToServer(char *hn, char *port);  // client connect to server            **
-**        void logIn(int sd, char *name);             // user log in                         **
-**        void displayMenu();                         // display UI text                     **
-**        void displayName(char *buffer);             // display the message from server     **
-**        void displayMessage(char *message);         // display the message from server     **
-**        char getUserChoice();                       // read user choice from command line  **
-**        int ack(int sd);                            // get acknowledge when log in         **
-**                                                                                           **
-***********************************************************************************************
-**********************************************************************************************/
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <string.h>
-
-#define BUFFERSIZE		100		
-#define NAMELENGTH		80      // each name is 80 characters maximum 
-#define MENUSIZE		7       // 7 choices total for menu
-#define MESSAGELENGTH	80      // 80 characters maximum for each message
-#define MESSAGESIZE		10		// 10 messages max for a user
-
-extern int writeStream(int sd, char *content);    // external function declare from communicate.c
-extern int readStream(int sd, char *content);     // external function declare from communicate.c
-
-static int connectToServer(char *hn, char *port); // client connect to server
-static void logIn(int sd, char *name);            // user log in
-static void displayMenu();                        // display UI text
-static void displayName(char *buffer);            // display names from the server
-static void displayMessage(char *message);        // display my messages from the server
-static char getUserChoice();                      // read menu choice from command line
-static int ack(int sd);                           // get acknowledge when log in
-
-
-/****************************************************************
-* Func:   Connect client, user log in, interact with user       *
-* Param:  int argc, arguments count                             *
-*         char *argv[], arguments value                         *
-* Return: 0 normal exit                                         *
-****************************************************************/
-int main(int argc, char *argv[])
-{	
-	char name[NAMELENGTH];    // user's name
-	int sd;
-	char command;             // read from command line
-	
-	// check for command line arguments
-	if (argc != 3)
-	{
-		printf("Usage: client host port\n");
-		exit(1);
-	}
-	
-	sd = connectToServer(argv[1], argv[2]);
-	logIn(sd, name);
-	if(ack(sd) == -1)		// log in error, namely, duplicate log in
-	{
-		printf("User already log in!\n");
-		exit(1);
-	}
-	
-	command = getUserChoice();
-	while(command != '7')    // 7. Exit
-	{
-		switch(command)
-		{
-			case '1':        // display the names of all known users
-			{
-				char *buffer = (char *)malloc(sizeof(char) * (NAMELENGTH * 100));    // maximum known users: 100
-
-				writeStream(sd, "1");
-				readStream(sd, buffer);
-				
-				printf("\nKnown users:\n");
-                displayName(buffer);
-				
-				free(buffer);
-				
-				break;
-			}
-				
-			case '2':         // display the names of all currently connected users
-			{
-				char *buffer = (char *)malloc(sizeof(char) * (NAMELENGTH * 100));     // maximum known users: 100
-
-				writeStream(sd, "2");
-				readStream(sd, buffer);
-				
-				printf("\nCurrently connected users:\n");
-				displayName(buffer);
-				
-				free(buffer);
-				
-				break;
-			}
-			
-			case '3':          // send a text message to a particular user
-			{
-				char *recip = (char *)malloc(sizeof(char) * (NAMELENGTH+1));
-				char *message = (char *)malloc(sizeof(char) * (MESSAGELENGTH+1));
-				
-				writeStream(sd, "3");
-				
-				printf("Enter recipient's name: ");      // get recipient from command line
-				fgets(recip, NAMELENGTH, stdin);
-				recip[strlen(recip)-1] = '\0';
-				
-				printf("Enter a message: ");
-				fgets(message, MESSAGELENGTH, stdin);    // get a message from command line
-				message[strlen(message)-1] = '\0';
-				
-				writeStream(sd, recip);                  // send to server
-				writeStream(sd, message);
-				
-				free(recip);
-				free(message);
-			}
-				break;
-				
-			case '4':          // send a text message to all currently connected users
-			{
-				char *message = (char *)malloc(sizeof(char) * (MESSAGELENGTH+1));
-				
-				writeStream(sd, "4");
-				
-				printf("Enter a message: ");             // get a message from command line
-				fgets(message, MESSAGELENGTH, stdin);
-				message[strlen(message)-1] = '\0';
-				
-				writeStream(sd, message);                // send the message to server
-				
-				free(message);
-			}
-				break;
-			
-			case '5':          // send a text message to all known users
-			{
-				char *message = (char *)malloc(sizeof(char) * (MESSAGELENGTH+1));
-				
-				writeStream(sd, "5");
-				
-				printf("Enter a message: ");
-				fgets(message, MESSAGELENGTH, stdin);     // get a message from command line
-				message[strlen(message)-1] = '\0';
-				
-				writeStream(sd, message);                 // send the message to server
-				
-				free(message);
-			}
-				break;
-				
-			case '6':          // Get my messages
-			{
-				char *message = (char *)malloc(sizeof(char) * (MESSAGESIZE * (MESSAGELENGTH + NAMELENGTH + 20)));
-
-				writeStream(sd, "6");
-				
-				readStream(sd, message);
-				
-				displayMessage(message);
-				
-				free(message);
-			}
-				break;
-				
-			default:
-				printf("%c, Invalid command, retry!\n", command);
-				break;
-		}
-		// read next command
-		command = getUserChoice();
-	}
-	
-	writeStream(sd, "7");      // Inform the server that I'm log out
-	
-	close(sd);                 // close the socket
-}
-
-
-/****************************************************************
-* Func:   Connect to server using socket                        *
-* Param:  char *hn, host name from command line                 *
-*         char *port_name, port name from command line          *
-* Return: int sd, socket description                            *
-****************************************************************/
-int connectToServer(char *hn, char *port_name)
-{
-	char hostname[NAMELENGTH];
-	int sd;
-	int port;
-	int count;
-	struct sockaddr_in pin;
-	struct hostent *hp;
-	
-	strncpy(hostname, hn, sizeof(hostname));    // get host name
-	hostname[NAMELENGTH-1] = '\0';
-	port = atoi(port_name);                     // get port
-	
-	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)    // create an Internet domain stream socket
-	{
-		perror("Error creating socket");
-		exit(1);
-	}
-	
-	if ((hp = gethostbyname(hostname)) == 0)             // lookup host machine information
-	{
-		perror("Error on gethostname call\n");
-		exit(1);
-	}
-	
-	// fill in the socket address structure with host information
-	memset(&pin, 0, sizeof(pin));
-	pin.sin_family = AF_INET;
-	pin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
-	pin.sin_port = htons(port);                                      // convert to network byte order
-	
-	printf("Connecting to %s: %d\n\n", hostname, port);
-	
-	if (connect(sd, (struct sockaddr *) &pin, sizeof(pin)) == -1)    // connect to port on host
-	{
-		perror("Error on connect call\n");
-		exit(1);
-	}
-	
-	return sd;
-}
-
-
-/****************************************************************
-* Func:   User log in                                           *
-* Param:  int sd, socket description                            *
-*         char *name, user name from command line               *
-* Return: none                                                  *
-****************************************************************/
-void logIn(int sd, char *name)
-{
-	printf("Enter your name: ");      // get user name
-	fgets(name, NAMELENGTH, stdin);
-	name[strlen(name)-1] = '\0';
-
-	writeStream(sd, name);            // log in
-}
-
-
-/****************************************************************
-* Func:   Display UI text                                       *
-* Param:  none                                                  *
-* Return: none                                                  *
-****************************************************************/
-void displayMenu()
-{
-	char *menu[MENUSIZE] = {"1. Display the names of all known users.",
-	                        "2. Display the names of all currently connected users.",
-							"3. Send a text message to a particular user.",
-							"4. Send a text message to all currently connected users.",
-							"5. Send a text message to all known users.",
-							"6. Get my messages.",
-							"7. Exit."};
-	int i;
-	
-	printf("\n");
-	for(i = 0; i < MENUSIZE; i++)
-		printf("%s\n", menu[i]);
-	printf("Enter your choice: ");
-}
-
-/****************************************************************
-* Func:   Output names received from server                     *
-* Param:  char *buffer, content to be displayed                 *
-* Return: none                                                  *
-****************************************************************/
-void displayName(char *buffer)
-{
-    int i=0, count = 1;
-
-    printf("  %d. ", count++);
-    while(buffer[i]!='\0')
-    {
-        printf("%c", buffer[i]);
-        if(buffer[i] == '\n' && buffer[i+1] != '\0')
-			printf("  %d. ", count++);
-	
-	    i++;
-    }
-	printf("\n");
-}
-
-/****************************************************************
-* Func:   Output messages received from user                    *
-* Param:  char *message, content to be displayed                *
-* Return: none                                                  *
-****************************************************************/
-void displayMessage(char *message)
-{
-    int i=0, count = 1;
-
-    // Format output
-	printf("\nYour messages:\n");
-	
-    printf("  %d. From ", count++);
-    while(message[i]!='\0')
-    {
-        printf("%c", message[i]);
-        if(message[i] == '\n' && message[i+1] != '\0')
-			printf("  %d. From ", count++);
-	
-	    i++;
-    }
-	printf("\n");
-}
-
-
-/****************************************************************
-* Func:   Get the acknowledge when user try to log in           *
-* Param:  int sd, socket description                            *
-* Return: 0 log in success                                      *
-*         1 log in failure (duplicate log in)                   *
-****************************************************************/
-int ack(int sd)
-{
-	int result = 0;
-	char *buffer = (char *)malloc(sizeof(char) * BUFFERSIZE);  // 'E\0' or 'S\0'
-	
-	readStream(sd, buffer);      // read log in result: 'E': error, 'S': success
-	
-	if(buffer[0] == 'E')
-	{
-		result = -1;
-	}
-	free(buffer);
-	
-	return result;
-}
-
-
-/****************************************************************
-* Func:   Get user choice from command line                     *
-* Param:  none                                                  *
-* Return: char, user choice                                     *
-****************************************************************/
-char getUserChoice()
-{
-	char tmp;
-	char *buffer = (char *)malloc(sizeof(char) * BUFFERSIZE);
-	
-	displayMenu();                      // UI
-	
-	fgets(buffer, BUFFERSIZE, stdin);   // read user choice from command line
-	tmp = buffer[0];
-	
-	free(buffer);
-	
-	return tmp;
-}
\ No newline at end of file
+/**********************************************************************************************
+***********************************************************************************************
+**  Created by Yiheng Gao, 4/16/2018, for project 3                                          **
+**                                                                                           **
+**  Client for network communication using sockets                                           **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        int connectToServer(char *hn, char *port);  // client connect to server            **
+**        void logIn(int sd, char *name, int push);   // user log in                         **
+**        void displayMenu();                         // display UI text                     **
+**        int displayName(char *buffer, int count);   // display the message from server     **
+**        int displayMessage(char *message, int count, unsigned long long *cursor);          **
+**                                                    // display a chunk of my messages      **
+**        void getMessages(int sd, char *reply);      // fetch and ack my messages in chunks **
+**        char getUserChoice();                       // read user choice from command line  **
+**        int ack(int sd);                            // get acknowledge when log in         **
+**        int sendBatch(int sd, char **recip, char **message, int count);                    **
+**                                                    // send many messages in few frames    **
+**        void sendBatchFile(int sd, char *file);     // send messages listed in a file      **
+**        void* receiveThread(void *arg);             // read sd, show pushes, answer pings  **
+**        int readReply(int sd, char *content, int size, int *more);                         **
+**                                                    // wait for the reply to a request     **
+**        void displayPush(char *message);            // display messages pushed by server   **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <string.h>
+#include <pthread.h>
+
+#define BUFFERSIZE		100		
+#define NAMELENGTH		80      // each name is 80 characters maximum 
+#define MENUSIZE		7       // 7 choices total for menu
+#define MESSAGELENGTH	80      // 80 characters maximum for each message
+#define MESSAGESIZE		10		// 10 messages max for a user
+#define BATCHSIZE		65536	// max characters for a batch frame (v2)
+#define V1MAXLENGTH		999		// max characters for a v1 frame
+#define BATCHCOUNT		1000	// messages read from a batch file at a time
+#define FRAMEMAX		(1 << 20)	// max characters for a v2 frame
+#define OP_PUSH			1		// v2 frame type of messages pushed by the server
+#define OP_PING			2		// v2 frame type of a ping from the server, the connection was idle
+#define OP_PONG			3		// v2 frame type of the answer to a ping
+#define FLAG_MORE		1		// v2 flags: a fragment, more of the reply follows ("CHUNK" log in option)
+#define CHUNKSIZE		16384	// max characters of a fragment of a large reply
+#define REPLYSIZE		(CHUNKSIZE + 1)	// largest reply read by the menu: a fragment of a user list, or FETCHV2 messages
+#define FETCHV1			4		// messages fetched at a time with v1 frames, 4 long ones fit in 999 characters
+#define FETCHV2			32		// messages fetched at a time with v2 frames
+
+typedef struct Reply{
+	char *content;
+	int more;                   // FLAG_MORE: the rest of the reply follows
+	struct Reply *next;
+} Reply;                        // reply read by the receive thread, waiting for readReply
+
+static int receiving = 0;       // 1: v2 server, the receive thread reads sd
+static pthread_t receiver;
+static Reply *replyHead, *replyTail;
+static int replyClosed = 0;     // 1: connection lost, no more replies
+static pthread_mutex_t replyLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replyReady = PTHREAD_COND_INITIALIZER;
+
+extern int writeStream(int sd, char *content);    // external function declare from communicate.c
+extern int readStream(int sd, char *content);     // external function declare from communicate.c
+extern int readFrame(int sd, int *opcode, int *flags, char *content, int size);    // external function declare from communicate.c
+extern int pushFrame(int sd, int opcode, char *content, int len);    // external function declare from communicate.c
+extern void streamSetVersion(int sd, int version);    // external function declare from communicate.c
+extern void streamClose(int sd);                  // external function declare from communicate.c
+extern int streamVersion(int sd);                 // external function declare from communicate.c
+extern void streamCork(int sd);                   // external function declare from communicate.c
+extern int streamFlush(int sd);                   // external function declare from communicate.c
+extern void streamCompress(int sd);               // external function declare from communicate.c
+
+static int connectToServer(char *hn, char *port); // client connect to server
+static void logIn(int sd, char *name, int push); // user log in
+static void displayMenu();                        // display UI text
+static int displayName(char *buffer, int count);  // display names from the server
+static int displayMessage(char *message, int count, unsigned long long *cursor);    // display a chunk of my messages
+static void getMessages(int sd, char *reply);     // fetch and ack my messages in chunks
+static char getUserChoice();                      // read menu choice from command line
+static int ack(int sd);                           // get acknowledge when log in
+static int sendBatch(int sd, char **recip, char **message, int count);    // send many messages in few frames
+static void sendBatchFile(int sd, char *file);    // send messages listed in a file
+static void* receiveThread(void *arg);            // read sd, show pushed messages, answer pings
+static int readReply(int sd, char *content, int size, int *more);    // wait for the reply to a request
+static void displayPush(char *message);           // display messages pushed by server
+
+
+/****************************************************************
+* Func:   Connect client, user log in, interact with user       *
+* Param:  int argc, arguments count                             *
+*         char *argv[], arguments value                         *
+* Return: 0 normal exit                                         *
+****************************************************************/
+int main(int argc, char *argv[])
+{	
+	char name[NAMELENGTH];    // user's name
+	int sd;
+	char command;             // read from command line
+	int push = 0;             // 1: ask the server to push my messages
+	char reply[REPLYSIZE];    // reply to '1', '2' or '6', reused by every request
+	int more, count;          // a fragment of the reply, more follows; names shown
+	char recip[NAMELENGTH+1];
+	char message[MESSAGELENGTH+1];
+	
+	// check for command line arguments
+	if(argc > 1 && strcmp(argv[1], "-p") == 0)
+	{
+		push = 1;
+		argv++;
+		argc--;
+	}
+	if (argc != 3 && argc != 4)
+	{
+		printf("Usage: client [-p] host port [batch file]\n");
+		exit(1);
+	}
+	
+	sd = connectToServer(argv[1], argv[2]);
+	logIn(sd, name, push);
+	switch(ack(sd))
+	{
+		case -1:		// log in error, namely, duplicate log in
+			printf("User already log in!\n");
+			exit(1);
+		case -2:		// too many connections
+			printf("Server busy, try again later!\n");
+			exit(1);
+	}
+	
+	if(argc == 4)            // bulk sender: send the file, no menu
+	{
+		sendBatchFile(sd, argv[3]);
+		writeStream(sd, "7");
+		streamFlush(sd);                 // corked by sendBatch, the receive thread does not flush it
+		if(receiving)
+			pthread_join(receiver, NULL);    // server closes after "7"
+		streamClose(sd);
+		exit(0);
+	}
+	
+	command = getUserChoice();
+	while(command != '7')    // 7. Exit
+	{
+		switch(command)
+		{
+			case '1':        // display the names of all known users
+			{
+				writeStream(sd, "1");
+				
+				printf("\nKnown users:\n");
+				count = 1;
+				do                  // a long list comes in fragments
+				{
+					if(readReply(sd, reply, REPLYSIZE, &more) == -1)
+						break;
+					count = displayName(reply, count);
+				} while(more);
+				printf("\n");
+				
+				break;
+			}
+				
+			case '2':         // display the names of all currently connected users
+			{
+				writeStream(sd, "2");
+				
+				printf("\nCurrently connected users:\n");
+				count = 1;
+				do
+				{
+					if(readReply(sd, reply, REPLYSIZE, &more) == -1)
+						break;
+					count = displayName(reply, count);
+				} while(more);
+				printf("\n");
+				
+				break;
+			}
+			
+			case '3':          // send a text message to a particular user
+			{
+				writeStream(sd, "3");
+				
+				printf("Enter recipient's name: ");      // get recipient from command line
+				fgets(recip, NAMELENGTH, stdin);
+				recip[strlen(recip)-1] = '\0';
+				
+				printf("Enter a message: ");
+				fgets(message, MESSAGELENGTH, stdin);    // get a message from command line
+				message[strlen(message)-1] = '\0';
+				
+				writeStream(sd, recip);                  // send to server
+				writeStream(sd, message);
+			}
+				break;
+				
+			case '4':          // send a text message to all currently connected users
+			{
+				writeStream(sd, "4");
+				
+				printf("Enter a message: ");             // get a message from command line
+				fgets(message, MESSAGELENGTH, stdin);
+				message[strlen(message)-1] = '\0';
+				
+				writeStream(sd, message);                // send the message to server
+			}
+				break;
+			
+			case '5':          // send a text message to all known users
+			{
+				writeStream(sd, "5");
+				
+				printf("Enter a message: ");
+				fgets(message, MESSAGELENGTH, stdin);     // get a message from command line
+				message[strlen(message)-1] = '\0';
+				
+				writeStream(sd, message);                 // send the message to server
+			}
+				break;
+				
+			case '6':          // Get my messages
+			{
+				getMessages(sd, reply);    // in chunks, a message is removed once it is shown
+			}
+				break;
+				
+			default:
+				printf("%c, Invalid command, retry!\n", command);
+				break;
+		}
+		// read next command
+		command = getUserChoice();
+	}
+	
+	writeStream(sd, "7");      // Inform the server that I'm log out
+	if(receiving)
+		pthread_join(receiver, NULL);    // server closes after "7"
+	
+	streamClose(sd);           // close the socket
+}
+
+
+/****************************************************************
+* Func:   Connect to server using socket                        *
+* Param:  char *hn, host name from command line                 *
+*         char *port_name, port name from command line          *
+* Return: int sd, socket description                            *
+****************************************************************/
+int connectToServer(char *hn, char *port_name)
+{
+	char hostname[NAMELENGTH];
+	int sd;
+	int port;
+	struct sockaddr_in pin;
+	struct hostent *hp;
+	
+	strncpy(hostname, hn, sizeof(hostname));    // get host name
+	hostname[NAMELENGTH-1] = '\0';
+	port = atoi(port_name);                     // get port
+	
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)    // create an Internet domain stream socket
+	{
+		perror("Error creating socket");
+		exit(1);
+	}
+	
+	if ((hp = gethostbyname(hostname)) == 0)             // lookup host machine information
+	{
+		perror("Error on gethostname call\n");
+		exit(1);
+	}
+	
+	// fill in the socket address structure with host information
+	memset(&pin, 0, sizeof(pin));
+	pin.sin_family = AF_INET;
+	pin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
+	pin.sin_port = htons(port);                                      // convert to network byte order
+	
+	printf("Connecting to %s: %d\n\n", hostname, port);
+	
+	if (connect(sd, (struct sockaddr *) &pin, sizeof(pin)) == -1)    // connect to port on host
+	{
+		perror("Error on connect call\n");
+		exit(1);
+	}
+	
+	return sd;
+}
+
+
+/****************************************************************
+* Func:   User log in                                           *
+* Param:  int sd, socket description                            *
+*         char *name, user name from command line               *
+*         int push, 1: ask the server to push my messages       *
+* Return: none                                                  *
+****************************************************************/
+void logIn(int sd, char *name, int push)
+{
+	char login[NAMELENGTH + 20];
+	
+	printf("Enter your name: ");      // get user name
+	fgets(name, NAMELENGTH, stdin);
+	name[strlen(name)-1] = '\0';
+
+	sprintf(login, "%s\nV2\nCHUNK\nLZ%s", name, push ? "\nPUSH" : "");   // log in, ask for binary frames, large replies in fragments and compressed
+	writeStream(sd, login);
+}
+
+
+/****************************************************************
+* Func:   Display UI text                                       *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void displayMenu()
+{
+	char *menu[MENUSIZE] = {"1. Display the names of all known users.",
+	                        "2. Display the names of all currently connected users.",
+							"3. Send a text message to a particular user.",
+							"4. Send a text message to all currently connected users.",
+							"5. Send a text message to all known users.",
+							"6. Get my messages.",
+							"7. Exit."};
+	int i;
+	
+	printf("\n");
+	for(i = 0; i < MENUSIZE; i++)
+		printf("%s\n", menu[i]);
+	printf("Enter your choice: ");
+}
+
+/****************************************************************
+* Func:   Output names received from server, a list may come in *
+*         fragments cut at line ends                            *
+* Param:  char *buffer, content to be displayed                 *
+*         int count, number of the first name                   *
+* Return: int, number of the name after the last one shown      *
+****************************************************************/
+int displayName(char *buffer, int count)
+{
+    int i=0;
+
+    while(buffer[i]!='\0')
+    {
+        if(i == 0 || buffer[i-1] == '\n')
+			printf("  %d. ", count++);
+        printf("%c", buffer[i]);
+	
+	    i++;
+    }
+	
+	return count;
+}
+
+/****************************************************************
+* Func:   Output a chunk of messages fetched from the server    *
+* Param:  char *message, "position name, time, text" lines, a   *
+*                        line cut short is not shown            *
+*         int count, number of the first message                *
+*         unsigned long long *cursor, moved past each message   *
+*                                     shown                     *
+* Return: int, number of the next message                       *
+****************************************************************/
+int displayMessage(char *message, int count, unsigned long long *cursor)
+{
+	char *end;
+
+	while((end = strchr(message, '\n')) != NULL)
+	{
+		*cursor = strtoull(message, &message, 10) + 1;
+		*end = '\0';
+		printf("  %d. From %s\n", count++, message + 1);
+		message = end + 1;
+	}
+
+	return count;
+}
+
+/****************************************************************
+* Func:   Get my messages: fetch a chunk from a cursor, show    *
+*         it, ack it, until none is left. What was not acked,   *
+*         e.g. the connection dropped, is fetched again later   *
+* Param:  int sd, socket description                            *
+*         char *reply, REPLYSIZE characters for each chunk      *
+* Return: none                                                  *
+****************************************************************/
+void getMessages(int sd, char *reply)
+{
+	char request[BUFFERSIZE];
+	char *line;
+	unsigned long long cursor = 0, next, shown;    // cursor 0: the oldest message the server holds
+	int max = streamVersion(sd) == 2 ? FETCHV2 : FETCHV1;
+	int left, count = 1;
+
+	printf("\nYour messages:\n");
+	do
+	{
+		sprintf(request, "f\n%llu\n%d", cursor, max);
+		writeStream(sd, request);
+		if(readReply(sd, reply, REPLYSIZE, NULL) == -1)
+			break;
+		next = strtoull(reply, &line, 10);     // the server would go on from here
+		left = strtol(line, &line, 10);        // messages after next
+		shown = cursor;
+		count = displayMessage(line + 1, count, &cursor);
+		if(cursor == shown)                    // nothing new
+			break;
+		sprintf(request, "a\n%llu", cursor);
+		writeStream(sd, request);
+	} while(left > 0 || cursor < next);        // more, or the reply was cut short
+	printf("\n");
+}
+
+/****************************************************************
+* Func:   Get the acknowledge when user try to log in, start    *
+*         the receive thread if the server speaks v2 frames     *
+* Param:  int sd, socket description                            *
+* Return: 0 log in success                                      *
+*         -1 log in failure (duplicate log in)                  *
+*         -2 server busy, too many connections                  *
+****************************************************************/
+int ack(int sd)
+{
+	int result = 0;
+	char *buffer = (char *)malloc(sizeof(char) * BUFFERSIZE);  // 'E\0', 'S\0', or "S\nV2" and the options granted
+	
+	// read log in result: 'E': error, 'S': success
+	if(readFrame(sd, NULL, NULL, buffer, BUFFERSIZE) == -1)
+	{
+		result = -1;
+	}
+	else if(strcmp(buffer, "E\nBUSY") == 0)    // too many connections
+	{
+		result = -2;
+	}
+	else if(buffer[0] == 'E')
+	{
+		result = -1;
+	}
+	else if(strncmp(buffer, "S\nV2", 4) == 0 && (buffer[4] == '\0' || buffer[4] == '\n'))    // server speaks binary frames
+	{                                          // (and pushes my messages, "PUSH"), old servers reply 'S'
+		static int receiverSd;
+		
+		streamSetVersion(sd, 2);
+		if(strstr(buffer, "\nLZ") != NULL)     // server agreed to compress, so do my batches
+			streamCompress(sd);
+		receiving = 1;                         // pings are answered while the menu waits for input
+		receiverSd = sd;
+		if(pthread_create(&receiver, NULL, receiveThread, &receiverSd) != 0)
+		{
+			printf("Create receive thread\n");
+			exit(1);
+		}
+	}
+	free(buffer);
+	
+	return result;
+}
+
+
+/****************************************************************
+* Func:   Get user choice from command line                     *
+* Param:  none                                                  *
+* Return: char, user choice                                     *
+****************************************************************/
+char getUserChoice()
+{
+	char tmp;
+	char *buffer = (char *)malloc(sizeof(char) * BUFFERSIZE);
+	
+	displayMenu();                      // UI
+	
+	fgets(buffer, BUFFERSIZE, stdin);   // read user choice from command line
+	tmp = buffer[0];
+	
+	free(buffer);
+	
+	return tmp;
+}
+
+
+/****************************************************************
+* Func:   Send messages for particular users, as many as fit    *
+*         in each frame, all frames before reading the replies  *
+* Param:  int sd, socket description                            *
+*         char **recip, recipients' names                       *
+*         char **message, one message for each recipient        *
+*         int count, number of messages                         *
+* Return: int, number of messages the server recorded           *
+*         -1 connection lost                                    *
+****************************************************************/
+int sendBatch(int sd, char **recip, char **message, int count)
+{
+	int maxLen = streamVersion(sd) == 2 ? BATCHSIZE - 1 : V1MAXLENGTH;
+	char *frame = (char *)malloc(sizeof(char) * (maxLen + 1));
+	char reply[BUFFERSIZE];
+	int i = 0, frames = 0, recorded = 0;
+	
+	streamCork(sd);                    // frames leave together
+	while(i < count)
+	{
+		int len = sprintf(frame, "b");  // format: "b\nrecipient\nmessage\nrecipient\nmessage..."
+		
+		while(i < count && len + strlen(recip[i]) + strlen(message[i]) + 2 <= maxLen)
+		{
+			len += sprintf(frame + len, "\n%s\n%s", recip[i], message[i]);
+			i++;
+		}
+		if(len == 1)                   // a message that never fits, skip it
+		{
+			i++;
+			continue;
+		}
+		writeStream(sd, frame);
+		frames++;
+	}
+	free(frame);
+	if(streamFlush(sd) == -1)
+		return -1;
+	
+	for(; frames > 0; frames--)         // one reply for each frame: recorded messages
+	{
+		if(readReply(sd, reply, BUFFERSIZE, NULL) == -1)
+			return -1;
+		recorded += atoi(reply);
+	}
+	
+	return recorded;
+}
+
+
+/****************************************************************
+* Func:   Send the messages listed in a file                    *
+*         format: one "recipient<TAB>message" per line          *
+* Param:  int sd, socket description                            *
+*         char *file, file name                                 *
+* Return: none                                                  *
+****************************************************************/
+void sendBatchFile(int sd, char *file)
+{
+	FILE *fp;
+	char *recip[BATCHCOUNT], *message[BATCHCOUNT];
+	char line[NAMELENGTH + MESSAGELENGTH + 2];
+	int count = 0, total = 0, recorded = 0, result, i;
+	
+	if((fp = fopen(file, "r")) == NULL)
+	{
+		perror("Error on open batch file\n");
+		return;
+	}
+	
+	while(1)
+	{
+		char *tab;
+		int eof = fgets(line, sizeof(line), fp) == NULL;
+		
+		if(!eof && (tab = strchr(line, '\t')) != NULL)
+		{
+			*tab++ = '\0';
+			tab[strcspn(tab, "\n")] = '\0';
+			recip[count] = strdup(line);
+			message[count] = strdup(tab);
+			count++;
+		}
+		
+		if(count == BATCHCOUNT || (eof && count > 0))
+		{
+			if((result = sendBatch(sd, recip, message, count)) == -1)
+				eof = 1;               // connection lost
+			else
+				recorded += result;
+			total += count;
+			for(i = 0; i < count; i++)
+			{
+				free(recip[i]);
+				free(message[i]);
+			}
+			count = 0;
+		}
+		if(eof)
+			break;
+	}
+	fclose(fp);
+	
+	printf("%d of %d messages sent.\n", recorded, total);
+}
+
+
+/****************************************************************
+* Func:   Receive thread (v2 server): the only reader of sd,    *
+*         shows pushed messages, answers pings, hands replies   *
+*         to readReply                                          *
+* Param:  void *arg, socket description (int *)                 *
+* Return: none                                                  *
+****************************************************************/
+void* receiveThread(void *arg)
+{
+	int sd = *((int *)arg);
+	char *frame = (char *)malloc(sizeof(char) * (FRAMEMAX + 1));
+	int opcode, flags;
+	
+	while(readFrame(sd, &opcode, &flags, frame, FRAMEMAX + 1) != -1)
+	{
+		if(opcode == OP_PUSH)
+		{
+			displayPush(frame);
+		}
+		else if(opcode == OP_PING)
+		{
+			pushFrame(sd, OP_PONG, "", 0);   // not held by the cork of the main thread
+		}
+		else                               // reply to a request of the main thread
+		{
+			Reply *reply = (Reply *)malloc(sizeof(Reply));
+			
+			reply->content = strdup(frame);
+			reply->more = flags & FLAG_MORE;
+			reply->next = NULL;
+			pthread_mutex_lock(&replyLock);
+			if(replyTail == NULL)
+				replyHead = reply;
+			else
+				replyTail->next = reply;
+			replyTail = reply;
+			pthread_cond_signal(&replyReady);
+			pthread_mutex_unlock(&replyLock);
+		}
+	}
+	free(frame);
+	
+	pthread_mutex_lock(&replyLock);        // connection lost, nobody waits forever
+	replyClosed = 1;
+	pthread_cond_broadcast(&replyReady);
+	pthread_mutex_unlock(&replyLock);
+	
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Wait for the reply to a request                       *
+* Param:  int sd, socket description                            *
+*         char *content, content to be written, size chars,     *
+*                        longer content is cut                  *
+*         int size, size of content                             *
+*         int *more, 1: a fragment, the rest of the reply       *
+*                    follows (NULL to ignore)                   *
+* Return: int, length of content                                *
+*         -1 connection closed or error                         *
+****************************************************************/
+int readReply(int sd, char *content, int size, int *more)
+{
+	Reply *reply;
+	int len, flags = 0;
+	
+	if(!receiving)                         // no receive thread, read sd directly
+	{
+		len = readFrame(sd, NULL, &flags, content, size);
+		if(more != NULL)
+			*more = flags & FLAG_MORE;
+		return len;
+	}
+	
+	pthread_mutex_lock(&replyLock);
+	while(replyHead == NULL && !replyClosed)
+		pthread_cond_wait(&replyReady, &replyLock);
+	if((reply = replyHead) != NULL)
+	{
+		if((replyHead = reply->next) == NULL)
+			replyTail = NULL;
+	}
+	pthread_mutex_unlock(&replyLock);
+	
+	if(reply == NULL)
+		return -1;
+	
+	if(more != NULL)
+		*more = reply->more;
+	strncpy(content, reply->content, size - 1);
+	content[size - 1] = '\0';
+	len = strlen(content);
+	free(reply->content);
+	free(reply);
+	
+	return len;
+}
+
+
+/****************************************************************
+* Func:   Output messages pushed by the server                  *
+* Param:  char *message, content to be displayed                *
+* Return: none                                                  *
+****************************************************************/
+void displayPush(char *message)
+{
+	char *line = message, *end;
+
+	printf("\nNew messages:\n");
+	while(*line != '\0')
+	{
+		end = strchr(line, '\n');
+		if(end != NULL)
+			*end = '\0';
+		printf("  From %s\n", line);
+		if(end == NULL)
+			break;
+		line = end + 1;
+	}
+	fflush(stdout);                        // shown while the menu waits for input
+}
@@ -1,74 +1,1339 @@
-/**********************************************************************************************
-***********************************************************************************************
-**  Created by Yiheng Gao, 4/16/2018, for project 3                                          **
-**                                                                                           **
-**  read/write for network communication using sockets                                       **
-**                                                                                           **
-**  Functions:                                                                               **
-**    - External:                                                                            **
-**        int writeSream(int sd, char *content);      // write to sd                         **
-**        int readStream(int sd, char *content);      // read from sd                        **
-**                                                                                           **
-***********************************************************************************************
-**********************************************************************************************/
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-
-#define MAX_MESSAGE 80			// 80 characters max for a message
-
-
-extern int writeSream(int sd, char *content);
-extern int readStream(int sd, char *content);
-
-
-/****************************************************************
-* Func:   Write to sd                                           *
-*         format: 3 chars for length of the content             *
-*                 rest chars would be the content itself        *
-* Param:  int sd, socket description                            *
-*         char *content, content to be write                    *
-* Return: 0 success                                             *
-****************************************************************/
-int writeStream(int sd, char *content)
-{
-	int count = 0;
-	
-	// create package
-	int len = strlen(content);		
-	char *message = (char *)malloc(sizeof(char) * (len + 3 + 1));	  // last one should be '\0'
-	sprintf(message, "%3d%s", len, content);
-	
-	// send package
-	while((count += write(sd, message, strlen(message))) != strlen(message));
-	
-	free(message);
-	
-	return 0;
-}
-
-
-/****************************************************************
-* Func:   Read from sd                                          *
-* Param:  int sd, socket description                            *
-*         char *content, content to be written                  *
-* Return: 0 success                                             *
-****************************************************************/
-int readStream(int sd, char *content)
-{
-	char len_char[3];
-	int len;
-	int len_count = 0, count = 0;
-
-	// get the length of the message
-	while((len_count += read(sd, len_char, 3)) != 3);        // read first 3 character
-	len = atoi(len_char);                                    // get length of the message
-	
-	// read the content
-	while((count += read(sd, content, len)) != len);
-	content[len] = '\0';			                         // add EOF for string
-	
-	return 0;
-}
\ No newline at end of file
+/**********************************************************************************************
+***********************************************************************************************
+**  Created by Yiheng Gao, 4/16/2018, for project 3                                          **
+**                                                                                           **
+**  read/write for network communication using sockets                                       **
+**                                                                                           **
+**  Frame formats:                                                                           **
+**    - v1: 3 ASCII chars for length of the content, then the content (max 999 chars)        **
+**    - v2: 4 bytes length (network byte order), 1 byte opcode, 1 byte flags, then the       **
+**          content. Negotiated at log in, see streamSetVersion.                             **
+**  Every sd has a receive buffer, one read() may bring in many frames and frames are taken  **
+**  out of the buffer one by one. Header and content go out in one sendmsg() without being   **
+**  copied; on a non-blocking sd whatever the socket does not take is queued until           **
+**  streamFlush. A corked sd queues every frame, so replies to pipelined requests leave in   **
+**  one write when the last buffered request is served (or before readFrame would wait);     **
+**  a frame of LARGEFRAME bytes or more flushes the queue and goes out without a copy.       **
+**  writeFrameV/pushFrameV gather the content of a frame from many pieces (a reply made of   **
+**  records kept elsewhere), in one sendmsg of up to GATHERMAX pieces at a time.             **
+**  The send side of an sd has a lock: pushFrame lets another thread (a message sender)      **
+**  write to it while the thread serving the sd reads or replies. Nobody holds it while      **
+**  waiting for a full socket: a blocking writer queues what is left and waits out of the    **
+**  lock, so pushes to a client that does not read are queued instead of waiting.           **
+**  Payloads of any size (writePayload): on a chunked sd ("CHUNK" log in option) one larger  **
+**  than CHUNKSIZE goes out in v2 frames of at most CHUNKSIZE, cut at line ends, every one   **
+**  but the last with FLAG_MORE. Fragments are sent from the caller's pieces; when the       **
+**  socket is full the rest waits in place (not copied) and streamFlush goes on with it as   **
+**  the socket drains, so memory stays at one fragment whatever the size of the payload.     **
+**  Pushes go out between two fragments. Otherwise a payload is one frame, v1 keeps the      **
+**  whole lines that fit in 999 chars.                                                       **
+**  Compression ("LZ" log in option, v2): a frame whose content is LZMIN bytes or more is    **
+**  sent LZ4-style compressed (literal runs and back references of at most 64K, see          **
+**  lzEncode) with FLAG_LZ, when that is shorter; fragments are compressed one by one.       **
+**  Every sd that compresses keeps its hash table from frame to frame, frames only move a    **
+**  base position, so nothing is cleared or allocated per frame. streamNext decompresses     **
+**  whatever carries FLAG_LZ, readers see the content as it was sent.                        **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        int writeSream(int sd, char *content);      // write to sd                         **
+**        int readStream(int sd, char *content);      // read from sd                        **
+**        int writeFrame(int sd, int opcode, int flags, char *content, int len);             **
+**                                                    // write a frame with opcode and flags **
+**        int writeFrameV(int sd, int opcode, int flags, struct iovec *iov, int count);      **
+**                                                    // write a frame gathered from pieces  **
+**        int pushFrame(int sd, int opcode, char *content, int len);                         **
+**                                                    // write now from any thread, no wait  **
+**        int pushFrameV(int sd, int opcode, struct iovec *iov, int count);                  **
+**                                                    // push a frame gathered from pieces   **
+**        int writePayload(int sd, int opcode, char *content, int len,                       **
+**                         void (*release)(void *arg), void *arg);                           **
+**                                                    // write content of any size           **
+**        int writePayloadV(int sd, int opcode, struct iovec *iov, int count,                **
+**                          void (*release)(void *arg), void *arg);                          **
+**                                                    // write pieces of any size            **
+**        int readFrame(int sd, int *opcode, int *flags, char *content, int size);           **
+**                                                    // read a frame with opcode and flags  **
+**        int streamFill(int sd);                     // read what is available, no waiting  **
+**        int streamNext(int sd, int *opcode, int *flags, char *content, int size);          **
+**                                                    // take a received frame, no waiting   **
+**        int streamFlush(int sd);                    // send queued bytes, no waiting       **
+**        void streamCork(int sd);                    // queue frames until streamFlush      **
+**        void streamChunk(int sd);                   // large payloads in fragments         **
+**        int streamBusy(int sd);                     // a payload waits for the socket      **
+**        void streamCompress(int sd);                // compress large frames               **
+**        void streamSetVersion(int sd, int version); // switch frame format                 **
+**        int streamVersion(int sd);                  // current frame format                **
+**        void streamClose(int sd);                   // release buffers and close sd        **
+**        void streamStats(void (*count)(int in, int out));                                  **
+**                                                    // count bytes read and written        **
+**    - Internal:                                                                            **
+**        Stream* streamGet(int sd);                  // buffers of sd, created on first use **
+**        int streamHeader(Stream *st, unsigned char *header, int opcode, int flags,         **
+**                         int *len);                 // frame header for the format of sd   **
+**        int streamCut(Stream *st, unsigned char *header, int opcode, int flags,            **
+**                      struct iovec *iov, int count);                                       **
+**                                                    // header, content cut to fit v1       **
+**        int streamSend(Stream *st, int sd, struct iovec *iov, int count, int sendFlags);   **
+**                                                    // send, queue what is left            **
+**        int streamDrain(Stream *st, int sd, int sendFlags);                                **
+**                                                    // send the queue, caller holds lock   **
+**        void streamQueue(Stream *st, struct iovec *iov, int count);                        **
+**                                                    // append to the send queue            **
+**        int streamFragment(Stream *st, unsigned char *header);                             **
+**                                                    // cut the next fragment of a payload  **
+**        int streamBulk(Stream *st, int sd);         // send fragments while the socket     **
+**                                                    // takes them                          **
+**        void streamSpill(Stream *st);               // queue a copy of the rest of it      **
+**        void streamBulkEnd(Stream *st);             // give the pieces of a payload back   **
+**        int lzPack(Stream *st, struct iovec *iov, int *count);                             **
+**                                                    // compress the content of a frame     **
+**        int lzEncode(Stream *st, unsigned char *src, int len, unsigned char *dst);         **
+**                                                    // LZ4-style block compression         **
+**        unsigned char* lzRun(unsigned char *op, int n);                                    **
+**                                                    // length bytes beyond the token       **
+**        int lzDecode(unsigned char *src, int len, char *dst, int size);                    **
+**                                                    // decompress a block, cut at size     **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#define MAX_MESSAGE 80			// 80 characters max for a message
+#define FRAMESIZE 1000          // readStream buffer: 999 characters max, plus '\0'
+#define V1MAXLENGTH 999         // 3 chars for length
+#define V1HEADER 3
+#define V2HEADER 6              // u32 length, u8 opcode, u8 flags
+#define V2MAXLENGTH (1 << 20)   // larger frames are a protocol error
+#define STREAMBUFSIZE 4096      // initial receive buffer, grows for larger frames
+#define CORKLIMIT 65536         // a corked sd sends once this much is queued
+#define LARGEFRAME 16384        // a larger frame is sent from the caller's buffer, not queued
+#define GATHERMAX 1024          // iovec per sendmsg, IOV_MAX of Linux
+#define STREAMPAGEBITS 10       // buffers are found by sd, in pages of 1024
+#define STREAMPAGESIZE (1 << STREAMPAGEBITS)
+#define STREAMPAGES 1024        // sd up to 1048575
+#define CHUNKSIZE 16384         // max content of a fragment of a large payload
+#define FLAG_MORE 1             // v2 flags: a fragment, more of the payload follows
+#define FLAG_LZ 2               // v2 flags: content is compressed (lzEncode)
+#define LZMIN 256               // smaller content is not worth compressing
+#define LZHASHBITS 12           // hash table of 4096 positions for each sd that compresses
+#define LZMINMATCH 4            // shortest back reference
+#define LZMAXOFFSET 65535       // farthest back reference, 2 bytes
+#define LZLASTLITERALS 12       // no match starts in the last 12 bytes, the last 5 are literals
+
+#define OP_DATA 0               // request or reply of the '1'..'7' protocol
+#define OP_PUSH 1               // messages the server pushes to a subscribed user (v2 only)
+
+typedef struct{
+	int version;                // 1 or 2, frame format
+	char *in;                   // received bytes
+	int inPos;                  // first byte not taken yet
+	int inLen;                  // end of received bytes
+	int inSize;
+	char *out;                  // bytes the socket did not take yet
+	int outPos;
+	int outLen;
+	int outSize;
+	int corked;                 // 1: queue frames until streamFlush
+	int chunked;                // 1: payloads larger than CHUNKSIZE go out in fragments
+	struct iovec *bulk;         // pieces of a payload the socket did not take yet, then room
+	int bulkNext;               // to gather a fragment; first piece not sent
+	int bulkCount;              // pieces
+	int bulkLeft;               // bytes not sent
+	int bulkOpcode;
+	void (*bulkRelease)(void *arg);    // gives the pieces back once sent, NULL: none
+	void *bulkArg;
+	uint32_t *lzTable;          // compression: hash -> lzPos based position, NULL: not compressed
+	uint32_t lzPos;             // base position of the next frame, older entries fail the checks
+	unsigned char *lzIn;        // content gathered from pieces
+	unsigned char *lzOut;       // compressed content
+	int lzInSize, lzOutSize;
+	pthread_mutex_t sendLock;   // out queue, bulk and sending, the reader of sd does not need it
+} Stream;
+
+static _Atomic(_Atomic(Stream *) *) streamPage[STREAMPAGES];    // Stream of each sd, read by pushing threads too
+static void (*byteCount)(int in, int out);             // streamStats, NULL: not counted
+
+
+extern int writeSream(int sd, char *content);
+extern int readStream(int sd, char *content);
+extern int writeFrame(int sd, int opcode, int flags, char *content, int len);
+extern int writeFrameV(int sd, int opcode, int flags, struct iovec *iov, int count);
+extern int pushFrame(int sd, int opcode, char *content, int len);
+extern int pushFrameV(int sd, int opcode, struct iovec *iov, int count);
+extern int writePayload(int sd, int opcode, char *content, int len, void (*release)(void *arg), void *arg);
+extern int writePayloadV(int sd, int opcode, struct iovec *iov, int count, void (*release)(void *arg), void *arg);
+extern int readFrame(int sd, int *opcode, int *flags, char *content, int size);
+extern int streamFill(int sd);
+extern int streamNext(int sd, int *opcode, int *flags, char *content, int size);
+extern int streamFlush(int sd);
+extern void streamCork(int sd);
+extern void streamChunk(int sd);
+extern int streamBusy(int sd);
+extern void streamCompress(int sd);
+extern void streamSetVersion(int sd, int version);
+extern int streamVersion(int sd);
+extern void streamClose(int sd);
+extern void streamStats(void (*count)(int in, int out));
+static Stream* streamGet(int sd);
+static int streamHeader(Stream *st, unsigned char *header, int opcode, int flags, int *len);
+static int streamCut(Stream *st, unsigned char *header, int opcode, int flags, struct iovec *iov, int count);
+static int streamSend(Stream *st, int sd, struct iovec *iov, int count, int sendFlags);
+static int streamDrain(Stream *st, int sd, int sendFlags);
+static void streamQueue(Stream *st, struct iovec *iov, int count);
+static int streamFragment(Stream *st, unsigned char *header);
+static int streamBulk(Stream *st, int sd);
+static void streamSpill(Stream *st);
+static void streamBulkEnd(Stream *st);
+static int lzPack(Stream *st, struct iovec *iov, int *count);
+static int lzEncode(Stream *st, unsigned char *src, int len, unsigned char *dst);
+static unsigned char* lzRun(unsigned char *op, int n);
+static int lzDecode(unsigned char *src, int len, char *dst, int size);
+
+
+/****************************************************************
+* Func:   Write to sd                                           *
+*         format: 3 chars for length of the content             *
+*                 rest chars would be the content itself        *
+*         (v2 format once negotiated)                           *
+* Param:  int sd, socket description                            *
+*         char *content, content to be write                    *
+* Return: 0 success                                             *
+*         -1 error                                              *
+****************************************************************/
+int writeStream(int sd, char *content)
+{
+	return writeFrame(sd, OP_DATA, 0, content, strlen(content));
+}
+
+
+/****************************************************************
+* Func:   Read from sd                                          *
+* Param:  int sd, socket description                            *
+*         char *content, content to be written, FRAMESIZE chars *
+* Return: 0 success                                             *
+*         -1 connection closed or error                         *
+****************************************************************/
+int readStream(int sd, char *content)
+{
+	return readFrame(sd, NULL, NULL, content, FRAMESIZE) == -1 ? -1 : 0;
+}
+
+
+/****************************************************************
+* Func:   Write a frame, header and content in one sendmsg      *
+* Param:  int sd, socket description                            *
+*         int opcode, frame type (v2 only)                      *
+*         int flags, frame flags (v2 only)                      *
+*         char *content, content to be write                    *
+*         int len, length of the content                        *
+* Return: 0 success (or queued on a non-blocking sd)            *
+*         -1 error                                              *
+****************************************************************/
+int writeFrame(int sd, int opcode, int flags, char *content, int len)
+{
+	struct iovec iov[2];
+	
+	iov[1].iov_base = content;
+	iov[1].iov_len = len;
+	
+	return writeFrameV(sd, opcode, flags, iov, 2);
+}
+
+
+/****************************************************************
+* Func:   Write a frame whose content is gathered from pieces,  *
+*         header and pieces in one sendmsg; the pieces are not  *
+*         used any more once it returns                         *
+* Param:  int sd, socket description                            *
+*         int opcode, frame type (v2 only)                      *
+*         int flags, frame flags (v2 only)                      *
+*         struct iovec *iov, iov[0] is left for the header, the *
+*                            content is iov[1] .. iov[count-1]  *
+*                            (changed)                          *
+*         int count, number of iovec, header included           *
+* Return: 0 success (or queued on a non-blocking sd)            *
+*         -1 error                                              *
+****************************************************************/
+int writeFrameV(int sd, int opcode, int flags, struct iovec *iov, int count)
+{
+	Stream *st = streamGet(sd);
+	unsigned char header[12];                       // v1: "%3d" and '\0', v2: 6 bytes
+	int result = 0, len;
+	
+	pthread_mutex_lock(&st->sendLock);              // the compression buffers of sd too
+	flags |= lzPack(st, iov, &count);
+	iov[0].iov_base = header;
+	len = streamCut(st, header, opcode, flags, iov, count);
+	if(st->corked && len >= LARGEFRAME && streamDrain(st, sd, MSG_DONTWAIT) == 0 && st->outPos == st->outLen)
+	{
+		result = streamSend(st, sd, iov, count, 0);    // earlier frames are out, no copy into the queue
+	}
+	else if(st->corked || st->outPos < st->outLen)  // corked, or earlier frames still queued
+	{
+		streamQueue(st, iov, count);                // keep the order
+		if(!st->corked || st->outLen - st->outPos >= CORKLIMIT)
+			result = streamDrain(st, sd, 0);
+	}
+	else
+	{
+		result = streamSend(st, sd, iov, count, 0);
+	}
+	pthread_mutex_unlock(&st->sendLock);
+	
+	return result;
+}
+
+
+/****************************************************************
+* Func:   Write a frame from a thread that does not serve sd,   *
+*         e.g. a message pushed to its recipient. Ignores the   *
+*         cork and never waits for a full socket: what is not   *
+*         taken stays queued for the next flush                 *
+* Param:  int sd, socket description, must stay open meanwhile  *
+*         int opcode, frame type                                *
+*         char *content, content to be write                    *
+*         int len, length of the content                        *
+* Return: 0 success (or queued)                                 *
+*         -1 error                                              *
+****************************************************************/
+int pushFrame(int sd, int opcode, char *content, int len)
+{
+	struct iovec iov[2];
+	
+	iov[1].iov_base = content;
+	iov[1].iov_len = len;
+	
+	return pushFrameV(sd, opcode, iov, 2);
+}
+
+
+/****************************************************************
+* Func:   Push a frame whose content is gathered from pieces,   *
+*         see pushFrame; the pieces are not used any more once  *
+*         it returns (what the socket did not take is copied)   *
+* Param:  int sd, socket description, must stay open meanwhile  *
+*         int opcode, frame type                                *
+*         struct iovec *iov, iov[0] is left for the header, the *
+*                            content is iov[1] .. iov[count-1]  *
+*                            (changed)                          *
+*         int count, number of iovec, header included           *
+* Return: 0 success (or queued)                                 *
+*         -1 error                                              *
+****************************************************************/
+int pushFrameV(int sd, int opcode, struct iovec *iov, int count)
+{
+	Stream *st = streamGet(sd);
+	unsigned char header[12];
+	int result;
+	
+	pthread_mutex_lock(&st->sendLock);
+	iov[0].iov_base = header;
+	streamCut(st, header, opcode, lzPack(st, iov, &count), iov, count);
+	if(st->outPos < st->outLen)                     // replies queued first, keep the order
+	{
+		streamQueue(st, iov, count);
+		result = streamDrain(st, sd, MSG_DONTWAIT);
+	}
+	else
+	{
+		result = streamSend(st, sd, iov, count, MSG_DONTWAIT);
+	}
+	pthread_mutex_unlock(&st->sendLock);
+	
+	return result;
+}
+
+
+/****************************************************************
+* Func:   Write content of any size, see writePayloadV          *
+* Param:  int sd, socket description                            *
+*         int opcode, frame type (v2 only)                      *
+*         char *content, content to be write                    *
+*         int len, length of the content                        *
+*         void (*release)(void *arg), gives content back once   *
+*                                     it is sent (NULL: none)   *
+*         void *arg, passed to release                          *
+* Return: 0 success (or waiting on a non-blocking sd)           *
+*         -1 error                                              *
+****************************************************************/
+int writePayload(int sd, int opcode, char *content, int len, void (*release)(void *arg), void *arg)
+{
+	struct iovec iov[2];
+	
+	iov[1].iov_base = content;
+	iov[1].iov_len = len;
+	
+	return writePayloadV(sd, opcode, iov, 2, release, arg);
+}
+
+
+/****************************************************************
+* Func:   Write content of any size gathered from pieces: on a  *
+*         chunked sd, fragments of CHUNKSIZE cut at line ends,  *
+*         else one frame. What a non-blocking sd does not take  *
+*         waits in the pieces until streamFlush sends it, then  *
+*         release gives them back; without release it is copied *
+* Param:  int sd, socket description                            *
+*         int opcode, frame type (v2 only)                      *
+*         struct iovec *iov, iov[0] is left for the header, the *
+*                            content is iov[1] .. iov[count-1]  *
+*                            (changed)                          *
+*         int count, number of iovec, header included           *
+*         void (*release)(void *arg), gives the pieces back     *
+*                                     once they are sent, may   *
+*                                     be called before return   *
+*                                     (NULL: the pieces are not *
+*                                     used once it returns)     *
+*         void *arg, passed to release                          *
+* Return: 0 success (or waiting on a non-blocking sd)           *
+*         -1 error                                              *
+****************************************************************/
+int writePayloadV(int sd, int opcode, struct iovec *iov, int count, void (*release)(void *arg), void *arg)
+{
+	Stream *st = streamGet(sd);
+	int len = 0, result, i;
+	
+	for(i = 1; i < count; i++)
+		len += iov[i].iov_len;
+	if(!st->chunked || len <= CHUNKSIZE)            // one frame
+	{
+		result = writeFrameV(sd, opcode, 0, iov, count);
+		if(release != NULL)
+			release(arg);                           // sent or queued, not used any more
+		return result;
+	}
+	
+	pthread_mutex_lock(&st->sendLock);
+	if(st->bulk != NULL)                            // the one before still waits: copy it, keep the order
+		streamSpill(st);
+	if((st->bulk = (struct iovec *)malloc(sizeof(struct iovec) * (count * 2))) == NULL)    // pieces, then room to gather a fragment
+	{
+		printf("Payload pieces\n");
+		exit(1);
+	}
+	memcpy(st->bulk, iov + 1, sizeof(struct iovec) * (count - 1));
+	st->bulkNext = 0;
+	st->bulkCount = count - 1;
+	st->bulkLeft = len;
+	st->bulkOpcode = opcode;
+	st->bulkRelease = release;
+	st->bulkArg = arg;
+	
+	if((result = streamDrain(st, sd, 0)) == 0)     // replies queued first
+		result = streamBulk(st, sd);
+	if(st->bulk != NULL && result == -1)           // dropped with sd
+		streamBulkEnd(st);
+	else if(st->bulk != NULL && release == NULL)    // the caller takes the pieces back
+		streamSpill(st);
+	pthread_mutex_unlock(&st->sendLock);
+	
+	return result;
+}
+
+
+/****************************************************************
+* Func:   Read a frame, wait until it is complete               *
+* Param:  int sd, socket description                            *
+*         int *opcode, frame type (NULL to ignore)              *
+*         int *flags, frame flags (NULL to ignore)              *
+*         char *content, content to be written, size chars,     *
+*                        longer content is cut                  *
+*         int size, size of content                             *
+* Return: int, length of content                                *
+*         -1 connection closed or error                         *
+****************************************************************/
+int readFrame(int sd, int *opcode, int *flags, char *content, int size)
+{
+	int len;
+	
+	while((len = streamNext(sd, opcode, flags, content, size)) == -1)
+	{
+		if(streamFlush(sd) == -1 || streamFill(sd) <= 0)    // replies out before waiting
+			return -1;                              // closed, error (or timeout)
+	}
+	
+	return len < 0 ? -1 : len;
+}
+
+
+/****************************************************************
+* Func:   Read whatever sd has, without waiting on a            *
+*         non-blocking sd                                       *
+* Param:  int sd, socket description                            *
+* Return: int, number of bytes read                             *
+*         0 nothing to read now                                 *
+*         -1 connection closed or error                         *
+****************************************************************/
+int streamFill(int sd)
+{
+	Stream *st = streamGet(sd);
+	int n;
+	
+	if(st->inPos > 0)                               // move the unfinished frame to the front
+	{
+		memmove(st->in, st->in + st->inPos, st->inLen - st->inPos);
+		st->inLen -= st->inPos;
+		st->inPos = 0;
+	}
+	if(st->inLen == st->inSize)
+	{
+		int size = st->inSize == 0 ? STREAMBUFSIZE : st->inSize * 2;
+		char *in;
+		
+		if((in = (char *)realloc(st->in, size)) == NULL)
+			return -1;                              // the buffer is kept, the connection closed
+		st->in = in;
+		st->inSize = size;
+	}
+	
+	while((n = read(sd, st->in + st->inLen, st->inSize - st->inLen)) == -1 && errno == EINTR);
+	if(n == 0)                                      // peer closed
+		return -1;
+	if(n == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	
+	st->inLen += n;
+	if(byteCount != NULL)
+		byteCount(n, 0);
+	return n;
+}
+
+
+/****************************************************************
+* Func:   Take the next complete frame out of the receive       *
+*         buffer, without reading sd                            *
+* Param:  int sd, socket description                            *
+*         int *opcode, frame type (NULL to ignore)              *
+*         int *flags, frame flags (NULL to ignore)              *
+*         char *content, content to be written, size chars,     *
+*                        longer content is cut                  *
+*         int size, size of content                             *
+* Return: int, length of content                                *
+*         -1 no complete frame yet                              *
+*         -2 protocol error, v1 length not a number, frame too  *
+*            long, no memory for it or not a valid compressed   *
+*            block                                              *
+****************************************************************/
+int streamNext(int sd, int *opcode, int *flags, char *content, int size)
+{
+	Stream *st = streamGet(sd);
+	unsigned char *header = (unsigned char *)st->in + st->inPos;
+	int avail = st->inLen - st->inPos;
+	int headLen, len, op = OP_DATA, fl = 0;
+	
+	if(st->version == 1)
+	{
+		char len_char[V1HEADER + 1];
+		int i;
+		
+		if(avail < V1HEADER)
+			return -1;
+		for(i = 0; i < V1HEADER; i++)               // only what "%3d" writes: no sign, no letter
+		{
+			if(header[i] != ' ' && (header[i] < '0' || header[i] > '9'))
+				return -2;
+		}
+		memcpy(len_char, header, V1HEADER);         // first 3 character is the length
+		len_char[V1HEADER] = '\0';
+		len = atoi(len_char);
+		headLen = V1HEADER;
+	}
+	else
+	{
+		uint32_t netLen;
+		
+		if(avail < V2HEADER)
+			return -1;
+		memcpy(&netLen, header, 4);
+		len = ntohl(netLen);
+		op = header[4];
+		fl = header[5];
+		headLen = V2HEADER;
+		if(len < 0 || len > V2MAXLENGTH)
+			return -2;
+	}
+	
+	if(avail < headLen + len)                       // not complete, make sure it fits
+	{
+		if(st->inSize < headLen + len)
+		{
+			char *in;
+			
+			memmove(st->in, st->in + st->inPos, avail);
+			st->inPos = 0;
+			st->inLen = avail;
+			if((in = (char *)realloc(st->in, headLen + len)) == NULL)
+				return -2;                          // no room for the frame, the buffer is kept
+			st->in = in;
+			st->inSize = headLen + len;
+		}
+		return -1;
+	}
+	
+	st->inPos += headLen + len;
+	if(fl & FLAG_LZ)                                // compressed, the reader gets the content as it was
+	{
+		if((len = lzDecode(header + headLen, len, content, size - 1)) == -1)
+			return -2;
+		fl &= ~FLAG_LZ;
+	}
+	else
+	{
+		if(len > size - 1)
+			len = size - 1;
+		memcpy(content, header + headLen, len);
+	}
+	content[len] = '\0';			                         // add EOF for string
+	if(opcode != NULL)
+		*opcode = op;
+	if(flags != NULL)
+		*flags = fl;
+	
+	if(st->inPos == st->inLen)                      // buffer empty, start over
+		st->inPos = st->inLen = 0;
+	
+	return len;
+}
+
+
+/****************************************************************
+* Func:   Send bytes queued on a non-blocking sd, then the      *
+*         fragments of a payload waiting for the socket         *
+* Param:  int sd, socket description                            *
+* Return: 0 success, or socket full and the rest stays queued   *
+*         -1 error                                              *
+****************************************************************/
+int streamFlush(int sd)
+{
+	Stream *st = streamGet(sd);
+	int result;
+	
+	pthread_mutex_lock(&st->sendLock);
+	result = streamDrain(st, sd, 0);
+	if(result == 0 && st->bulk != NULL)            // then the payload waiting for the socket
+		result = streamBulk(st, sd);
+	pthread_mutex_unlock(&st->sendLock);
+	
+	return result;
+}
+
+
+/****************************************************************
+* Func:   Send the queue of sd, caller holds sendLock; on a     *
+*         blocking sd it waits for the socket out of the lock,  *
+*         frames pushed meanwhile are queued behind             *
+* Param:  Stream *st, buffers of sd                             *
+*         int sd, socket description                            *
+*         int sendFlags, MSG_DONTWAIT to never block            *
+* Return: 0 success, or socket full and the rest stays queued   *
+*         -1 error                                              *
+****************************************************************/
+int streamDrain(Stream *st, int sd, int sendFlags)
+{
+	struct pollfd pfd;
+	
+	while(st->outPos < st->outLen)
+	{
+		int n = send(sd, st->out + st->outPos, st->outLen - st->outPos, MSG_NOSIGNAL | MSG_DONTWAIT);
+		
+		if(n == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			if(sendFlags == MSG_DONTWAIT || (fcntl(sd, F_GETFL, 0) & O_NONBLOCK))
+				return 0;                           // streamFlush sends the rest
+			pfd.fd = sd;
+			pfd.events = POLLOUT;
+			pthread_mutex_unlock(&st->sendLock);    // pushes are queued meanwhile
+			poll(&pfd, 1, -1);
+			pthread_mutex_lock(&st->sendLock);
+			continue;
+		}
+		st->outPos += n;
+		if(byteCount != NULL)
+			byteCount(0, n);
+	}
+	st->outPos = st->outLen = 0;
+	
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Cork sd: frames are queued and sent together by       *
+*         streamFlush, or when readFrame has to wait for data   *
+* Param:  int sd, socket description                            *
+* Return: none                                                  *
+****************************************************************/
+void streamCork(int sd)
+{
+	streamGet(sd)->corked = 1;
+}
+
+
+/****************************************************************
+* Func:   Payloads larger than CHUNKSIZE go out on sd in        *
+*         fragments (writePayload), the peer asked for it       *
+* Param:  int sd, socket description, v2                        *
+* Return: none                                                  *
+****************************************************************/
+void streamChunk(int sd)
+{
+	streamGet(sd)->chunked = 1;
+}
+
+
+/****************************************************************
+* Func:   Whether a payload of sd still waits for the socket,   *
+*         called by the thread serving sd: replies to more      *
+*         requests would pile up behind it                      *
+* Param:  int sd, socket description                            *
+* Return: int, 1 waiting, streamFlush sends it                  *
+*         0 none                                                *
+****************************************************************/
+int streamBusy(int sd)
+{
+	return streamGet(sd)->bulk != NULL;
+}
+
+
+/****************************************************************
+* Func:   Compress frames of LZMIN bytes or more sent on sd     *
+*         from now on, the peer asked for it (or agreed)        *
+* Param:  int sd, socket description, v2                        *
+* Return: none                                                  *
+****************************************************************/
+void streamCompress(int sd)
+{
+	Stream *st = streamGet(sd);
+	
+	pthread_mutex_lock(&st->sendLock);
+	if(st->lzTable == NULL && (st->lzTable = (uint32_t *)calloc(1 << LZHASHBITS, sizeof(uint32_t))) == NULL)
+	{
+		printf("Compression table\n");
+		exit(1);
+	}
+	pthread_mutex_unlock(&st->sendLock);
+}
+
+
+/****************************************************************
+* Func:   Switch the frame format of sd, both directions        *
+* Param:  int sd, socket description                            *
+*         int version, 1 or 2                                   *
+* Return: none                                                  *
+****************************************************************/
+void streamSetVersion(int sd, int version)
+{
+	streamGet(sd)->version = version;
+}
+
+
+/****************************************************************
+* Func:   Frame format of sd                                    *
+* Param:  int sd, socket description                            *
+* Return: int, 1 or 2                                           *
+****************************************************************/
+int streamVersion(int sd)
+{
+	return streamGet(sd)->version;
+}
+
+
+/****************************************************************
+* Func:   Send what is still queued, release the buffers of sd  *
+*         and close it                                          *
+* Param:  int sd, socket description                            *
+* Return: none                                                  *
+****************************************************************/
+void streamClose(int sd)
+{
+	_Atomic(Stream *) *page = atomic_load(&streamPage[sd >> STREAMPAGEBITS]);
+	Stream *st;
+	
+	if(page != NULL && (st = atomic_load_explicit(&page[sd & (STREAMPAGESIZE - 1)], memory_order_acquire)) != NULL)
+	{
+		streamFlush(sd);                            // e.g. replies to requests pipelined before exit
+		if(st->bulk != NULL)                        // the peer does not read it any more
+			streamBulkEnd(st);
+		atomic_store_explicit(&page[sd & (STREAMPAGESIZE - 1)], NULL, memory_order_release);    // sd may be reused right after close
+		pthread_mutex_destroy(&st->sendLock);
+		free(st->lzTable);
+		free(st->lzIn);
+		free(st->lzOut);
+		free(st->in);
+		free(st->out);
+		free(st);
+	}
+	close(sd);
+}
+
+
+/****************************************************************
+* Func:   Count bytes read and written on every sd, call before *
+*         the first sd is used                                  *
+* Param:  void (*count)(int in, int out), called after each     *
+*                                         read and write        *
+* Return: none                                                  *
+****************************************************************/
+void streamStats(void (*count)(int in, int out))
+{
+	byteCount = count;
+}
+
+
+/****************************************************************
+* Func:   Buffers of sd, created on first use (v1 format)       *
+* Param:  int sd, socket description                            *
+* Return: Stream*, buffers of sd                                *
+****************************************************************/
+Stream* streamGet(int sd)
+{
+	_Atomic(Stream *) *page = atomic_load(&streamPage[sd >> STREAMPAGEBITS]);
+	Stream *st;
+	
+	if(page == NULL)                                // first sd of this page
+	{
+		_Atomic(Stream *) *newPage = (_Atomic(Stream *) *)calloc(STREAMPAGESIZE, sizeof(_Atomic(Stream *)));
+		
+		if(newPage == NULL)
+		{
+			printf("Stream table\n");
+			exit(1);
+		}
+		if(atomic_compare_exchange_strong(&streamPage[sd >> STREAMPAGEBITS], &page, newPage))
+			page = newPage;
+		else
+			free(newPage);                          // another thread was first
+	}
+	
+	if((st = atomic_load_explicit(&page[sd & (STREAMPAGESIZE - 1)], memory_order_acquire)) == NULL)    // only the thread serving sd gets here
+	{
+		if((st = (Stream *)calloc(1, sizeof(Stream))) == NULL)
+		{
+			printf("Stream buffers\n");
+			exit(1);
+		}
+		st->version = 1;
+		pthread_mutex_init(&st->sendLock, NULL);
+		atomic_store_explicit(&page[sd & (STREAMPAGESIZE - 1)], st, memory_order_release);
+	}
+	
+	return st;
+}
+
+
+/****************************************************************
+* Func:   Frame header for the format of sd                     *
+* Param:  Stream *st, buffers of sd                             *
+*         unsigned char *header, 12 chars                       *
+*         int opcode, frame type (v2 only)                      *
+*         int flags, frame flags (v2 only)                      *
+*         int *len, length of the content, cut to 999 for v1    *
+* Return: int, length of the header                             *
+****************************************************************/
+int streamHeader(Stream *st, unsigned char *header, int opcode, int flags, int *len)
+{
+	uint32_t netLen;
+	
+	if(st->version == 1)
+	{
+		if(*len > V1MAXLENGTH)                      // does not fit in 3 chars
+			*len = V1MAXLENGTH;
+		return sprintf((char *)header, "%3d", *len);
+	}
+	
+	netLen = htonl(*len);
+	memcpy(header, &netLen, 4);
+	header[4] = opcode;
+	header[5] = flags;
+	
+	return V2HEADER;
+}
+
+
+/****************************************************************
+* Func:   Header of a frame gathered from pieces, pieces beyond *
+*         what v1 can carry are cut off after the last whole    *
+*         line that fits                                        *
+* Param:  Stream *st, buffers of sd                             *
+*         unsigned char *header, 12 chars, iov[0] points to it  *
+*         int opcode, frame type (v2 only)                      *
+*         int flags, frame flags (v2 only)                      *
+*         struct iovec *iov, header, then the content (changed) *
+*         int count, number of iovec, header included           *
+* Return: int, length of the content                            *
+****************************************************************/
+int streamCut(Stream *st, unsigned char *header, int opcode, int flags, struct iovec *iov, int count)
+{
+	int len = 0, left, line = 0, i, j;
+	
+	for(i = 1; i < count; i++)
+		len += iov[i].iov_len;
+	for(i = 1, left = 0; st->version == 1 && len > V1MAXLENGTH && i < count && left < V1MAXLENGTH; i++)
+	{
+		char *piece = (char *)iov[i].iov_base;
+		
+		for(j = 0; j < (int)iov[i].iov_len && left + j < V1MAXLENGTH; j++)
+		{
+			if(piece[j] == '\n')
+				line = left + j + 1;
+		}
+		left += iov[i].iov_len;
+	}
+	if(line > 0)                                    // v1 keeps whole lines
+		len = line;
+	iov[0].iov_len = streamHeader(st, header, opcode, flags, &len);
+	
+	for(i = 1, left = len; i < count; i++)          // v1: the rest of the pieces is dropped
+	{
+		if((int)iov[i].iov_len > left)
+			iov[i].iov_len = left;
+		left -= iov[i].iov_len;
+	}
+	
+	return len;
+}
+
+
+/****************************************************************
+* Func:   Send iovec, retry partial writes, queue what the      *
+*         socket does not take (a blocking sd then waits in     *
+*         streamDrain), caller holds sendLock                   *
+* Param:  Stream *st, buffers of sd                             *
+*         int sd, socket description                            *
+*         struct iovec *iov, data to send (changed)             *
+*         int count, number of iovec                            *
+*         int sendFlags, MSG_DONTWAIT to never block            *
+* Return: 0 success                                             *
+*         -1 error                                              *
+****************************************************************/
+int streamSend(Stream *st, int sd, struct iovec *iov, int count, int sendFlags)
+{
+	struct msghdr msg;
+	
+	memset(&msg, 0, sizeof(msg));
+	while(count > 0)
+	{
+		ssize_t n;
+		
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count < GATHERMAX ? count : GATHERMAX;    // long gathers go out in parts
+		if((n = sendmsg(sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				streamQueue(st, iov, count);        // sent by streamFlush later, or now on a blocking sd
+				return sendFlags == MSG_DONTWAIT ? 0 : streamDrain(st, sd, 0);
+			}
+			return -1;
+		}
+		if(byteCount != NULL)
+			byteCount(0, n);
+		
+		while(count > 0 && (size_t)n >= iov->iov_len)    // skip what is sent
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Append iovec to the send queue                        *
+* Param:  Stream *st, buffers of sd                             *
+*         struct iovec *iov, data to queue                      *
+*         int count, number of iovec                            *
+* Return: none                                                  *
+****************************************************************/
+void streamQueue(Stream *st, struct iovec *iov, int count)
+{
+	int i;
+	
+	for(i = 0; i < count; i++)
+	{
+		if(st->outLen + (int)iov[i].iov_len > st->outSize)
+		{
+			st->outSize = (st->outLen + iov[i].iov_len) * 2;
+			if((st->out = (char *)realloc(st->out, st->outSize)) == NULL)
+			{
+				printf("Send queue\n");
+				exit(1);
+			}
+		}
+		memcpy(st->out + st->outLen, iov[i].iov_base, iov[i].iov_len);
+		st->outLen += iov[i].iov_len;
+	}
+}
+
+
+/****************************************************************
+* Func:   Cut the next fragment of the payload waiting on sd:   *
+*         up to the last line end within CHUNKSIZE (the whole   *
+*         CHUNKSIZE if a line is longer), FLAG_MORE unless it   *
+*         is the last one, compressed on an sd that compresses; *
+*         caller holds sendLock                                 *
+* Param:  Stream *st, buffers of sd                             *
+*         unsigned char *header, 12 chars                       *
+* Return: int, number of iovec of the fragment, header included *
+*         (st->bulk + st->bulkCount)                            *
+****************************************************************/
+int streamFragment(Stream *st, unsigned char *header)
+{
+	struct iovec *piece = st->bulk + st->bulkNext, *frag = st->bulk + st->bulkCount;
+	int pieces = st->bulkCount - st->bulkNext;
+	int len = 0, cut = -1, cutLen = 0, fragLen = 0, take = 0, count, flags, i, j;
+	
+	if(st->bulkLeft <= CHUNKSIZE)                   // the last fragment, the rest
+	{
+		cut = pieces - 1;
+		cutLen = piece[cut].iov_len;
+		fragLen = st->bulkLeft;
+	}
+	else
+	{
+		for(i = 0; i < pieces && len < CHUNKSIZE; i++)
+		{
+			char *base = (char *)piece[i].iov_base;
+			
+			take = (int)piece[i].iov_len < CHUNKSIZE - len ? (int)piece[i].iov_len : CHUNKSIZE - len;
+			for(j = take - 1; j >= 0 && base[j] != '\n'; j--);
+			if(j >= 0)                              // the last line end so far
+			{
+				cut = i;
+				cutLen = j + 1;
+				fragLen = len + cutLen;
+			}
+			len += take;
+		}
+		if(cut == -1)                               // no line end: cut inside the line
+		{
+			cut = i - 1;
+			cutLen = take;
+			fragLen = len;
+		}
+	}
+	
+	for(i = 0; i < cut; i++)
+		frag[i + 1] = piece[i];
+	frag[cut + 1].iov_base = piece[cut].iov_base;
+	frag[cut + 1].iov_len = cutLen;
+	piece[cut].iov_base = (char *)piece[cut].iov_base + cutLen;
+	piece[cut].iov_len -= cutLen;
+	st->bulkNext += piece[cut].iov_len == 0 ? cut + 1 : cut;
+	st->bulkLeft -= fragLen;
+	count = cut + 2;
+	flags = lzPack(st, frag, &count);
+	if(flags == FLAG_LZ)
+		fragLen = frag[1].iov_len;
+	frag[0].iov_base = header;
+	frag[0].iov_len = streamHeader(st, header, st->bulkOpcode, flags | (st->bulkLeft > 0 ? FLAG_MORE : 0), &fragLen);
+	
+	return count;
+}
+
+
+/****************************************************************
+* Func:   Send fragments of the payload waiting on sd while the *
+*         socket takes them, give the pieces back once all      *
+*         are sent; caller holds sendLock, other threads may    *
+*         push between two fragments                            *
+* Param:  Stream *st, buffers of sd, the queue is empty         *
+*         int sd, socket description                            *
+* Return: 0 success, or socket full and the rest still waits    *
+*         -1 error                                              *
+****************************************************************/
+int streamBulk(Stream *st, int sd)
+{
+	unsigned char header[12];
+	int count;
+	
+	while(st->bulkLeft > 0 && st->outPos == st->outLen)    // a fragment the socket did not take is queued
+	{
+		count = streamFragment(st, header);
+		if(streamSend(st, sd, st->bulk + st->bulkCount, count, 0) == -1)
+			return -1;
+		pthread_mutex_unlock(&st->sendLock);        // pushes go out between two fragments
+		pthread_mutex_lock(&st->sendLock);
+	}
+	if(st->bulkLeft == 0)
+		streamBulkEnd(st);
+	
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Queue a copy of the rest of the payload waiting on sd *
+*         in fragments, give the pieces back; caller holds      *
+*         sendLock                                              *
+* Param:  Stream *st, buffers of sd                             *
+* Return: none                                                  *
+****************************************************************/
+void streamSpill(Stream *st)
+{
+	unsigned char header[12];
+	
+	while(st->bulkLeft > 0)
+		streamQueue(st, st->bulk + st->bulkCount, streamFragment(st, header));
+	streamBulkEnd(st);
+}
+
+
+/****************************************************************
+* Func:   Forget the payload waiting on sd, give its pieces     *
+*         back; caller holds sendLock (or closes sd)            *
+* Param:  Stream *st, buffers of sd                             *
+* Return: none                                                  *
+****************************************************************/
+void streamBulkEnd(Stream *st)
+{
+	free(st->bulk);
+	st->bulk = NULL;
+	if(st->bulkRelease != NULL)
+		st->bulkRelease(st->bulkArg);
+}
+
+
+/****************************************************************
+* Func:   Compress the content of a frame on an sd that         *
+*         compresses, if it is LZMIN bytes or more and gets     *
+*         shorter; caller holds sendLock                        *
+* Param:  Stream *st, buffers of sd                             *
+*         struct iovec *iov, iov[0] is left for the header, the *
+*                            content is iov[1] .. iov[count-1]; *
+*                            compressed: iov[1] only (changed)  *
+*         int *count, number of iovec, header included (changed)*
+* Return: int, FLAG_LZ compressed, valid until sendLock is let  *
+*         go (sent or queued by then)                           *
+*         0 left as it is                                       *
+****************************************************************/
+int lzPack(Stream *st, struct iovec *iov, int *count)
+{
+	unsigned char *src;
+	int len = 0, packed, i;
+	
+	if(st->lzTable == NULL || st->version != 2)
+		return 0;
+	for(i = 1; i < *count; i++)
+		len += iov[i].iov_len;
+	if(len < LZMIN)
+		return 0;
+	
+	if(*count == 2)                                 // one piece, compressed where it is
+	{
+		src = (unsigned char *)iov[1].iov_base;
+	}
+	else                                            // matches reach across pieces
+	{
+		if(st->lzInSize < len && (st->lzIn = (unsigned char *)realloc(st->lzIn, st->lzInSize = len)) == NULL)
+		{
+			printf("Compression buffers\n");
+			exit(1);
+		}
+		for(i = 1, len = 0; i < *count; i++)
+		{
+			memcpy(st->lzIn + len, iov[i].iov_base, iov[i].iov_len);
+			len += iov[i].iov_len;
+		}
+		src = st->lzIn;
+	}
+	if(st->lzOutSize < len + len / 255 + 16 && (st->lzOut = (unsigned char *)realloc(st->lzOut, st->lzOutSize = len + len / 255 + 16)) == NULL)
+	{                                               // worst case: all literals
+		printf("Compression buffers\n");
+		exit(1);
+	}
+	
+	if((packed = lzEncode(st, src, len, st->lzOut)) >= len)    // does not repeat itself
+		return 0;
+	iov[1].iov_base = st->lzOut;
+	iov[1].iov_len = packed;
+	*count = 2;
+	
+	return FLAG_LZ;
+}
+
+
+/****************************************************************
+* Func:   LZ4-style block compression: sequences of a token     *
+*         (literal run length, match length - 4), the literals, *
+*         a 2 byte little endian offset back and the length     *
+*         beyond 15 in bytes of 255; the last sequence is       *
+*         literals only. Positions in the hash table are based  *
+*         on st->lzPos, which moves past every frame, so the    *
+*         table is reused without clearing it                   *
+* Param:  Stream *st, buffers of sd, lzTable                    *
+*         unsigned char *src, content, LZMIN bytes or more      *
+*         int len, length of the content                        *
+*         unsigned char *dst, len + len / 255 + 16 bytes        *
+* Return: int, length of the compressed content                 *
+****************************************************************/
+int lzEncode(Stream *st, unsigned char *src, int len, unsigned char *dst)
+{
+	uint32_t *table = st->lzTable, base = st->lzPos, seq, pos, cand;
+	unsigned char *ip = src, *anchor = src, *end = src + len, *limit = end - LZLASTLITERALS;
+	unsigned char *op = dst, *ref, *match, *token;
+	int run, offset;
+	
+	if(st->lzPos > (1u << 30))                     // start over long before it wraps, stale entries
+		base = 0;                                   // still fail the checks or the compare
+	st->lzPos = base + len;
+	
+	while(ip < limit)
+	{
+		memcpy(&seq, ip, 4);
+		pos = base + (ip - src);
+		cand = table[(seq * 2654435761u) >> (32 - LZHASHBITS)];
+		table[(seq * 2654435761u) >> (32 - LZHASHBITS)] = pos;
+		if(cand < base || cand >= pos || pos - cand > LZMAXOFFSET || memcmp(src + (cand - base), ip, LZMINMATCH) != 0)
+		{
+			ip += 1 + ((ip - anchor) >> 6);        // through text that does not repeat a little faster
+			continue;
+		}
+		
+		offset = pos - cand;
+		ref = src + (cand - base) + LZMINMATCH;
+		for(match = ip + LZMINMATCH; match < end - 5 && *match == *ref; match++, ref++);
+		
+		token = op++;
+		run = ip - anchor;
+		*token = (run < 15 ? run : 15) << 4;
+		op = lzRun(op, run);
+		memcpy(op, anchor, run);
+		op += run;
+		*op++ = offset & 0xff;                      // little endian
+		*op++ = offset >> 8;
+		run = match - ip - LZMINMATCH;
+		*token |= run < 15 ? run : 15;
+		op = lzRun(op, run);
+		ip = anchor = match;
+	}
+	
+	run = end - anchor;                             // the last literals
+	*op++ = (run < 15 ? run : 15) << 4;
+	op = lzRun(op, run);
+	memcpy(op, anchor, run);
+	op += run;
+	
+	return op - dst;
+}
+
+
+/****************************************************************
+* Func:   Write the part of a length that does not fit in the   *
+*         4 bits of a token                                     *
+* Param:  unsigned char *op, where to write                     *
+*         int n, literal run or match length - 4                *
+* Return: unsigned char*, after what is written                 *
+****************************************************************/
+unsigned char* lzRun(unsigned char *op, int n)
+{
+	if(n < 15)
+		return op;
+	for(n -= 15; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	
+	return op;
+}
+
+
+/****************************************************************
+* Func:   Decompress a block of lzEncode, every length and      *
+*         offset is checked, the input comes from the network   *
+* Param:  unsigned char *src, compressed content                *
+*         int len, length of the compressed content             *
+*         char *dst, content to be written, size chars          *
+*         int size, longer content is cut                       *
+* Return: int, length of the content                            *
+*         -1 not a valid block                                  *
+****************************************************************/
+int lzDecode(unsigned char *src, int len, char *dst, int size)
+{
+	unsigned char *ip = src, *end = src + len;
+	int op = 0, token, n, offset, i;
+	
+	while(ip < end)
+	{
+		token = *ip++;
+		if((n = token >> 4) == 15)                 // literal run, more in bytes of 255
+		{
+			do
+			{
+				if(ip == end || n > V2MAXLENGTH)
+					return -1;
+				n += *ip;
+			} while(*ip++ == 255);
+		}
+		if(n > end - ip)
+			return -1;
+		if(n >= size - op)                          // cut
+		{
+			memcpy(dst + op, ip, size - op);
+			return size;
+		}
+		memcpy(dst + op, ip, n);
+		op += n;
+		ip += n;
+		if(ip == end)                               // the last sequence has no match
+			break;
+		
+		if(end - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op)
+			return -1;
+		if((n = token & 15) == 15)                 // match length
+		{
+			do
+			{
+				if(ip == end || n > V2MAXLENGTH)
+					return -1;
+				n += *ip;
+			} while(*ip++ == 255);
+		}
+		if((n += LZMINMATCH) > size - op)          // cut
+			n = size - op;
+		if(offset >= n)
+		{
+			memcpy(dst + op, dst + op - offset, n);
+		}
+		else                                        // overlaps itself: byte by byte
+		{
+			for(i = 0; i < n; i++)
+				dst[op + i] = dst[op - offset + i];
+		}
+		if((op += n) == size)
+			return size;
+	}
+	
+	return op;
+}
@@ -0,0 +1,229 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Epoch based reclamation for lock-free readers                                            **
+**                                                                                           **
+**  A reader brackets its lock-free section with epochEnter/epochExit: it publishes the      **
+**  global epoch it saw in its own slot, nothing else is written. A writer that unlinks a    **
+**  shared object (a hash table that was grown, a replaced user list) hands it to            **
+**  epochRetire instead of freeing it. The global epoch only moves on once every reader      **
+**  inside a section has seen the current one, so an object retired in epoch e is freed      **
+**  once the epoch reaches e + 2: no reader can still hold a pointer to it.                  **
+**  Slots of exited threads are reused by new threads. Shared pointers are stored and        **
+**  loaded seq_cst, like the slots: a reader either sees the new pointer or is seen by the   **
+**  writer.                                                                                  **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        void epochEnter();                          // start a read section, no lock       **
+**        void epochExit();                           // end a read section                  **
+**        void epochRetire(void *object, void (*release)(void *object));                     **
+**                                                    // free once no reader holds it        **
+**    - Internal:                                                                            **
+**        EpochSlot* epochSlot();                     // slot of the calling thread          **
+**        void epochRelease(void *slot);              // owner thread exits, slot is free    **
+**        void epochCollect();                        // move the epoch, free what is safe   **
+**        void epochKey();                            // key freeing slots of exited threads **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define EPOCHIDLE 0             // slot state outside a read section
+#define CACHELINE 64
+
+typedef struct EpochSlot{
+	_Alignas(CACHELINE) atomic_uint_fast64_t state;    // epoch * 2 + 1 inside a section, EPOCHIDLE outside
+	atomic_int owned;                       // 1: a thread uses the slot
+	struct EpochSlot *next;                 // list of all slots, never shrinks
+} EpochSlot;
+
+typedef struct Retired{
+	void *object;
+	void (*release)(void *object);
+	uint64_t epoch;                         // global epoch when it was retired
+	struct Retired *next;
+} Retired;
+
+static atomic_uint_fast64_t globalEpoch = 1;
+static _Atomic(EpochSlot *) slots;          // every thread that read
+static pthread_key_t slotKey;               // slot of a thread, released when it exits
+static pthread_once_t slotOnce = PTHREAD_ONCE_INIT;
+static __thread EpochSlot *mySlot;
+static Retired *retired;                    // waiting for readers, newest first
+static pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;    // for retired
+
+
+// function declare
+extern void epochEnter();
+extern void epochExit();
+extern void epochRetire(void *object, void (*release)(void *object));
+static EpochSlot* epochSlot();
+static void epochRelease(void *slot);
+static void epochCollect();
+static void epochKey();
+
+
+/****************************************************************
+* Func:   Start a lock-free read section: shared objects seen   *
+*         from now on stay valid until epochExit. Sections do   *
+*         not nest                                              *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void epochEnter()
+{
+	EpochSlot *slot = epochSlot();
+
+	// seq_cst: published before any shared pointer is read (pointers are read seq_cst too)
+	atomic_store(&slot->state, atomic_load_explicit(&globalEpoch, memory_order_relaxed) * 2 + 1);
+}
+
+
+/****************************************************************
+* Func:   End a lock-free read section                          *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void epochExit()
+{
+	atomic_store_explicit(&mySlot->state, EPOCHIDLE, memory_order_release);
+}
+
+
+/****************************************************************
+* Func:   Free an object once no reader can hold it, the caller *
+*         already unlinked it. Freeing waits for later calls    *
+* Param:  void *object, object to free                          *
+*         void (*release)(void *object), frees it               *
+* Return: none                                                  *
+****************************************************************/
+void epochRetire(void *object, void (*release)(void *object))
+{
+	Retired *r = (Retired *)malloc(sizeof(Retired));
+
+	if(r == NULL)
+	{
+		printf("Allocate retired object\n");
+		exit(1);
+	}
+	r->object = object;
+	r->release = release;
+
+	pthread_mutex_lock(&retireLock);
+	r->epoch = atomic_load_explicit(&globalEpoch, memory_order_relaxed);
+	r->next = retired;
+	retired = r;
+	epochCollect();
+	pthread_mutex_unlock(&retireLock);
+}
+
+
+/****************************************************************
+* Func:   Slot of the calling thread, a free one is reused      *
+* Param:  none                                                  *
+* Return: EpochSlot*, slot of the thread                        *
+****************************************************************/
+EpochSlot* epochSlot()
+{
+	EpochSlot *slot;
+
+	if(mySlot != NULL)
+		return mySlot;
+
+	pthread_once(&slotOnce, epochKey);
+	for(slot = atomic_load_explicit(&slots, memory_order_acquire); slot != NULL; slot = slot->next)
+	{
+		int free = 0;
+
+		if(atomic_compare_exchange_strong(&slot->owned, &free, 1))
+			break;
+	}
+	if(slot == NULL)                       // all taken, add one
+	{
+		if((slot = (EpochSlot *)aligned_alloc(CACHELINE, sizeof(EpochSlot))) == NULL)
+		{
+			printf("Allocate epoch slot\n");
+			exit(1);
+		}
+		atomic_init(&slot->state, EPOCHIDLE);
+		atomic_init(&slot->owned, 1);
+		slot->next = atomic_load_explicit(&slots, memory_order_relaxed);
+		while(!atomic_compare_exchange_weak_explicit(&slots, &slot->next, slot, memory_order_release, memory_order_relaxed));
+	}
+	pthread_setspecific(slotKey, slot);
+	mySlot = slot;
+
+	return slot;
+}
+
+
+/****************************************************************
+* Func:   Owner thread exits, another thread may take the slot  *
+* Param:  void *slot, slot of the thread (EpochSlot *)          *
+* Return: none                                                  *
+****************************************************************/
+void epochRelease(void *slot)
+{
+	atomic_store_explicit(&((EpochSlot *)slot)->state, EPOCHIDLE, memory_order_release);
+	atomic_store_explicit(&((EpochSlot *)slot)->owned, 0, memory_order_release);
+}
+
+
+/****************************************************************
+* Func:   Move the global epoch on if every reader inside a     *
+*         section has seen it, free objects retired two epochs  *
+*         ago. Caller holds retireLock                          *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void epochCollect()
+{
+	uint64_t epoch = atomic_load_explicit(&globalEpoch, memory_order_relaxed);
+	Retired **link, *r;
+	EpochSlot *slot;
+	int step;
+
+	for(step = 0; step < 2; step++)                 // two steps free what was just retired
+	{
+		for(slot = atomic_load_explicit(&slots, memory_order_acquire); slot != NULL; slot = slot->next)
+		{
+			uint64_t state = atomic_load(&slot->state);    // seq_cst: after the unlinking store
+
+			if(state != EPOCHIDLE && state / 2 != epoch)
+				break;                              // a reader is still in an older epoch
+		}
+		if(slot != NULL)
+			break;
+		atomic_store_explicit(&globalEpoch, ++epoch, memory_order_release);
+	}
+
+	link = &retired;
+	while((r = *link) != NULL)
+	{
+		if(r->epoch + 2 <= epoch)
+		{
+			*link = r->next;
+			r->release(r->object);
+			free(r);
+		}
+		else
+		{
+			link = &r->next;
+		}
+	}
+}
+
+
+/****************************************************************
+* Func:   Create the key that releases slots of exited threads  *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void epochKey()
+{
+	pthread_key_create(&slotKey, epochRelease);
+}
@@ -0,0 +1,868 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Message journal: write-ahead log of users, messages and deliveries, snapshot, replay     **
+**                                                                                           **
+**  Threads append records to one memory buffer (a memcpy under a mutex). A writer thread    **
+**  wakes every JOURNALSYNCMS and writes what has accumulated with one write() and one       **
+**  fdatasync() (group commit), so a crash loses at most the last few milliseconds.          **
+**  Records: U user recorded (location, broadcast cursor, name), M message put in a mailbox  **
+**  (recipient, sender, mailbox position, time, text), T messages taken (mailbox read        **
+**  position and broadcast cursor), B broadcast (seq, sender, time, '4' or '5', text).       **
+**  Mailbox positions order the messages of a user, so the order in which records reach      **
+**  the journal does not matter: a message is pending while its position is not below the    **
+**  read position. Every record has a length and a checksum, a torn tail is ignored.         **
+**  Files for "-j path": path.snap (snapshot) and segments path.1, path.2, ... A segment     **
+**  beyond JOURNALCOMPACT is closed and a new one started; a compactor thread folds the      **
+**  snapshot and the closed segments into a new snapshot (written aside, then renamed) and   **
+**  deletes the segments. The first record of a file is its generation: a snapshot of        **
+**  generation g covers every segment below g. Replay maps the files with mmap, rebuilds     **
+**  the pending messages of each user, hands users and messages to the server, then writes   **
+**  a snapshot of what the server holds (mailbox positions start over) and a new segment.    **
+**  Pending '5' broadcasts are put in the mailboxes, pending '4' ones are not replayed.      **
+**  Records use the byte order of the machine.                                               **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        void journalOpen(char *path, int (*addUser)(char *name), int (*addMail)(int to,    **
+**                         int from, time_t time, char *message, uint64_t *pos));            **
+**                                                    // replay, snapshot, start the writer  **
+**        void journalUser(int loc, uint64_t cursor, char *name);                            **
+**                                                    // a user was recorded                 **
+**        void journalMail(int to, int from, uint64_t pos, time_t time, char *message);      **
+**                                                    // a message was put in a mailbox      **
+**        void journalTake(int loc, uint64_t tail, uint64_t cursor);                         **
+**                                                    // a user read its messages            **
+**        void journalCast(uint64_t seq, int from, time_t time, int activeOnly,              **
+**                         char *message);            // a broadcast was posted              **
+**    - Internal:                                                                            **
+**        void journalAppend(int type, char *payload, int len);                              **
+**                                                    // queue a record for the writer       **
+**        void* journalWriter(void *arg);             // group commit, segment rotation      **
+**        void* journalCompactor(void *arg);          // fold closed segments into snapshot  **
+**        uint64_t journalLoad(JState *st, uint64_t below);                                  **
+**                                                    // snapshot and segments into st       **
+**        int journalReplay(JState *st, char *file, uint64_t *gen);                          **
+**                                                    // apply the records of one file       **
+**        void journalApply(JState *st, int type, char *p, int len);                         **
+**                                                    // apply one record                    **
+**        void journalPending(JUser *user, JMail *mail);                                     **
+**                                                    // add a pending message, keep order   **
+**        void journalSnapshot(JState *st, uint64_t gen);                                    **
+**                                                    // write st as the snapshot            **
+**        void journalRemove(uint64_t below);         // delete the segments below           **
+**        int journalEncode(char *rec, int type, char *payload, int len);                    **
+**                                                    // header, payload and checksum        **
+**        void journalFree(JState *st);               // release a replay state              **
+**        uint32_t journalCheck(int type, char *payload, int len);                           **
+**                                                    // FNV-1a checksum of a record         **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NAMESIZE 80             // max characters for a name
+#define MESSAGELENGTH 80        // max 80 characters for a message
+#define BCASTSIZE 4096          // broadcasts kept in the broadcast log, see broadcast.c
+#define JOURNALSYNCMS 5         // group commit: one write and fdatasync every 5 ms at most
+#define JOURNALCOMPACT (64L << 20)    // a segment beyond 64 MB is closed and compacted
+#define JOURNALBUFSIZE 65536    // initial append buffer, grows if the disk falls behind
+#define JOURNALHEADER 5         // u32 payload length, u8 type; u32 checksum follows the payload
+#define JOURNALRECORD 256       // largest payload
+#define JOURNALUSERS 1024       // initial users of a replay state
+#define PATHSIZE 256
+
+#define J_GEN 'G'               // u64 generation, first record of every file
+#define J_USER 'U'              // i32 loc, u64 cursor, name
+#define J_MAIL 'M'              // i32 to, i32 from, u64 pos, i64 time, text
+#define J_TAKE 'T'              // i32 loc, u64 tail, u64 cursor
+#define J_CAST 'B'              // u64 seq, i32 from, i64 time, u8 activeOnly, text
+
+#define MAIL_OK 0               // message recorded, see mailbox.c
+
+typedef struct{
+	uint64_t pos;               // mailbox position; seq + 1 for a broadcast, 0 empty
+	int from;
+	int64_t time;
+	int activeOnly;             // broadcast only, 1: '4'
+	char message[MESSAGELENGTH + 1];
+} JMail;
+
+typedef struct{
+	char name[NAMESIZE];
+	uint64_t tail;              // mailbox read position, messages below it were delivered
+	uint64_t cursor;            // broadcast cursor
+	JMail *mail;                // pending messages by position
+	int count, size;
+} JUser;
+
+typedef struct{
+	JUser *user;                // by location
+	int users, userSize;
+	JMail cast[BCASTSIZE];      // last broadcasts, by seq % BCASTSIZE
+	uint64_t castHead;          // seq of the next broadcast
+} JState;
+
+static char *journalPath;                   // prefix of the journal files
+static int journalOn;                       // 1: replay is over, records are written
+static int capacity;                        // mailbox capacity, older positions are gone
+static int journalFd = -1;                  // current segment
+static uint64_t segment;                    // generation of the current segment
+static long segmentSize;
+static char *buf, *spare;                   // records waiting for the writer, and the last ones written
+static int bufLen, bufSize, spareSize;
+static pthread_mutex_t bufLock = PTHREAD_MUTEX_INITIALIZER;    // for buf, bufLen and bufSize
+static uint64_t compactBelow;               // segments below it are closed
+static pthread_mutex_t compactLock = PTHREAD_MUTEX_INITIALIZER;    // for compactBelow
+static pthread_cond_t compactWake = PTHREAD_COND_INITIALIZER;
+
+
+// function declare
+extern void journalOpen(char *path, int (*addUser)(char *name),
+                        int (*addMail)(int to, int from, time_t time, char *message, uint64_t *pos));
+extern void journalUser(int loc, uint64_t cursor, char *name);
+extern void journalMail(int to, int from, uint64_t pos, time_t time, char *message);
+extern void journalTake(int loc, uint64_t tail, uint64_t cursor);
+extern void journalCast(uint64_t seq, int from, time_t time, int activeOnly, char *message);
+extern int mailCapacity();                        // external function (mailbox.c)
+extern void logLine(const char *format, ...);     // external function (log.c)
+static void journalAppend(int type, char *payload, int len);
+static void* journalWriter(void *arg);
+static void* journalCompactor(void *arg);
+static uint64_t journalLoad(JState *st, uint64_t below);
+static int journalReplay(JState *st, char *file, uint64_t *gen);
+static void journalApply(JState *st, int type, char *p, int len);
+static void journalPending(JUser *user, JMail *mail);
+static void journalSnapshot(JState *st, uint64_t gen);
+static void journalRemove(uint64_t below);
+static int journalEncode(char *rec, int type, char *payload, int len);
+static void journalFree(JState *st);
+static uint32_t journalCheck(int type, char *payload, int len);
+
+
+/****************************************************************
+* Func:   Replay the journal into the server, write a snapshot  *
+*         of the result, open a new segment and start the       *
+*         writer and compactor threads. Call once, after        *
+*         mailConfig and before clients connect                 *
+* Param:  char *path, journal files prefix                      *
+*         int (*addUser)(char *name), record a user, returns    *
+*                 its location                                  *
+*         int (*addMail)(...), put a message in a mailbox,      *
+*                 returns MAIL_OK.. and the mailbox position    *
+* Return: none                                                  *
+****************************************************************/
+void journalOpen(char *path, int (*addUser)(char *name),
+                 int (*addMail)(int to, int from, time_t time, char *message, uint64_t *pos))
+{
+	JState *st = (JState *)calloc(1, sizeof(JState));
+	JState *now = (JState *)calloc(1, sizeof(JState));    // what the server holds after replay
+	long messages = 0;
+	int i, j;
+	pthread_t tid;
+	pthread_attr_t attr;
+	struct timespec start, end;
+	char file[PATHSIZE];
+
+	if(st == NULL || now == NULL)
+	{
+		printf("Allocate journal replay\n");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	journalPath = path;
+	capacity = mailCapacity();
+	segment = journalLoad(st, UINT64_MAX);      // first generation without a segment
+
+	// users in table order; their messages and pending '5' broadcasts merged by time
+	for(i = 0; i < st->users; i++)
+	{
+		JUser *user = &st->user[i], *kept;
+		uint64_t seq = user->cursor;
+
+		if(addUser(user->name) != i)
+		{
+			printf("Journal replay: user %s is not at location %d\n", user->name, i);
+			exit(1);
+		}
+		if(now->users == now->userSize)
+		{
+			now->userSize = now->userSize == 0 ? JOURNALUSERS : now->userSize * 2;
+			if((now->user = (JUser *)realloc(now->user, sizeof(JUser) * now->userSize)) == NULL)
+			{
+				printf("Allocate journal replay\n");
+				exit(1);
+			}
+		}
+		kept = &now->user[now->users++];
+		memset(kept, 0, sizeof(JUser));
+		strcpy(kept->name, user->name);
+
+		if(st->castHead > BCASTSIZE && seq < st->castHead - BCASTSIZE)
+			seq = st->castHead - BCASTSIZE;    // older ones were overwritten in the broadcast log too
+		for(j = 0; j < user->count || seq < st->castHead; )
+		{
+			JMail *cast = seq < st->castHead ? &st->cast[seq % BCASTSIZE] : NULL;
+			JMail next;
+
+			if(cast != NULL && (cast->pos != seq + 1 || cast->activeOnly))
+			{
+				seq++;                          // lost, or a '4' for a session that is gone
+				continue;
+			}
+			if(j < user->count && (cast == NULL || user->mail[j].time <= cast->time))
+			{
+				next = user->mail[j++];
+			}
+			else
+			{
+				next = *cast;
+				seq++;
+			}
+			if(addMail(i, next.from, (time_t)next.time, next.message, &next.pos) >= MAIL_OK)
+			{
+				journalPending(kept, &next);
+				messages++;
+			}
+		}
+	}
+	journalFree(st);
+
+	// the snapshot holds the new mailbox positions, every segment before it is obsolete
+	journalSnapshot(now, segment);
+	journalFree(now);
+	journalRemove(segment);
+	compactBelow = segment;
+
+	snprintf(file, PATHSIZE, "%s.%llu", path, (unsigned long long)segment);
+	if((journalFd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+	{
+		perror("Error on open journal\n");
+		exit(1);
+	}
+	bufSize = spareSize = JOURNALBUFSIZE;
+	buf = (char *)malloc(bufSize);
+	spare = (char *)malloc(spareSize);
+	if(buf == NULL || spare == NULL)
+	{
+		printf("Allocate journal buffer\n");
+		exit(1);
+	}
+	journalAppend(J_GEN, (char *)&segment, sizeof(segment));
+	journalOn = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	logLine("Journal %s: %d users, %ld messages recovered in %.3f s", path, i, messages,
+	        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&tid, &attr, journalWriter, NULL) != 0 || pthread_create(&tid, &attr, journalCompactor, NULL) != 0)
+	{
+		printf("Create journal threads\n");
+		exit(1);
+	}
+}
+
+
+/****************************************************************
+* Func:   Journal a recorded user, the caller holds the table   *
+*         lock so users are journaled in location order         *
+* Param:  int loc, user location                                *
+*         uint64_t cursor, broadcast cursor of the new user     *
+*         char *name, user name                                 *
+* Return: none                                                  *
+****************************************************************/
+void journalUser(int loc, uint64_t cursor, char *name)
+{
+	char p[JOURNALRECORD];
+	int len = strnlen(name, NAMESIZE - 1);
+
+	if(!journalOn)
+		return;
+	memcpy(p, &loc, 4);
+	memcpy(p + 4, &cursor, 8);
+	memcpy(p + 12, name, len);
+	journalAppend(J_USER, p, 12 + len);
+}
+
+
+/****************************************************************
+* Func:   Journal a message put in a mailbox                    *
+* Param:  int to, recipient location                            *
+*         int from, sender location                             *
+*         uint64_t pos, mailbox position of the message         *
+*         time_t time, when the sender sent                     *
+*         char *message, message text                           *
+* Return: none                                                  *
+****************************************************************/
+void journalMail(int to, int from, uint64_t pos, time_t time, char *message)
+{
+	char p[JOURNALRECORD];
+	int64_t t = time;
+	int len = strnlen(message, MESSAGELENGTH);
+
+	if(!journalOn)
+		return;
+	memcpy(p, &to, 4);
+	memcpy(p + 4, &from, 4);
+	memcpy(p + 8, &pos, 8);
+	memcpy(p + 16, &t, 8);
+	memcpy(p + 24, message, len);
+	journalAppend(J_MAIL, p, 24 + len);
+}
+
+
+/****************************************************************
+* Func:   Journal that a user read its messages                 *
+* Param:  int loc, user location                                *
+*         uint64_t tail, mailbox read position after reading    *
+*         uint64_t cursor, broadcast cursor after reading       *
+* Return: none                                                  *
+****************************************************************/
+void journalTake(int loc, uint64_t tail, uint64_t cursor)
+{
+	char p[20];
+
+	if(!journalOn)
+		return;
+	memcpy(p, &loc, 4);
+	memcpy(p + 4, &tail, 8);
+	memcpy(p + 12, &cursor, 8);
+	journalAppend(J_TAKE, p, 20);
+}
+
+
+/****************************************************************
+* Func:   Journal a broadcast                                   *
+* Param:  uint64_t seq, sequence number in the broadcast log    *
+*         int from, sender location                             *
+*         time_t time, when the sender sent                     *
+*         int activeOnly, 1 for '4', 0 for '5'                  *
+*         char *message, message text                           *
+* Return: none                                                  *
+****************************************************************/
+void journalCast(uint64_t seq, int from, time_t time, int activeOnly, char *message)
+{
+	char p[JOURNALRECORD];
+	int64_t t = time;
+	int len = strnlen(message, MESSAGELENGTH);
+
+	if(!journalOn)
+		return;
+	memcpy(p, &seq, 8);
+	memcpy(p + 8, &from, 4);
+	memcpy(p + 12, &t, 8);
+	p[20] = (char)activeOnly;
+	memcpy(p + 21, message, len);
+	journalAppend(J_CAST, p, 21 + len);
+}
+
+
+/****************************************************************
+* Func:   Queue a record for the writer thread                  *
+* Param:  int type, record type                                 *
+*         char *payload, record payload                         *
+*         int len, payload length                               *
+* Return: none                                                  *
+****************************************************************/
+void journalAppend(int type, char *payload, int len)
+{
+	char rec[JOURNALHEADER + JOURNALRECORD + 4];
+	int n = journalEncode(rec, type, payload, len);    // outside the lock
+
+	pthread_mutex_lock(&bufLock);
+	if(bufLen + n > bufSize)                    // the disk is behind, keep everything
+	{
+		bufSize = (bufLen + n) * 2;
+		if((buf = (char *)realloc(buf, bufSize)) == NULL)
+		{
+			printf("Grow journal buffer\n");
+			exit(1);
+		}
+	}
+	memcpy(buf + bufLen, rec, n);
+	bufLen += n;
+	pthread_mutex_unlock(&bufLock);
+}
+
+
+/****************************************************************
+* Func:   Writer thread: every JOURNALSYNCMS write what was     *
+*         appended and fdatasync it (group commit); start a new *
+*         segment once the current one is JOURNALCOMPACT long   *
+* Param:  void *arg, not used                                   *
+* Return: none                                                  *
+****************************************************************/
+void* journalWriter(void *arg)
+{
+	struct timespec tick = {0, JOURNALSYNCMS * 1000000L};
+	char file[PATHSIZE];
+
+	while(1)
+	{
+		char *data;
+		int len, size, off, n;
+
+		nanosleep(&tick, NULL);
+
+		pthread_mutex_lock(&bufLock);           // take the records, appends go to the spare buffer
+		data = buf;
+		len = bufLen;
+		size = bufSize;
+		buf = spare;
+		bufSize = spareSize;
+		bufLen = 0;
+		pthread_mutex_unlock(&bufLock);
+		spare = data;
+		spareSize = size;
+
+		if(len == 0)
+			continue;
+		for(off = 0; off < len; off += n > 0 ? n : 0)
+		{
+			if((n = write(journalFd, data + off, len - off)) == -1 && errno != EINTR)
+			{
+				perror("Error on write journal\n");
+				exit(1);
+			}
+		}
+		fdatasync(journalFd);                   // one sync for every record of the tick
+		segmentSize += len;
+
+		if(segmentSize >= JOURNALCOMPACT)       // next segment, the closed ones are compacted
+		{
+			close(journalFd);
+			segment++;
+			snprintf(file, PATHSIZE, "%s.%llu", journalPath, (unsigned long long)segment);
+			if((journalFd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+			{
+				perror("Error on open journal\n");
+				exit(1);
+			}
+			segmentSize = 0;
+			journalAppend(J_GEN, (char *)&segment, sizeof(segment));
+
+			pthread_mutex_lock(&compactLock);
+			compactBelow = segment;
+			pthread_cond_signal(&compactWake);
+			pthread_mutex_unlock(&compactLock);
+		}
+	}
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Compactor thread: fold the snapshot and the closed    *
+*         segments into a new snapshot, delete the segments.    *
+*         Reads the files only, the server does not wait        *
+* Param:  void *arg, not used                                   *
+* Return: none                                                  *
+****************************************************************/
+void* journalCompactor(void *arg)
+{
+	uint64_t done, below;
+
+	pthread_mutex_lock(&compactLock);
+	done = compactBelow;
+	pthread_mutex_unlock(&compactLock);
+	while(1)
+	{
+		JState *st;
+
+		pthread_mutex_lock(&compactLock);
+		while(compactBelow == done)
+			pthread_cond_wait(&compactWake, &compactLock);
+		below = compactBelow;
+		pthread_mutex_unlock(&compactLock);
+
+		if((st = (JState *)calloc(1, sizeof(JState))) == NULL)
+			continue;                           // try again after the next segment
+		journalLoad(st, below);
+		journalSnapshot(st, below);
+		journalFree(st);
+		journalRemove(below);
+		logLine("Journal %s: segments %llu to %llu compacted", journalPath,
+		        (unsigned long long)done, (unsigned long long)below - 1);
+		done = below;
+	}
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Load the snapshot, then the segments after it up to   *
+*         the first one missing or below                        *
+* Param:  JState *st, empty replay state                        *
+*         uint64_t below, do not load this segment and later    *
+* Return: uint64_t, first segment not loaded                    *
+****************************************************************/
+uint64_t journalLoad(JState *st, uint64_t below)
+{
+	uint64_t gen = 1, g;                        // no snapshot: segments start at 1
+	char file[PATHSIZE];
+
+	snprintf(file, PATHSIZE, "%s.snap", journalPath);
+	journalReplay(st, file, &gen);
+
+	for(; gen < below; gen++)
+	{
+		snprintf(file, PATHSIZE, "%s.%llu", journalPath, (unsigned long long)gen);
+		if(journalReplay(st, file, &g) == -1)
+			break;
+	}
+
+	return gen;
+}
+
+
+/****************************************************************
+* Func:   Apply the records of a journal file, stop at the      *
+*         first torn or damaged one                             *
+* Param:  JState *st, replay state                              *
+*         char *file, snapshot or segment                       *
+*         uint64_t *gen, generation of the file                 *
+* Return: 0 applied                                             *
+*         -1 no such file                                       *
+****************************************************************/
+int journalReplay(JState *st, char *file, uint64_t *gen)
+{
+	struct stat info;
+	char *map, *p, *end;
+	int fd;
+
+	if((fd = open(file, O_RDONLY)) == -1)
+		return -1;
+	if(fstat(fd, &info) == -1 || info.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	if((map = (char *)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		perror("Error on map journal\n");
+		exit(1);
+	}
+	close(fd);
+	madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+	for(p = map, end = map + info.st_size; end - p >= JOURNALHEADER + 4; )
+	{
+		uint32_t len, check;
+
+		memcpy(&len, p, 4);
+		if(len > JOURNALRECORD || end - p < JOURNALHEADER + len + 4)
+			break;                              // torn write
+		memcpy(&check, p + JOURNALHEADER + len, 4);
+		if(check != journalCheck(p[4], p + JOURNALHEADER, len))
+			break;                              // damaged
+		if(p[4] == J_GEN && len == 8)
+			memcpy(gen, p + JOURNALHEADER, 8);
+		else
+			journalApply(st, p[4], p + JOURNALHEADER, len);
+		p += JOURNALHEADER + len + 4;
+	}
+	if(p != end)
+		logLine("Journal %s: %ld bytes after a damaged record ignored", file, (long)(end - p));
+	munmap(map, info.st_size);
+
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Apply one record to a replay state                    *
+* Param:  JState *st, replay state                              *
+*         int type, J_USER, J_MAIL, J_TAKE or J_CAST            *
+*         char *p, payload                                      *
+*         int len, payload length                               *
+* Return: none                                                  *
+****************************************************************/
+void journalApply(JState *st, int type, char *p, int len)
+{
+	JMail mail;
+	JUser *user;
+	uint64_t tail, cursor;
+	int loc, drop;
+
+	memset(&mail, 0, sizeof(JMail));
+	switch(type)
+	{
+		case J_USER:
+			memcpy(&loc, p, 4);
+			if(len < 12 || len - 12 >= NAMESIZE || loc != st->users)
+				break;                          // users come in location order
+			if(st->users == st->userSize)
+			{
+				st->userSize = st->userSize == 0 ? JOURNALUSERS : st->userSize * 2;
+				if((st->user = (JUser *)realloc(st->user, sizeof(JUser) * st->userSize)) == NULL)
+				{
+					printf("Allocate journal replay\n");
+					exit(1);
+				}
+			}
+			user = &st->user[st->users++];
+			memset(user, 0, sizeof(JUser));
+			memcpy(&user->cursor, p + 4, 8);
+			memcpy(user->name, p + 12, len - 12);
+			break;
+
+		case J_MAIL:
+			memcpy(&loc, p, 4);
+			if(len < 24 || len - 24 > MESSAGELENGTH || loc < 0 || loc >= st->users)
+				break;
+			memcpy(&mail.from, p + 4, 4);
+			memcpy(&mail.pos, p + 8, 8);
+			memcpy(&mail.time, p + 16, 8);
+			memcpy(mail.message, p + 24, len - 24);
+			if(mail.pos >= st->user[loc].tail)  // otherwise it was read before its record was written
+				journalPending(&st->user[loc], &mail);
+			break;
+
+		case J_TAKE:
+			memcpy(&loc, p, 4);
+			if(len != 20 || loc < 0 || loc >= st->users)
+				break;
+			user = &st->user[loc];
+			memcpy(&tail, p + 4, 8);
+			memcpy(&cursor, p + 12, 8);
+			if(tail > user->tail)
+			{
+				user->tail = tail;
+				for(drop = 0; drop < user->count && user->mail[drop].pos < tail; drop++);
+				memmove(user->mail, user->mail + drop, sizeof(JMail) * (user->count - drop));
+				user->count -= drop;
+			}
+			if(cursor > user->cursor)
+				user->cursor = cursor;
+			break;
+
+		case J_CAST:
+			if(len < 21 || len - 21 > MESSAGELENGTH)
+				break;
+			memcpy(&cursor, p, 8);              // seq
+			memcpy(&mail.from, p + 8, 4);
+			memcpy(&mail.time, p + 12, 8);
+			mail.activeOnly = p[20];
+			memcpy(mail.message, p + 21, len - 21);
+			mail.pos = cursor + 1;
+			if(mail.pos > st->castHead)
+				st->castHead = mail.pos;
+			if(st->cast[cursor % BCASTSIZE].pos < mail.pos)    // a newer one may be there already
+				st->cast[cursor % BCASTSIZE] = mail;
+			break;
+	}
+}
+
+
+/****************************************************************
+* Func:   Add a pending message to a user, by position; only    *
+*         the last capacity positions are kept, as in the       *
+*         mailbox                                               *
+* Param:  JUser *user, recipient                                *
+*         JMail *mail, message                                  *
+* Return: none                                                  *
+****************************************************************/
+void journalPending(JUser *user, JMail *mail)
+{
+	int i, drop;
+
+	if(user->count == user->size)
+	{
+		user->size = user->size == 0 ? 4 : user->size * 2;
+		if((user->mail = (JMail *)realloc(user->mail, sizeof(JMail) * user->size)) == NULL)
+		{
+			printf("Allocate journal replay\n");
+			exit(1);
+		}
+	}
+	for(i = user->count; i > 0 && user->mail[i - 1].pos > mail->pos; i--);    // mostly at the end
+	memmove(user->mail + i + 1, user->mail + i, sizeof(JMail) * (user->count - i));
+	user->mail[i] = *mail;
+	user->count++;
+
+	// a full mailbox in drop mode dropped the oldest ones without a take record
+	for(drop = 0; drop < user->count && user->mail[drop].pos + capacity <= user->mail[user->count - 1].pos; drop++);
+	if(drop > 0)
+	{
+		memmove(user->mail, user->mail + drop, sizeof(JMail) * (user->count - drop));
+		user->count -= drop;
+	}
+}
+
+
+/****************************************************************
+* Func:   Write a replay state as the snapshot: written aside,  *
+*         synced, then renamed over the old one                 *
+* Param:  JState *st, replay state                              *
+*         uint64_t gen, first segment not in the snapshot       *
+* Return: none                                                  *
+****************************************************************/
+void journalSnapshot(JState *st, uint64_t gen)
+{
+	char file[PATHSIZE], tmp[PATHSIZE], p[JOURNALRECORD];
+	char rec[JOURNALHEADER + JOURNALRECORD + 4];
+	FILE *fp;
+	uint64_t seq;
+	int i, j, len, fd;
+
+	snprintf(file, PATHSIZE, "%s.snap", journalPath);
+	snprintf(tmp, PATHSIZE, "%s.snap.tmp", journalPath);
+	if((fp = fopen(tmp, "w")) == NULL)
+	{
+		perror("Error on open journal snapshot\n");
+		exit(1);
+	}
+	fwrite(rec, 1, journalEncode(rec, J_GEN, (char *)&gen, 8), fp);
+
+	for(i = 0; i < st->users; i++)              // a user, where it read up to, what is pending
+	{
+		JUser *user = &st->user[i];
+
+		len = strlen(user->name);
+		memcpy(p, &i, 4);
+		memcpy(p + 4, &user->cursor, 8);
+		memcpy(p + 12, user->name, len);
+		fwrite(rec, 1, journalEncode(rec, J_USER, p, 12 + len), fp);
+		if(user->tail > 0)
+		{
+			memcpy(p + 4, &user->tail, 8);
+			memcpy(p + 12, &user->cursor, 8);
+			fwrite(rec, 1, journalEncode(rec, J_TAKE, p, 20), fp);
+		}
+		for(j = 0; j < user->count; j++)
+		{
+			JMail *mail = &user->mail[j];
+
+			len = strlen(mail->message);
+			memcpy(p + 4, &mail->from, 4);
+			memcpy(p + 8, &mail->pos, 8);
+			memcpy(p + 16, &mail->time, 8);
+			memcpy(p + 24, mail->message, len);
+			fwrite(rec, 1, journalEncode(rec, J_MAIL, p, 24 + len), fp);
+		}
+	}
+
+	for(seq = st->castHead > BCASTSIZE ? st->castHead - BCASTSIZE : 0; seq < st->castHead; seq++)
+	{
+		JMail *cast = &st->cast[seq % BCASTSIZE];
+
+		if(cast->pos != seq + 1)
+			continue;
+		len = strlen(cast->message);
+		memcpy(p, &seq, 8);
+		memcpy(p + 8, &cast->from, 4);
+		memcpy(p + 12, &cast->time, 8);
+		p[20] = (char)cast->activeOnly;
+		memcpy(p + 21, cast->message, len);
+		fwrite(rec, 1, journalEncode(rec, J_CAST, p, 21 + len), fp);
+	}
+
+	if(fflush(fp) != 0 || fsync(fileno(fp)) == -1 || fclose(fp) != 0 || rename(tmp, file) == -1)
+	{
+		perror("Error on write journal snapshot\n");
+		exit(1);
+	}
+
+	// the rename itself must survive a crash too
+	strcpy(tmp, journalPath);
+	if(strrchr(tmp, '/') != NULL)
+		strrchr(tmp, '/')[1] = '\0';
+	else
+		strcpy(tmp, ".");
+	if((fd = open(tmp, O_RDONLY)) != -1)
+	{
+		fsync(fd);
+		close(fd);
+	}
+}
+
+
+/****************************************************************
+* Func:   Delete the segments below a generation, the snapshot  *
+*         of that generation holds them                         *
+* Param:  uint64_t below, generation of the snapshot            *
+* Return: none                                                  *
+****************************************************************/
+void journalRemove(uint64_t below)
+{
+	char file[PATHSIZE];
+	uint64_t g;
+
+	for(g = below - 1; g > 0; g--)              // segments are contiguous
+	{
+		snprintf(file, PATHSIZE, "%s.%llu", journalPath, (unsigned long long)g);
+		if(unlink(file) == -1)
+			break;
+	}
+}
+
+
+/****************************************************************
+* Func:   Encode a record: payload length, type, payload and    *
+*         checksum                                              *
+* Param:  char *rec, JOURNALHEADER + JOURNALRECORD + 4 chars    *
+*         int type, record type                                 *
+*         char *payload, record payload                         *
+*         int len, payload length, at most JOURNALRECORD        *
+* Return: int, length of the record                             *
+****************************************************************/
+int journalEncode(char *rec, int type, char *payload, int len)
+{
+	uint32_t n = len, check = journalCheck(type, payload, len);
+
+	memcpy(rec, &n, 4);
+	rec[4] = (char)type;
+	memcpy(rec + JOURNALHEADER, payload, len);
+	memcpy(rec + JOURNALHEADER + len, &check, 4);
+
+	return JOURNALHEADER + len + 4;
+}
+
+
+/****************************************************************
+* Func:   Release a replay state                                *
+* Param:  JState *st, replay state                              *
+* Return: none                                                  *
+****************************************************************/
+void journalFree(JState *st)
+{
+	int i;
+
+	for(i = 0; i < st->users; i++)
+		free(st->user[i].mail);
+	free(st->user);
+	free(st);
+}
+
+
+/****************************************************************
+* Func:   FNV-1a checksum of a record type and payload          *
+* Param:  int type, record type                                 *
+*         char *payload, record payload                         *
+*         int len, payload length                               *
+* Return: uint32_t, checksum                                    *
+****************************************************************/
+uint32_t journalCheck(int type, char *payload, int len)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	hash = (hash ^ (unsigned char)type) * 16777619u;
+	for(i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)payload[i]) * 16777619u;
+
+	return hash;
+}
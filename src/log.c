@@ -0,0 +1,341 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Asynchronous log: per-thread lock-free rings drained by a writer thread                  **
+**                                                                                           **
+**  A thread formats a line straight into its own ring (single producer, single consumer,    **
+**  no lock, no system call) and goes on serving its client. The writer thread wakes up      **
+**  every LOGFLUSHMS, or as soon as a ring is half full, writes what the rings hold to       **
+**  stdout or to a log file, and rotates the file once it reaches LOGROTATESIZE (file,       **
+**  file.1 ... file.LOGKEEP). A full ring drops the line and counts it instead of waiting.   **
+**  The writer also keeps a coarse clock, updated on every wake up, so callers need neither  **
+**  time() nor localtime() for each line.                                                    **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        void logInit(char *file);                   // start the writer, NULL: stdout      **
+**        void logLine(const char *format, ...);      // queue a line, never waits           **
+**        time_t logTime();                           // coarse clock, seconds               **
+**    - Internal:                                                                            **
+**        LogRing* logRing();                         // ring of the calling thread          **
+**        void logRelease(void *ring);                // owner thread exits                  **
+**        void* logWriter(void *arg);                 // drain rings, write, rotate          **
+**        void logWrite(char *data, int len);         // write to the log, rotate if needed  **
+**        void logOpen();                             // open (or create) the log file       **
+**        void logRotate();                           // shift file -> file.1 -> file.2 ...  **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOGLINE 512             // max characters for a line
+#define LOGRINGSIZE 32768       // bytes queued for each thread, power of 2
+#define LOGFLUSHMS 10           // writer wakes up every 10 ms
+#define LOGROTATESIZE (64L << 20)    // rotate the log file at 64 MB
+#define LOGKEEP 4               // rotated files kept: file.1 ... file.4
+#define LOGNAMESIZE 256
+#define CACHELINE 64
+
+typedef struct LogRing{
+	_Alignas(CACHELINE) atomic_uint_fast64_t head;    // bytes queued, moved by the owner thread
+	char pad1[CACHELINE - sizeof(atomic_uint_fast64_t)];
+	atomic_uint_fast64_t tail;              // bytes written, moved by the writer thread
+	char pad2[CACHELINE - sizeof(atomic_uint_fast64_t)];
+	atomic_uint_fast64_t dropped;           // lines dropped, ring was full
+	atomic_int closed;                      // owner thread exited, free once drained
+	struct LogRing *next;                   // list of all rings, see logWriter
+	char data[LOGRINGSIZE];
+} LogRing;
+
+static LogRing *rings;                      // every thread that logged
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;    // for rings
+static pthread_key_t ringKey;               // ring of a thread, released when it exits
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeWriter = PTHREAD_COND_INITIALIZER;    // a ring is half full
+static atomic_llong coarseTime;             // seconds, updated by the writer
+static int logFd = 1;                       // stdout unless a file is given
+static char *logFile;                       // NULL: stdout, no rotation
+static long logSize;                        // bytes in the current file
+
+
+// function declare
+extern void logInit(char *file);
+extern void logLine(const char *format, ...);
+extern time_t logTime();
+static LogRing* logRing();
+static void logRelease(void *ring);
+static void* logWriter(void *arg);
+static void logWrite(char *data, int len);
+static void logOpen();
+static void logRotate();
+
+
+/****************************************************************
+* Func:   Start the writer thread                               *
+* Param:  char *file, log file, NULL for stdout                 *
+* Return: none                                                  *
+****************************************************************/
+void logInit(char *file)
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	atomic_store(&coarseTime, time(NULL));
+	pthread_key_create(&ringKey, logRelease);
+	if(file != NULL)
+	{
+		logFile = file;
+		logOpen();
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&tid, &attr, logWriter, NULL) != 0)
+	{
+		printf("Create log writer thread\n");
+		exit(1);
+	}
+}
+
+
+/****************************************************************
+* Func:   Queue a line for the log, printf format, a '\n' is    *
+*         added. Never waits: a full ring drops the line        *
+* Param:  const char *format, printf format                     *
+*         ..., printf arguments                                 *
+* Return: none                                                  *
+****************************************************************/
+void logLine(const char *format, ...)
+{
+	LogRing *ring = logRing();
+	char line[LOGLINE];
+	uint_fast64_t head, tail;
+	int len, pos, first;
+	va_list args;
+
+	va_start(args, format);
+	len = vsnprintf(line, LOGLINE - 1, format, args);
+	va_end(args);
+	if(len < 0)
+		return;
+	if(len > LOGLINE - 2)                   // cut, keep room for '\n'
+		len = LOGLINE - 2;
+	line[len++] = '\n';
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if(head - tail + len > LOGRINGSIZE)     // writer is behind
+	{
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	pos = head & (LOGRINGSIZE - 1);
+	first = len < LOGRINGSIZE - pos ? len : LOGRINGSIZE - pos;
+	memcpy(ring->data + pos, line, first);
+	memcpy(ring->data, line + first, len - first);    // wrapped part, if any
+	atomic_store_explicit(&ring->head, head + len, memory_order_release);    // publish to writer
+	
+	// crossing half full: wake the writer early, once per half ring at most
+	if(head - tail < LOGRINGSIZE / 2 && head + len - tail >= LOGRINGSIZE / 2)
+		pthread_cond_signal(&wakeWriter);
+}
+
+
+/****************************************************************
+* Func:   Coarse clock, updated by the writer every LOGFLUSHMS  *
+* Param:  none                                                  *
+* Return: time_t, seconds since the epoch                       *
+****************************************************************/
+time_t logTime()
+{
+	return (time_t)atomic_load_explicit(&coarseTime, memory_order_relaxed);
+}
+
+
+/****************************************************************
+* Func:   Ring of the calling thread, created on first use      *
+* Param:  none                                                  *
+* Return: LogRing*, ring of the thread                          *
+****************************************************************/
+LogRing* logRing()
+{
+	LogRing *ring = (LogRing *)pthread_getspecific(ringKey);
+
+	if(ring == NULL)
+	{
+		if((ring = (LogRing *)aligned_alloc(CACHELINE, sizeof(LogRing))) == NULL)
+		{
+			printf("Allocate log ring\n");
+			exit(1);
+		}
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_init(&ring->dropped, 0);
+		atomic_init(&ring->closed, 0);
+		pthread_setspecific(ringKey, ring);
+
+		pthread_mutex_lock(&ringLock);
+		ring->next = rings;
+		rings = ring;
+		pthread_mutex_unlock(&ringLock);
+	}
+
+	return ring;
+}
+
+
+/****************************************************************
+* Func:   Owner thread exits, the writer frees the ring after   *
+*         writing what is left in it                            *
+* Param:  void *ring, ring of the thread (LogRing *)            *
+* Return: none                                                  *
+****************************************************************/
+void logRelease(void *ring)
+{
+	atomic_store_explicit(&((LogRing *)ring)->closed, 1, memory_order_release);
+}
+
+
+/****************************************************************
+* Func:   Writer thread: every LOGFLUSHMS update the coarse     *
+*         clock, write every ring to the log, free the rings of *
+*         exited threads                                        *
+* Param:  void *arg, not used                                   *
+* Return: none                                                  *
+****************************************************************/
+void* logWriter(void *arg)
+{
+	struct timespec wake;
+	char note[80];
+
+	while(1)
+	{
+		LogRing **link, *ring;
+
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += LOGFLUSHMS * 1000000L;
+		if(wake.tv_nsec >= 1000000000L)
+		{
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&wakeLock);       // a missed signal only costs the rest of the tick
+		pthread_cond_timedwait(&wakeWriter, &wakeLock, &wake);
+		pthread_mutex_unlock(&wakeLock);
+		atomic_store_explicit(&coarseTime, time(NULL), memory_order_relaxed);
+
+		pthread_mutex_lock(&ringLock);        // new threads add rings meanwhile
+		link = &rings;
+		while((ring = *link) != NULL)
+		{
+			int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+			uint_fast64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+			uint_fast64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			uint_fast64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+
+			if(head != tail)
+			{
+				int pos = tail & (LOGRINGSIZE - 1);
+				int len = (int)(head - tail);
+				int first = len < LOGRINGSIZE - pos ? len : LOGRINGSIZE - pos;
+
+				logWrite(ring->data + pos, first);
+				logWrite(ring->data, len - first);
+				atomic_store_explicit(&ring->tail, head, memory_order_release);    // room for the owner
+			}
+			if(dropped > 0)
+				logWrite(note, sprintf(note, "log: %llu lines dropped, writer too slow\n", (unsigned long long)dropped));
+
+			if(closed)                         // nothing more will come from this ring
+			{
+				*link = ring->next;
+				free(ring);
+			}
+			else
+			{
+				link = &ring->next;
+			}
+		}
+		pthread_mutex_unlock(&ringLock);
+	}
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Write to the log, rotate the file when it is full     *
+* Param:  char *data, bytes to write                            *
+*         int len, number of bytes                              *
+* Return: none                                                  *
+****************************************************************/
+void logWrite(char *data, int len)
+{
+	while(len > 0)
+	{
+		int n = write(logFd, data, len);
+
+		if(n == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return;                            // log lost, the server goes on
+		}
+		data += n;
+		len -= n;
+		logSize += n;
+	}
+
+	if(logFile != NULL && logSize >= LOGROTATESIZE)
+		logRotate();
+}
+
+
+/****************************************************************
+* Func:   Open the log file for appending                       *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void logOpen()
+{
+	if((logFd = open(logFile, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+	{
+		perror("Error on open log file\n");
+		exit(1);
+	}
+	logSize = lseek(logFd, 0, SEEK_END);
+}
+
+
+/****************************************************************
+* Func:   Rotate the log file: file.3 -> file.4, ...,           *
+*         file -> file.1, then start an empty file              *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void logRotate()
+{
+	char from[LOGNAMESIZE], to[LOGNAMESIZE];
+	int i;
+
+	close(logFd);
+	for(i = LOGKEEP - 1; i >= 1; i--)
+	{
+		snprintf(from, LOGNAMESIZE, "%s.%d", logFile, i);
+		snprintf(to, LOGNAMESIZE, "%s.%d", logFile, i + 1);
+		rename(from, to);                      // missing ones are fine
+	}
+	snprintf(to, LOGNAMESIZE, "%s.1", logFile);
+	rename(logFile, to);
+	logOpen();
+}
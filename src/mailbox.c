@@ -0,0 +1,444 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Mailbox of a user: bounded lock-free ring of fixed size message records                  **
+**                                                                                           **
+**  Any number of senders enqueue at the same time without a lock (sequence numbered cells,  **
+**  one compare-and-swap per message), the owner drains it without touching the allocator.   **
+**  The owner may also claim ready records and read them in place (a reply is sent straight  **
+**  from the cells). Claimed records stay held, oldest first, until the owner releases them: **
+**  at once when the reply is out ('6', push) or when the client acks them (cursor fetch),   **
+**  so a client that drops mid-read fetches them again. A full mailbox whose oldest cells    **
+**  are held rejects new messages even in drop mode.                                         **
+**  The ring of a user is carved from a slab the first time a message is sent to that user.  **
+**  A full mailbox either rejects the new message or drops the oldest one (mailConfig).      **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        void mailConfig(int size, int drop);        // set capacity and overflow policy    **
+**        int mailPut(Mailbox **box, int from, time_t time, char *message, uint64_t *at);    **
+**                                                    // enqueue a message                   **
+**        int mailGet(Mailbox *box, int *from, time_t *time, char *message);                 **
+**                                                    // dequeue the oldest message          **
+**        int mailCount(Mailbox *box);                // number of queued messages           **
+**        uint64_t mailTail(Mailbox *box);            // oldest position not released yet    **
+**        int mailClaim(Mailbox *box, uint64_t *first, int more);                            **
+**                                                    // claim ready records, hold them      **
+**        char* mailAt(Mailbox *box, uint64_t pos, int *from, time_t *time, int *len);       **
+**                                                    // read a claimed record in place      **
+**        void mailRelease(Mailbox *box, uint64_t upTo);                                     **
+**                                                    // free held records for senders       **
+**        int mailCapacity();                         // max messages for a user             **
+**    - Internal:                                                                            **
+**        Mailbox* mailAlloc();                       // take an empty ring from the slab    **
+**        void mailFree(Mailbox *box);                // give a ring back to the slab        **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MESSAGELENGTH 80        // max 80 characters for a message
+#define MESSAGESIZE 10          // default: max 10 messages for a user
+#define MAILSLABSIZE 256        // rings carved from one slab allocation
+#define CACHELINE 64
+
+#define MAIL_OK 0               // message recorded
+#define MAIL_DROPPED 1          // message recorded, oldest message dropped
+#define MAIL_FULL -1            // mailbox full, message rejected
+#define MAIL_NOMEM -2           // no memory for a mailbox
+
+typedef struct{
+	atomic_uint_fast64_t seq;   // position + 1: ready to read, position + capacity: ready to write
+	time_t time;                // when the sender sends, formatted at delivery
+	int from;                   // sender location in known user table, its name is looked up at delivery
+	unsigned char len;          // characters in message
+	char message[MESSAGELENGTH + 1];
+} MailRecord;                   // 104 bytes, no padding between the fields
+
+typedef struct Mailbox{
+	atomic_uint_fast64_t head;              // next position to write, shared by senders
+	char pad1[CACHELINE - sizeof(atomic_uint_fast64_t)];
+	atomic_uint_fast64_t tail;              // next position to read
+	atomic_uint_fast64_t held;              // positions from acked below it are claimed, not released yet, 0: none
+	atomic_uint_fast64_t acked;             // oldest held position, owner only writes it
+	char pad2[CACHELINE - 3 * sizeof(atomic_uint_fast64_t)];
+	struct Mailbox *next;                   // free list of the slab
+	MailRecord slot[];                      // mailConfig capacity records
+} Mailbox;
+
+
+static int capacity = MESSAGESIZE;          // records in each ring
+static int dropOldest = 0;                  // 1: drop oldest on overflow, 0: reject new message
+static size_t mailSize;                     // bytes for a ring, header and records
+
+static pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+static char *slabNext;                      // unused part of the current slab
+static int slabLeft;                        // rings left in the current slab
+static Mailbox *freeBoxes;                  // rings given back, reused first
+
+
+// function declare
+extern void mailConfig(int size, int drop);
+extern int mailPut(Mailbox **box, int from, time_t time, char *message, uint64_t *at);
+extern int mailGet(Mailbox *box, int *from, time_t *time, char *message);
+extern int mailCount(Mailbox *box);
+extern uint64_t mailTail(Mailbox *box);
+extern int mailClaim(Mailbox *box, uint64_t *first, int more);
+extern char* mailAt(Mailbox *box, uint64_t pos, int *from, time_t *time, int *len);
+extern void mailRelease(Mailbox *box, uint64_t upTo);
+extern int mailCapacity();
+static Mailbox* mailAlloc();
+static void mailFree(Mailbox *box);
+
+
+/****************************************************************
+* Func:   Set mailbox capacity and overflow policy, call once   *
+*         before the first message                              *
+* Param:  int size, max messages for a user                     *
+*         int drop, 1: drop the oldest message when full        *
+*                   0: reject the new message when full         *
+* Return: none                                                  *
+****************************************************************/
+void mailConfig(int size, int drop)
+{
+	if(size > 0)
+		capacity = size;
+	dropOldest = drop;
+}
+
+
+/****************************************************************
+* Func:   Max messages kept for a user                          *
+* Param:  none                                                  *
+* Return: int, mailbox capacity                                 *
+****************************************************************/
+int mailCapacity()
+{
+	return capacity;
+}
+
+
+/****************************************************************
+* Func:   Enqueue a message, safe for many senders at once      *
+* Param:  Mailbox **box, mailbox of the recipient, allocated    *
+*                        here if NULL                           *
+*         int from, sender location                             *
+*         time_t time, when the sender sends                    *
+*         char *message, text to be recorded                    *
+*         uint64_t *at, position of the message in the mailbox  *
+*                       (NULL to discard)                       *
+* Return: MAIL_OK, MAIL_DROPPED, MAIL_FULL or MAIL_NOMEM        *
+****************************************************************/
+int mailPut(Mailbox **box, int from, time_t time, char *message, uint64_t *at)
+{
+	Mailbox *mbox = atomic_load_explicit((Mailbox * _Atomic *)box, memory_order_acquire);
+	MailRecord *cell;
+	uint_fast64_t pos, seq;
+	int result = MAIL_OK;
+
+	if(mbox == NULL)            // first message for this user
+	{
+		Mailbox *expect = NULL;
+
+		if((mbox = mailAlloc()) == NULL)
+			return MAIL_NOMEM;
+		if(!atomic_compare_exchange_strong((Mailbox * _Atomic *)box, &expect, mbox))
+		{
+			mailFree(mbox);     // another sender was first
+			mbox = expect;
+		}
+	}
+
+	pos = atomic_load_explicit(&mbox->head, memory_order_relaxed);
+	while(1)
+	{
+		cell = &mbox->slot[pos % capacity];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+		if(seq == pos)          // free cell, claim it
+		{
+			if(atomic_compare_exchange_weak_explicit(&mbox->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if((int_fast64_t)(seq - pos) < 0)    // full, oldest record is not read yet
+		{
+			uint_fast64_t oldest = pos - capacity;
+
+			if(!dropOldest || atomic_load_explicit(&mbox->held, memory_order_acquire) != 0)
+				return MAIL_FULL;                 // or the oldest ones are held
+			// drop exactly the record in this cell once it is written: fails if the owner
+			// read it or claimed it meanwhile, then the held range is rechecked next round
+			if(seq == oldest + 1 && atomic_compare_exchange_strong_explicit(&mbox->tail, &oldest, oldest + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				atomic_store_explicit(&cell->seq, pos, memory_order_release);    // free for this sender
+				result = MAIL_DROPPED;
+			}
+			pos = atomic_load_explicit(&mbox->head, memory_order_relaxed);
+		}
+		else                    // another sender took the cell
+		{
+			pos = atomic_load_explicit(&mbox->head, memory_order_relaxed);
+		}
+	}
+
+	cell->from = from;
+	cell->time = time;
+	cell->len = strnlen(message, MESSAGELENGTH);    // copies the text only, no padding
+	memcpy(cell->message, message, cell->len);
+	cell->message[cell->len] = '\0';
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);    // publish to reader
+	if(at != NULL)
+		*at = pos;
+
+	return result;
+}
+
+
+/****************************************************************
+* Func:   Dequeue the oldest message                            *
+* Param:  Mailbox *box, mailbox to read                         *
+*         int *from, sender location (NULL to discard)          *
+*         time_t *time, when the sender sent (NULL to discard)  *
+*         char *message, MESSAGELENGTH + 1 chars (NULL to       *
+*                        discard)                               *
+* Return: 1 got a message                                       *
+*         0 mailbox is empty                                    *
+****************************************************************/
+int mailGet(Mailbox *box, int *from, time_t *time, char *message)
+{
+	MailRecord *cell;
+	uint_fast64_t pos, seq;
+
+	if(box == NULL)             // nobody sent anything yet
+		return 0;
+
+	pos = atomic_load_explicit(&box->tail, memory_order_relaxed);
+	while(1)
+	{
+		cell = &box->slot[pos % capacity];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+		if(seq == pos + 1)      // written, claim it
+		{
+			if(atomic_compare_exchange_weak_explicit(&box->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if((int_fast64_t)(seq - (pos + 1)) < 0)    // empty
+		{
+			return 0;
+		}
+		else                    // a sender dropped it first
+		{
+			pos = atomic_load_explicit(&box->tail, memory_order_relaxed);
+		}
+	}
+
+	if(from != NULL)
+		*from = cell->from;
+	if(time != NULL)
+		*time = cell->time;
+	if(message != NULL)
+		memcpy(message, cell->message, cell->len + 1);
+	atomic_store_explicit(&cell->seq, pos + capacity, memory_order_release);    // free for next round
+
+	return 1;
+}
+
+
+/****************************************************************
+* Func:   Number of messages in a mailbox                       *
+* Param:  Mailbox *box, mailbox to check                        *
+* Return: int, queued and held messages (a snapshot, may        *
+*         change)                                               *
+****************************************************************/
+int mailCount(Mailbox *box)
+{
+	if(box == NULL)
+		return 0;
+
+	return (int)(atomic_load(&box->head) - mailTail(box));
+}
+
+
+/****************************************************************
+* Func:   Oldest position not released yet: every message put   *
+*         at a lower position was read or dropped               *
+* Param:  Mailbox *box, mailbox to check                        *
+* Return: uint64_t, read position (0 for no mailbox)            *
+****************************************************************/
+uint64_t mailTail(Mailbox *box)
+{
+	if(box == NULL)
+		return 0;
+
+	if(atomic_load_explicit(&box->held, memory_order_relaxed) != 0)
+		return atomic_load_explicit(&box->acked, memory_order_relaxed);
+	return atomic_load_explicit(&box->tail, memory_order_relaxed);
+}
+
+
+/****************************************************************
+* Func:   Claim up to more ready records after the held ones,   *
+*         oldest first. They stay in their cells until          *
+*         mailRelease, the owner reads them with mailAt. While  *
+*         records are held no sender drops one, so the held     *
+*         ones are always in a row. Owner only                  *
+* Param:  Mailbox *box, mailbox to read                         *
+*         uint64_t *first, oldest held position (read position  *
+*                          if none is held)                     *
+*         int more, max records to claim, 0 claims none         *
+* Return: int, number of held records, from first on            *
+****************************************************************/
+int mailClaim(Mailbox *box, uint64_t *first, int more)
+{
+	uint_fast64_t pos, held;
+	int count;
+
+	*first = 0;
+	if(box == NULL)             // nobody sent anything yet
+		return 0;
+
+	held = atomic_load_explicit(&box->held, memory_order_relaxed);
+	pos = atomic_load_explicit(&box->tail, memory_order_relaxed);
+	while(1)
+	{
+		for(count = 0; count < more && count < capacity; count++)    // written ones in a row
+		{
+			if(atomic_load_explicit(&box->slot[(pos + count) % capacity].seq, memory_order_acquire) != pos + count + 1)
+				break;
+		}
+		if(count == 0)
+			break;
+		if(held == 0)
+			atomic_store_explicit(&box->acked, pos, memory_order_relaxed);
+		atomic_store_explicit(&box->held, pos + count, memory_order_relaxed);    // before senders can see them gone
+		if(atomic_compare_exchange_weak_explicit(&box->tail, &pos, pos + count, memory_order_acq_rel, memory_order_relaxed))
+		{
+			held = pos + count;
+			break;
+		}
+		atomic_store_explicit(&box->held, held, memory_order_relaxed);    // a sender dropped the oldest, again
+	}
+
+	if(held == 0)               // nothing held
+	{
+		*first = pos;
+		return 0;
+	}
+	*first = atomic_load_explicit(&box->acked, memory_order_relaxed);
+
+	return (int)(held - *first);
+}
+
+
+/****************************************************************
+* Func:   Read a held record in place                           *
+* Param:  Mailbox *box, mailbox of the claim                    *
+*         uint64_t pos, held position, see mailClaim            *
+*         int *from, sender location                            *
+*         time_t *time, when the sender sent                    *
+*         int *len, characters in the message                   *
+* Return: char*, message text, valid until mailRelease          *
+****************************************************************/
+char* mailAt(Mailbox *box, uint64_t pos, int *from, time_t *time, int *len)
+{
+	MailRecord *cell = &box->slot[pos % capacity];
+
+	*from = cell->from;
+	*time = cell->time;
+	*len = cell->len;
+
+	return cell->message;
+}
+
+
+/****************************************************************
+* Func:   Free held records below a position for senders, the   *
+*         oldest first. Owner only                              *
+* Param:  Mailbox *box, mailbox of the claims                   *
+*         uint64_t upTo, records below it are released (held    *
+*                        ones only, later ones stay held)       *
+* Return: none                                                  *
+****************************************************************/
+void mailRelease(Mailbox *box, uint64_t upTo)
+{
+	uint64_t pos, held;
+
+	if(box == NULL || (held = atomic_load_explicit(&box->held, memory_order_relaxed)) == 0)
+		return;                 // nothing held
+
+	if(upTo > held)
+		upTo = held;
+	for(pos = atomic_load_explicit(&box->acked, memory_order_relaxed); pos < upTo; pos++)
+		atomic_store_explicit(&box->slot[pos % capacity].seq, pos + capacity, memory_order_release);
+	atomic_store_explicit(&box->acked, pos, memory_order_relaxed);
+	if(pos == held)
+		atomic_store_explicit(&box->held, 0, memory_order_release);
+}
+
+
+/****************************************************************
+* Func:   Take an empty ring, from the free list or the slab    *
+* Param:  none                                                  *
+* Return: Mailbox*, empty ring                                  *
+*         NULL, out of memory                                   *
+****************************************************************/
+Mailbox* mailAlloc()
+{
+	Mailbox *box;
+	int i;
+
+	pthread_mutex_lock(&slabLock);
+	if(mailSize == 0)
+		mailSize = (sizeof(Mailbox) + sizeof(MailRecord) * capacity + CACHELINE - 1) / CACHELINE * CACHELINE;
+
+	if(freeBoxes != NULL)
+	{
+		box = freeBoxes;
+		freeBoxes = box->next;
+	}
+	else
+	{
+		if(slabLeft == 0)       // carve rings for the next MAILSLABSIZE users at once
+		{
+			if((slabNext = (char *)aligned_alloc(CACHELINE, mailSize * MAILSLABSIZE)) == NULL)
+			{
+				pthread_mutex_unlock(&slabLock);
+				return NULL;
+			}
+			slabLeft = MAILSLABSIZE;
+		}
+		box = (Mailbox *)slabNext;
+		slabNext += mailSize;
+		slabLeft--;
+	}
+	pthread_mutex_unlock(&slabLock);
+
+	atomic_init(&box->head, 0);
+	atomic_init(&box->tail, 0);
+	atomic_init(&box->held, 0);
+	atomic_init(&box->acked, 0);
+	for(i = 0; i < capacity; i++)
+		atomic_init(&box->slot[i].seq, i);
+
+	return box;
+}
+
+
+/****************************************************************
+* Func:   Give an unused ring back                              *
+* Param:  Mailbox *box, ring to give back                       *
+* Return: none                                                  *
+****************************************************************/
+void mailFree(Mailbox *box)
+{
+	pthread_mutex_lock(&slabLock);
+	box->next = freeBoxes;
+	freeBoxes = box;
+	pthread_mutex_unlock(&slabLock);
+}
@@ -0,0 +1,1060 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Event driven server mode, epoll with a fixed number of worker threads                    **
+**                                                                                           **
+**  Each worker owns an epoll instance, the accept loop hands every new connection to one    **
+**  worker (round robin). Sockets are non-blocking and edge-triggered, every connection is   **
+**  a small state machine (log in -> command -> arguments) driving the same '1'..'7'         **
+**  requests as handleClient in server.c.                                                    **
+**  A worker puts the connections its epoll instance reports ready on its run queue and      **
+**  serves them from the front; a worker with nothing to do steals from the back of the      **
+**  others' queues, and is woken up for it when a queue holds more than one. A connection    **
+**  is served by one worker at a time (RunState); the owner frees one closed elsewhere.      **
+**  Connections beyond the limit of server.c get a busy 'E' reply at accept (serverAdmit).   **
+**  A connection whose large reply still waits for the socket (writePayload, communicate.c)  **
+**  reads no more requests until the reply is out: a peer that does not read is held back    **
+**  by TCP, not by server memory.                                                            **
+**  Sharded mode has no accept loop: every shard has its own SO_REUSEPORT listener, the      **
+**  kernel spreads new connections over them. A user belongs to the shard picked by the      **
+**  hash of its name; once logged in, a connection accepted elsewhere is posted to it. A     **
+**  message for a subscribed user of another shard is posted too, the shard of the user      **
+**  pushes it. Posts wake a shard through an eventfd in its epoll instance. The user table,  **
+**  mailboxes and broadcast log stay shared (see server.c), shards own connections.          **
+**  Idle connections: every worker or shard has a hashed timing wheel of WHEELSLOTS one      **
+**  second slots, a connection sits in the slot of the second it may have gone idle at. A    **
+**  read only stamps the connection (seen), the wheel is not touched: once the slot comes    **
+**  up, a connection that read meanwhile moves to seen + idle, O(1) whatever the number of   **
+**  connections. One silent for idle seconds gets a ping (v2 opcode 2, the client answers    **
+**  with opcode 3) and is closed if it stays silent idle / 2 more seconds; one that never    **
+**  logged in is closed at once. A v1 connection cannot be pinged, TCP keepalive (server.c)  **
+**  finds a peer that is gone. Closing logs the user out, the name can log in again.         **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        void reactorRun(int sd, int workers);       // accept loop, never returns          **
+**        void reactorShards(int *sd, int shards);    // sharded event loops, never returns  **
+**        int reactorPush(int loc, char *name);       // post a push to the shard of a user  **
+**        void reactorIdle(int seconds);              // idle timeout, 0: none               **
+**    - Internal:                                                                            **
+**        void shardInit(Shard *s, int index, int sd); // epoll, listener of a shard         **
+**        void* reactorWorker(void *arg);             // event loop of a worker or shard     **
+**        void shardAccept(Shard *s);                 // accept on the listener of a shard   **
+**        void shardPost(Shard *s, Connection *conn, int loc);                               **
+**                                                    // hand work over to a shard           **
+**        void shardDrain(Shard *s);                  // serve what other shards posted      **
+**        void runPut(Shard *s, Connection *conn);    // queue a ready connection            **
+**        Connection* runTake(Shard *s, int steal);   // next connection to serve            **
+**        Connection* runSteal(Shard *s);             // take work queued by another worker  **
+**        void runWake(Shard *s);                     // wake idle workers to steal          **
+**        void connServe(Shard *s, Connection *conn); // serve a connection until it is idle **
+**        int connOpen(Shard *s, int sd);             // new connection in an epoll instance **
+**        int connRead(Connection *conn);             // read and process available frames   **
+**        int connFrame(Connection *conn, char *frame);                                      **
+**                                                    // advance connection state machine    **
+**        void connClose(Shard *s, Connection *conn); // log out and release a connection    **
+**        void connIdle(Shard *s, Connection *conn);  // ping or close a silent connection   **
+**        uint64_t wheelClock();                      // seconds of the timing wheels        **
+**        void wheelSet(Shard *s, Connection *conn, uint64_t due);                           **
+**                                                    // put a connection in a wheel slot    **
+**        void wheelCancel(Shard *s, Connection *conn);                                      **
+**                                                    // take a connection out of the wheel  **
+**        void wheelExpire(Shard *s);                 // handle the slots up to now          **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define NAMESIZE 80             // max characters for a name
+#define BATCHSIZE 65536         // max characters for a request frame, a batch of messages
+#define MAXEVENTS 256           // events handled per epoll_wait
+#define ARENASIZE 1024          // first block of a connection arena, argument frames of a request
+#define POSTINITSIZE 64         // initial room for posts to a shard
+#define RUNINITSIZE 256         // initial room in a run queue
+#define WHEELSLOTS 512          // one second slots of a timing wheel, longer timeouts go round
+#define OP_PING 2               // v2 frame type of a ping to an idle connection
+#define OP_PONG 3               // v2 frame type of the answer, not a request
+
+typedef enum{
+	CONN_LOGIN,                 // waiting for user name
+	CONN_COMMAND,               // waiting for a command
+	CONN_ARGS                   // waiting for the frames following a command
+} ConnState;
+
+typedef enum{
+	RUN_IDLE,                   // waiting for events
+	RUN_QUEUED,                 // on a run queue
+	RUN_SERVED,                 // a worker is serving it
+	RUN_AGAIN,                  // served, and new events came meanwhile
+	RUN_CLOSED                  // closed, waiting to be freed by its owner
+} RunState;
+
+typedef struct Arena Arena;   // per-connection bump allocator, see arena.c
+typedef struct Shard Shard;
+
+typedef struct Connection{
+	int sd;
+	ConnState state;
+	int loc;                    // user location in known user table
+	char name[NAMESIZE];
+	char command[2];            // command waiting for its arguments
+	char *args[2];              // recipient and/or message, from arena
+	Arena *arena;               // memory of the request being received, reset once served
+	int argCount;               // frames expected after command
+	int argRead;                // frames received after command
+	Shard *owner;               // worker or shard whose epoll instance has sd
+	atomic_int sched;           // RunState
+	struct Connection *next;    // closed ones waiting for the owner
+	struct Connection *wheelPrev, *wheelNext;    // slot of the owner's wheel, under its wheelLock
+	uint64_t due;               // second of the slot, 0: not in the wheel
+	atomic_uint_fast64_t seen;  // second of the last read, by whoever serves it
+	int pinged;                 // 1: pinged, closed unless it reads before due
+} Connection;                   // receive/send buffers are kept by communicate.c
+
+typedef struct{
+	Connection *conn;           // connection handed over after log in, NULL: push to loc
+	int loc;                    // user to push pending messages to
+} ShardPost;
+
+struct Shard{
+	int index;                  // position in shard or worker
+	int epfd;
+	int listenSd;               // SO_REUSEPORT listener, -1: none (worker)
+	int wakeFd;                 // eventfd, readable once something is posted or to steal
+	pthread_mutex_t lock;       // for post and postCount
+	ShardPost *post;            // posted by other shards, served in order
+	int postCount;
+	int postSize;
+	ShardPost *spare;           // swapped with post while serving, no copy
+	int spareSize;
+	pthread_mutex_t runLock;    // for run, runHead, runCount and dead
+	Connection **run;           // ready connections, a ring: served from the front, stolen from the back
+	int runHead;
+	int runCount;
+	int runSize;
+	Connection *dead;           // closed by another worker, freed once the events of the owner are queued
+	atomic_int idle;            // 1: waiting for events, may be woken up to steal
+	pthread_mutex_t wheelLock;  // for wheel, wheelTick and the wheel links of connections
+	Connection **wheel;         // timing wheel, WHEELSLOTS lists of connections by due % WHEELSLOTS
+	uint64_t wheelTick;         // slots up to this second are handled
+};
+
+static Shard *shard;            // sharded mode, NULL otherwise
+static int shardCount;          // 0: not sharded
+static Shard *worker;           // workers of reactorRun, they steal from each other
+static int workerCount;
+static __thread int myShard = -1;    // shard of the calling thread
+static int idleTimeout;         // seconds without a read before a ping, 0: never
+
+
+// function declare
+extern int streamFill(int sd);                                     // external function from communicate.c
+extern int streamNext(int sd, int *opcode, int *flags, char *content, int size);    // external function from communicate.c
+extern int streamFlush(int sd);                                    // external function from communicate.c
+extern void streamClose(int sd);                                   // external function from communicate.c
+extern void streamCork(int sd);                                    // external function from communicate.c
+extern int streamVersion(int sd);                                  // external function from communicate.c
+extern int streamBusy(int sd);                                     // external function from communicate.c
+extern int pushFrame(int sd, int opcode, char *content, int len);  // external function from communicate.c
+extern int userLogin(int sd, char *login, char *name);             // external function from server.c
+extern void userLogout(int loc, char *name);                       // external function from server.c
+extern int commandArgs(char command);                              // external function from server.c
+extern void serveCommand(int sd, int loc, char *name, char *request, char **args);    // external function from server.c
+extern void logLine(const char *format, ...);                      // external function from log.c
+extern Arena* arenaCreate(int size);                               // external function from arena.c
+extern void* arenaAlloc(Arena *arena, int size);                   // external function from arena.c
+extern void arenaReset(Arena *arena);                              // external function from arena.c
+extern void arenaDestroy(Arena *arena);                            // external function from arena.c
+extern void pushMessage(int loc);                                  // external function from server.c
+extern unsigned int dirHash(char *name);                           // external function from userdir.c
+extern int serverAdmit(int sd);                                    // external function from server.c
+extern void serverLeave();                                         // external function from server.c
+
+extern void reactorRun(int sd, int workers);
+extern void reactorShards(int *sd, int shards);
+extern int reactorPush(int loc, char *name);
+extern void reactorIdle(int seconds);
+static void shardInit(Shard *s, int index, int sd);
+static void* reactorWorker(void *arg);
+static void shardAccept(Shard *s);
+static void shardPost(Shard *s, Connection *conn, int loc);
+static void shardDrain(Shard *s);
+static void runPut(Shard *s, Connection *conn);
+static Connection* runTake(Shard *s, int steal);
+static Connection* runSteal(Shard *s);
+static void runWake(Shard *s);
+static void connServe(Shard *s, Connection *conn);
+static int connOpen(Shard *s, int sd);
+static int connRead(Connection *conn);
+static int connFrame(Connection *conn, char *frame);
+static void connClose(Shard *s, Connection *conn);
+static void connIdle(Shard *s, Connection *conn);
+static uint64_t wheelClock();
+static void wheelSet(Shard *s, Connection *conn, uint64_t due);
+static void wheelCancel(Shard *s, Connection *conn);
+static void wheelExpire(Shard *s);
+
+
+/****************************************************************
+* Func:   Start workers, accept connections and hand them to    *
+*         the workers                                           *
+* Param:  int sd, listening socket                              *
+*         int workers, number of worker threads                 *
+* Return: none, never returns                                   *
+****************************************************************/
+void reactorRun(int sd, int workers)
+{
+	int i, next = 0;
+	int sd_current;
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	worker = (Shard *)calloc(workers, sizeof(Shard));    // one epoll instance per worker
+	for(i = 0; i < workers; i++)
+		shardInit(&worker[i], i, -1);
+	workerCount = workers;
+	for(i = 0; i < workers; i++)
+	{
+		if(pthread_create(&tid, &attr, reactorWorker, &worker[i]) != 0)
+		{
+			printf("Create worker thread\n");
+			exit(1);
+		}
+	}
+	logLine("Event driven mode, %d workers", workers);
+
+	while(1)
+	{
+		if((sd_current = accept(sd, NULL, NULL)) == -1)
+		{
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+				continue;        // transient, keep serving other clients
+			perror("Error on accept call\n");
+			exit(1);
+		}
+
+		if(connOpen(&worker[next], sd_current) == 0)
+			next = (next + 1) % workers;
+	}
+}
+
+
+/****************************************************************
+* Func:   Start one event loop per shard, each accepting on its *
+*         own listener; the calling thread runs shard 0         *
+* Param:  int *sd, SO_REUSEPORT listening sockets, one a shard  *
+*         int shards, number of shards                          *
+* Return: none, never returns                                   *
+****************************************************************/
+void reactorShards(int *sd, int shards)
+{
+	int i;
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	shard = (Shard *)calloc(shards, sizeof(Shard));
+	for(i = 0; i < shards; i++)
+		shardInit(&shard[i], i, sd[i]);
+	shardCount = shards;                 // posts are possible from now on
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(i = 1; i < shards; i++)
+	{
+		if(pthread_create(&tid, &attr, reactorWorker, &shard[i]) != 0)
+		{
+			printf("Create shard thread\n");
+			exit(1);
+		}
+	}
+	logLine("Sharded mode, %d shards", shards);
+
+	reactorWorker(&shard[0]);
+}
+
+
+/****************************************************************
+* Func:   Have the shard of a user push its pending messages,   *
+*         unless the caller runs that shard                     *
+* Param:  int loc, user location                                *
+*         char *name, user name, picks the shard                *
+* Return: 0 posted, the shard of the user pushes                *
+*         -1 not posted, the caller pushes (not sharded, or the *
+*            user belongs to the shard of the caller)           *
+****************************************************************/
+int reactorPush(int loc, char *name)
+{
+	int home;
+
+	if(shardCount == 0)
+		return -1;
+	if((home = dirHash(name) % shardCount) == myShard)
+		return -1;
+	shardPost(&shard[home], NULL, loc);
+
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Set the idle timeout, call once before reactorRun or  *
+*         reactorShards                                         *
+* Param:  int seconds, without a read before a ping, 0: never   *
+* Return: none                                                  *
+****************************************************************/
+void reactorIdle(int seconds)
+{
+	idleTimeout = seconds;
+}
+
+
+/****************************************************************
+* Func:   Set up the epoll instance, wake up eventfd and queues *
+*         of a worker or shard; a shard also gets its listener  *
+* Param:  Shard *s, worker or shard to set up                   *
+*         int index, position in shard or worker                *
+*         int sd, listening socket, -1: none (worker)           *
+* Return: none                                                  *
+****************************************************************/
+void shardInit(Shard *s, int index, int sd)
+{
+	struct epoll_event ev;
+
+	s->index = index;
+	s->listenSd = sd;
+	if((s->epfd = epoll_create1(0)) == -1 || (s->wakeFd = eventfd(0, EFD_NONBLOCK)) == -1)
+	{
+		perror("Error on epoll_create1/eventfd call\n");
+		exit(1);
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_mutex_init(&s->runLock, NULL);
+	s->postSize = s->spareSize = POSTINITSIZE;
+	s->runSize = RUNINITSIZE;
+	s->post = (ShardPost *)malloc(sizeof(ShardPost) * s->postSize);
+	s->spare = (ShardPost *)malloc(sizeof(ShardPost) * s->spareSize);
+	s->run = (Connection **)malloc(sizeof(Connection *) * s->runSize);
+	if(s->post == NULL || s->spare == NULL || s->run == NULL)
+	{
+		printf("Allocate shard queues\n");
+		exit(1);
+	}
+	atomic_init(&s->idle, 0);
+	pthread_mutex_init(&s->wheelLock, NULL);
+	s->wheel = (Connection **)calloc(WHEELSLOTS, sizeof(Connection *));
+	s->wheelTick = wheelClock();
+	if(s->wheel == NULL)
+	{
+		printf("Allocate timing wheel\n");
+		exit(1);
+	}
+
+	// level-triggered, the data pointer tells them from connections
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->wakeFd;
+	if(epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakeFd, &ev) == -1)
+	{
+		perror("Error on epoll_ctl call\n");
+		exit(1);
+	}
+	if(sd == -1)
+		return;
+
+	fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+	ev.data.ptr = &s->listenSd;
+	if(epoll_ctl(s->epfd, EPOLL_CTL_ADD, sd, &ev) == -1)
+	{
+		perror("Error on epoll_ctl call\n");
+		exit(1);
+	}
+}
+
+
+/****************************************************************
+* Func:   Event loop of a worker thread or shard: queue what is *
+*         ready, serve the queue, then steal from other workers *
+* Param:  void *arg, worker or shard to run (Shard *)           *
+* Return: none                                                  *
+****************************************************************/
+void* reactorWorker(void *arg)
+{
+	Shard *s = (Shard *)arg;
+	struct epoll_event events[MAXEVENTS];
+	Connection *conn, *dead;
+	int i, n;
+
+	myShard = s->index;
+	while(1)
+	{
+		atomic_store(&s->idle, 1);
+		n = epoll_wait(s->epfd, events, MAXEVENTS, idleTimeout > 0 ? 1000 : -1);    // the wheel turns every second
+		atomic_store(&s->idle, 0);
+		if(n == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("Error on epoll_wait call\n");
+			exit(1);
+		}
+
+		for(i = 0; i < n; i++)
+		{
+			if(events[i].data.ptr == &s->listenSd)
+				shardAccept(s);
+			else if(events[i].data.ptr == &s->wakeFd)
+				shardDrain(s);
+			else
+				runPut(s, (Connection *)events[i].data.ptr);    // whatever the event, connRead handles it
+		}
+
+		// no event of these can come any more: their sd was closed before
+		pthread_mutex_lock(&s->runLock);
+		dead = s->dead;
+		s->dead = NULL;
+		pthread_mutex_unlock(&s->runLock);
+		while((conn = dead) != NULL)
+		{
+			dead = conn->next;
+			free(conn);
+		}
+
+		wheelExpire(s);                  // after the events: one queued is not idle
+		runWake(s);
+		while((conn = runTake(s, 0)) != NULL || (conn = runSteal(s)) != NULL)
+			connServe(s, conn);
+	}
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Accept the connections waiting on a shard listener    *
+* Param:  Shard *s, shard whose listener is readable            *
+* Return: none                                                  *
+****************************************************************/
+void shardAccept(Shard *s)
+{
+	int sd_current;
+
+	while((sd_current = accept(s->listenSd, NULL, NULL)) != -1)
+		connOpen(s, sd_current);
+
+	if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED && errno != EMFILE && errno != ENFILE)
+	{
+		perror("Error on accept call\n");    // transient ones are retried on the next event
+		exit(1);
+	}
+}
+
+
+/****************************************************************
+* Func:   Hand a connection or a push over to a shard, wake it  *
+*         up if nothing was waiting                             *
+* Param:  Shard *s, shard to post to                            *
+*         Connection *conn, logged in connection, NULL: push    *
+*         int loc, user to push to (conn is NULL)               *
+* Return: none                                                  *
+****************************************************************/
+void shardPost(Shard *s, Connection *conn, int loc)
+{
+	uint64_t one = 1;
+	int wake;
+
+	pthread_mutex_lock(&s->lock);
+	if(s->postCount == s->postSize)
+	{
+		s->postSize *= 2;
+		if((s->post = (ShardPost *)realloc(s->post, sizeof(ShardPost) * s->postSize)) == NULL)
+		{
+			printf("Allocate shard posts\n");
+			exit(1);
+		}
+	}
+	s->post[s->postCount].conn = conn;
+	s->post[s->postCount].loc = loc;
+	wake = s->postCount++ == 0;          // later posts find the shard awake
+	pthread_mutex_unlock(&s->lock);
+
+	if(wake && write(s->wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		perror("Error on eventfd write\n");
+}
+
+
+/****************************************************************
+* Func:   Serve what other shards posted: take over connections *
+*         and push to users of this shard (a worker is only     *
+*         woken up to steal)                                    *
+* Param:  Shard *s, shard of the calling thread                 *
+* Return: none                                                  *
+****************************************************************/
+void shardDrain(Shard *s)
+{
+	struct epoll_event ev;
+	ShardPost *post;
+	uint64_t count;
+	int n, size, i;
+
+	if(read(s->wakeFd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		perror("Error on eventfd read\n");
+
+	pthread_mutex_lock(&s->lock);      // swap the arrays, posters are not held while serving
+	post = s->post;
+	n = s->postCount;
+	size = s->postSize;
+	s->post = s->spare;
+	s->postSize = s->spareSize;
+	s->postCount = 0;
+	s->spare = post;
+	s->spareSize = size;
+	pthread_mutex_unlock(&s->lock);
+
+	for(i = 0; i < n; i++)
+	{
+		Connection *conn = post[i].conn;
+
+		if(conn == NULL)
+		{
+			pushMessage(post[i].loc);  // nothing if the user logged out meanwhile
+			continue;
+		}
+
+		conn->owner = s;
+		atomic_store(&conn->sched, RUN_SERVED);    // events from now on are for connServe
+		if(idleTimeout > 0)
+		{
+			pthread_mutex_lock(&s->wheelLock);
+			wheelSet(s, conn, s->wheelTick + idleTimeout);
+			pthread_mutex_unlock(&s->wheelLock);
+		}
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if(epoll_ctl(s->epfd, EPOLL_CTL_ADD, conn->sd, &ev) == -1)
+			connClose(s, conn);
+		else
+			connServe(s, conn);        // requests already buffered are served by connRead
+	}
+}
+
+
+/****************************************************************
+* Func:   Queue a connection reported ready, unless it is       *
+*         queued or being served already. Owner only            *
+* Param:  Shard *s, owner of the connection                     *
+*         Connection *conn, ready connection                    *
+* Return: none                                                  *
+****************************************************************/
+void runPut(Shard *s, Connection *conn)
+{
+	int state = atomic_load(&conn->sched);
+
+	while(1)
+	{
+		if(state == RUN_IDLE && atomic_compare_exchange_weak(&conn->sched, &state, RUN_QUEUED))
+			break;
+		if(state == RUN_SERVED && atomic_compare_exchange_weak(&conn->sched, &state, RUN_AGAIN))
+			return;            // the worker serving it reads again
+		if(state == RUN_QUEUED || state == RUN_AGAIN || state == RUN_CLOSED)
+			return;            // read anyway, or closed by another worker
+	}
+
+	pthread_mutex_lock(&s->runLock);
+	if(s->runCount == s->runSize)     // grow, the ring starts over at 0
+	{
+		Connection **run = (Connection **)malloc(sizeof(Connection *) * s->runSize * 2);
+		int i;
+
+		if(run == NULL)
+		{
+			printf("Allocate run queue\n");
+			exit(1);
+		}
+		for(i = 0; i < s->runCount; i++)
+			run[i] = s->run[(s->runHead + i) % s->runSize];
+		free(s->run);
+		s->run = run;
+		s->runHead = 0;
+		s->runSize *= 2;
+	}
+	s->run[(s->runHead + s->runCount++) % s->runSize] = conn;
+	pthread_mutex_unlock(&s->runLock);
+}
+
+
+/****************************************************************
+* Func:   Take the next connection to serve from a run queue    *
+* Param:  Shard *s, worker or shard whose queue is taken from   *
+*         int steal, 0: the oldest one (owner), 1: the newest   *
+*                    one (another worker)                       *
+* Return: Connection*, connection now served by the caller      *
+*         NULL, the queue is empty                              *
+****************************************************************/
+Connection* runTake(Shard *s, int steal)
+{
+	Connection *conn = NULL;
+
+	pthread_mutex_lock(&s->runLock);
+	if(s->runCount > 0)
+	{
+		if(steal)
+		{
+			conn = s->run[(s->runHead + s->runCount - 1) % s->runSize];
+		}
+		else
+		{
+			conn = s->run[s->runHead];
+			s->runHead = (s->runHead + 1) % s->runSize;
+		}
+		s->runCount--;
+		atomic_store(&conn->sched, RUN_SERVED);
+	}
+	pthread_mutex_unlock(&s->runLock);
+
+	return conn;
+}
+
+
+/****************************************************************
+* Func:   Take a ready connection queued by another worker,     *
+*         starting with the next one (workers of reactorRun     *
+*         only, a shard keeps its users)                        *
+* Param:  Shard *s, worker of the calling thread                *
+* Return: Connection*, connection now served by the caller      *
+*         NULL, nothing to steal                                *
+****************************************************************/
+Connection* runSteal(Shard *s)
+{
+	Connection *conn;
+	int i;
+
+	if(s->listenSd != -1)           // shard
+		return NULL;
+	for(i = 1; i < workerCount; i++)
+	{
+		if((conn = runTake(&worker[(s->index + i) % workerCount], 1)) != NULL)
+			return conn;
+	}
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Wake idle workers up to steal, one for each queued    *
+*         connection beyond the one the owner serves next       *
+* Param:  Shard *s, worker that queued connections              *
+* Return: none                                                  *
+****************************************************************/
+void runWake(Shard *s)
+{
+	uint64_t one = 1;
+	int extra, i;
+
+	if(s->listenSd != -1)           // shard
+		return;
+	pthread_mutex_lock(&s->runLock);
+	extra = s->runCount - 1;
+	pthread_mutex_unlock(&s->runLock);
+
+	for(i = 1; i < workerCount && extra > 0; i++)
+	{
+		Shard *idle = &worker[(s->index + i) % workerCount];
+
+		if(atomic_exchange(&idle->idle, 0) == 1)    // a missed one only costs latency, the owner serves it
+		{
+			if(write(idle->wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+				perror("Error on eventfd write\n");
+			extra--;
+		}
+	}
+}
+
+
+/****************************************************************
+* Func:   Serve a connection until no event came meanwhile:     *
+*         read and process frames, flush replies                *
+* Param:  Shard *s, worker or shard of the calling thread       *
+*         Connection *conn, connection in RUN_SERVED            *
+* Return: none                                                  *
+****************************************************************/
+void connServe(Shard *s, Connection *conn)
+{
+	int result, state;
+
+	while(1)
+	{
+		if((result = connRead(conn)) == -1)
+		{
+			connClose(s, conn);        // also removes sd from epoll
+			return;
+		}
+		if(result == 1)                // logged in, the shard of the user takes it over
+		{
+			epoll_ctl(conn->owner->epfd, EPOLL_CTL_DEL, conn->sd, NULL);
+			wheelCancel(conn->owner, conn);
+			shardPost(&shard[dirHash(conn->name) % shardCount], conn, -1);
+			return;
+		}
+
+		state = RUN_SERVED;
+		if(atomic_compare_exchange_strong(&conn->sched, &state, RUN_IDLE))
+			return;
+		atomic_store(&conn->sched, RUN_SERVED);    // RUN_AGAIN: read what came meanwhile
+	}
+}
+
+
+/****************************************************************
+* Func:   Set up a new connection and add it to the epoll       *
+*         instance of a worker or shard, unless the server is   *
+*         busy                                                  *
+* Param:  Shard *s, worker or shard that owns it from now on    *
+*         int sd, accepted socket                               *
+* Return: 0 success                                             *
+*         -1 busy or error, sd is closed                        *
+****************************************************************/
+int connOpen(Shard *s, int sd)
+{
+	struct epoll_event ev;
+	Connection *conn;
+
+	if(serverAdmit(sd) == -1)          // too many connections, 'E' busy reply sent
+		return -1;
+	fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+
+	conn = (Connection *)calloc(1, sizeof(Connection));
+	conn->sd = sd;
+	conn->state = CONN_LOGIN;
+	conn->loc = -1;
+	conn->arena = arenaCreate(ARENASIZE);
+	conn->owner = s;
+	atomic_init(&conn->sched, RUN_IDLE);
+	atomic_init(&conn->seen, wheelClock());
+	streamCork(sd);    // replies go out together after each read, see connRead
+	if(idleTimeout > 0)                // the accept loop of reactorRun adds to a worker's wheel
+	{
+		pthread_mutex_lock(&s->wheelLock);
+		wheelSet(s, conn, s->wheelTick + idleTimeout);
+		pthread_mutex_unlock(&s->wheelLock);
+	}
+
+	// edge-triggered: the worker reads/writes until EAGAIN on every event
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if(epoll_ctl(s->epfd, EPOLL_CTL_ADD, sd, &ev) == -1)
+	{
+		perror("Error on epoll_ctl call\n");
+		wheelCancel(s, conn);
+		streamClose(sd);
+		arenaDestroy(conn->arena);
+		free(conn);
+		serverLeave();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Read everything available and process whole frames    *
+* Param:  Connection *conn, connection to read from             *
+* Return: 0 keep connection                                     *
+*         1 logged in, belongs to another shard, frames after   *
+*           the log in are left for it                          *
+*         -1 connection closed (exit, error or end of stream)   *
+****************************************************************/
+int connRead(Connection *conn)
+{
+	char frame[BATCHSIZE];
+	int filled, len = 0, held, result, opcode;
+
+	do
+	{
+		// no read while a large reply waits for the socket, the event that sends it comes back here
+		if((filled = streamBusy(conn->sd) ? 0 : streamFill(conn->sd)) > 0 && idleTimeout > 0)
+			atomic_store_explicit(&conn->seen, wheelClock(), memory_order_relaxed);    // the wheel sees it later
+		
+		// a read may carry several pipelined requests, or only part of one
+		while((held = streamBusy(conn->sd)) == 0 && (len = streamNext(conn->sd, &opcode, NULL, frame, BATCHSIZE)) >= 0)
+		{
+			if(opcode == OP_PONG)       // answer to a ping, reading it was enough
+				continue;
+			if((result = connFrame(conn, frame)) != 0)
+				return result;
+		}
+		if(len == -2)                   // protocol error
+			return -1;
+		
+		if(streamFlush(conn->sd) == -1) // replies to all of them in one write, goes on with a large one
+			return -1;
+	} while(filled > 0 || (held && !streamBusy(conn->sd)));    // edge-triggered, read until EAGAIN
+
+	return filled;                      // 0 drained, -1 closed
+}
+
+
+/****************************************************************
+* Func:   Advance the connection state machine by one frame     *
+* Param:  Connection *conn, connection the frame belongs to     *
+*         char *frame, frame content                            *
+* Return: 0 keep connection                                     *
+*         1 logged in, move it to the shard of the user         *
+*         -1 close connection                                   *
+****************************************************************/
+int connFrame(Connection *conn, char *frame)
+{
+	switch(conn->state)
+	{
+		case CONN_LOGIN:                    // replies 'E' or 'S', negotiates frame format
+			conn->loc = userLogin(conn->sd, frame, conn->name);
+			if(conn->loc == -1)             // duplicate log in, error!
+				return -1;
+			conn->state = CONN_COMMAND;
+			if(shardCount > 0 && (int)(dirHash(conn->name) % shardCount) != myShard)
+				return 1;
+			return 0;
+
+		case CONN_COMMAND:
+			if(frame[0] == '7')             // 7. Exit
+				return -1;
+			conn->argCount = commandArgs(frame[0]);
+			conn->argRead = 0;
+			conn->command[0] = frame[0];
+			if(conn->argCount > 0)
+			{
+				conn->state = CONN_ARGS;    // wait for recipient and/or message
+				return 0;
+			}
+			serveCommand(conn->sd, conn->loc, conn->name, frame, conn->args);    // whole request in frame, e.g. a batch
+			break;
+
+		case CONN_ARGS:
+			conn->args[conn->argRead] = (char *)arenaAlloc(conn->arena, strlen(frame) + 1);
+			strcpy(conn->args[conn->argRead++], frame);
+			if(conn->argRead < conn->argCount)
+				return 0;
+			serveCommand(conn->sd, conn->loc, conn->name, conn->command, conn->args);    // whole request received
+			break;
+	}
+
+	arenaReset(conn->arena);            // the request is served
+	conn->argRead = 0;
+	conn->state = CONN_COMMAND;
+
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Log the user out and release the connection; one that *
+*         another worker owns is freed by the owner, it may     *
+*         still be among the events the owner got               *
+* Param:  Shard *s, worker or shard of the calling thread       *
+*         Connection *conn, connection to close                 *
+* Return: none                                                  *
+****************************************************************/
+void connClose(Shard *s, Connection *conn)
+{
+	Shard *owner = conn->owner;
+
+	if(conn->state != CONN_LOGIN)      // logged in user
+		userLogout(conn->loc, conn->name);
+
+	wheelCancel(owner, conn);          // the wheel keeps no closed one
+	arenaDestroy(conn->arena);
+	streamClose(conn->sd);             // closing removes sd from epoll
+	serverLeave();
+	atomic_store(&conn->sched, RUN_CLOSED);
+	if(owner == s)                     // its events were queued, none is left
+	{
+		free(conn);
+		return;
+	}
+
+	pthread_mutex_lock(&owner->runLock);
+	conn->next = owner->dead;
+	owner->dead = conn;
+	pthread_mutex_unlock(&owner->runLock);
+}
+
+
+/****************************************************************
+* Func:   Ping a connection silent for idleTimeout seconds, or  *
+*         close it: it never logged in, or did not answer the   *
+*         ping. The caller took it out of the wheel and serves  *
+*         it (RUN_SERVED). Owner only                           *
+* Param:  Shard *s, owner of the connection                     *
+*         Connection *conn, silent connection                   *
+* Return: none                                                  *
+****************************************************************/
+void connIdle(Shard *s, Connection *conn)
+{
+	int state = RUN_SERVED, wait = idleTimeout;
+
+	if(conn->state == CONN_LOGIN || conn->pinged)
+	{
+		if(conn->state == CONN_LOGIN)
+			logLine("Connection closed, no log in for %d s", idleTimeout);
+		else
+			logLine("%s did not answer a ping, connection closed", conn->name);
+		connClose(s, conn);
+		return;
+	}
+
+	if(streamVersion(conn->sd) == 2)   // v1: TCP keepalive finds a peer that is gone
+	{
+		pushFrame(conn->sd, OP_PING, "", 0);    // ignores the cork, sent now
+		conn->pinged = 1;
+		wait = idleTimeout / 2 > 0 ? idleTimeout / 2 : 1;
+	}
+	pthread_mutex_lock(&s->wheelLock);
+	wheelSet(s, conn, s->wheelTick + wait);
+	pthread_mutex_unlock(&s->wheelLock);
+
+	if(!atomic_compare_exchange_strong(&conn->sched, &state, RUN_IDLE))
+	{
+		atomic_store(&conn->sched, RUN_SERVED);    // RUN_AGAIN: read what came meanwhile
+		connServe(s, conn);
+	}
+}
+
+
+/****************************************************************
+* Func:   Seconds of the timing wheels, never go back           *
+* Param:  none                                                  *
+* Return: uint64_t, seconds since some point                    *
+****************************************************************/
+uint64_t wheelClock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);    // no system call
+
+	return (uint64_t)now.tv_sec;
+}
+
+
+/****************************************************************
+* Func:   Put a connection in the slot of a second, O(1);       *
+*         caller holds the wheelLock of s                       *
+* Param:  Shard *s, owner of the connection                     *
+*         Connection *conn, connection not in the wheel         *
+*         uint64_t due, second after s->wheelTick               *
+* Return: none                                                  *
+****************************************************************/
+void wheelSet(Shard *s, Connection *conn, uint64_t due)
+{
+	Connection **slot = &s->wheel[due % WHEELSLOTS];
+
+	conn->due = due;
+	conn->wheelPrev = NULL;
+	conn->wheelNext = *slot;
+	if(*slot != NULL)
+		(*slot)->wheelPrev = conn;
+	*slot = conn;
+}
+
+
+/****************************************************************
+* Func:   Take a connection out of the wheel, if it is in, O(1) *
+* Param:  Shard *s, owner of the connection                     *
+*         Connection *conn, connection to take out              *
+* Return: none                                                  *
+****************************************************************/
+void wheelCancel(Shard *s, Connection *conn)
+{
+	if(idleTimeout == 0)
+		return;
+
+	pthread_mutex_lock(&s->wheelLock);
+	if(conn->due != 0)
+	{
+		if(conn->wheelPrev != NULL)
+			conn->wheelPrev->wheelNext = conn->wheelNext;
+		else
+			s->wheel[conn->due % WHEELSLOTS] = conn->wheelNext;
+		if(conn->wheelNext != NULL)
+			conn->wheelNext->wheelPrev = conn->wheelPrev;
+		conn->due = 0;
+	}
+	pthread_mutex_unlock(&s->wheelLock);
+}
+
+
+/****************************************************************
+* Func:   Handle the slots of the seconds gone by: a connection *
+*         that read meanwhile moves to its new second, a silent *
+*         one is pinged or closed (connIdle). Owner only, after *
+*         the events of epoll_wait are queued                   *
+* Param:  Shard *s, worker or shard of the calling thread       *
+* Return: none                                                  *
+****************************************************************/
+void wheelExpire(Shard *s)
+{
+	uint64_t now = wheelClock(), seen;
+	Connection *conn, *next, *silent = NULL;
+	int state;
+
+	if(idleTimeout == 0 || s->wheelTick >= now)    // wheelTick only moves here, on this thread
+		return;
+
+	pthread_mutex_lock(&s->wheelLock);
+	while(s->wheelTick < now)
+	{
+		s->wheelTick++;
+		for(conn = s->wheel[s->wheelTick % WHEELSLOTS]; conn != NULL; conn = next)
+		{
+			next = conn->wheelNext;
+			if(conn->due > s->wheelTick)          // a later turn of the wheel
+				continue;
+
+			if(conn->wheelPrev != NULL)           // out of the slot
+				conn->wheelPrev->wheelNext = next;
+			else
+				s->wheel[s->wheelTick % WHEELSLOTS] = next;
+			if(next != NULL)
+				next->wheelPrev = conn->wheelPrev;
+			conn->due = 0;
+
+			seen = atomic_load_explicit(&conn->seen, memory_order_relaxed);
+			state = RUN_IDLE;
+			if(seen + idleTimeout > s->wheelTick)    // read meanwhile: not idle yet
+			{
+				conn->pinged = 0;
+				wheelSet(s, conn, seen + idleTimeout);
+			}
+			else if(atomic_compare_exchange_strong(&conn->sched, &state, RUN_SERVED))
+			{
+				conn->wheelNext = silent;         // served outside the lock, connClose takes it
+				silent = conn;
+			}
+			else                                  // queued or served right now, look again soon
+			{
+				wheelSet(s, conn, s->wheelTick + 1);
+			}
+		}
+	}
+	pthread_mutex_unlock(&s->wheelLock);
+
+	while((conn = silent) != NULL)
+	{
+		silent = conn->wheelNext;
+		connIdle(s, conn);
+	}
+}
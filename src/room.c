@@ -0,0 +1,311 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Chat rooms: named rooms with a member set and a message log each                         **
+**                                                                                           **
+**  A room is created by its first join and stays. Like the broadcast log, a room message    **
+**  is stored once in a ring of ROOMLOGSIZE records numbered by a sequence that only grows;  **
+**  each member keeps a read cursor into it (server.c) and a member more than ROOMLOGSIZE    **
+**  messages behind misses the oldest ones. The member set is what a post fans out to, so    **
+**  posting costs the same in a 50 member room whatever the number of known users.           **
+**  Room names are found through a hash index that never grows (ROOMSIZE rooms at most).     **
+**  Room ids are positions in the room table, a room found once stays where it is.           **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        int roomFind(char *name, int create);       // room id, created if asked           **
+**        char* roomName(int room);                   // name of a room                      **
+**        void roomJoin(int room, int loc);           // add a member                        **
+**        void roomLeave(int room, int loc);          // remove a member                     **
+**        int* roomMembers(int room, int *count);     // copy of the member set              **
+**        uint64_t roomPost(int room, int from, time_t time, char *message);                 **
+**                                                    // append a message, return its seq    **
+**        int roomRead(int room, uint64_t seq, int *from, time_t *time, char *message);      **
+**                                                    // copy a message out of the log       **
+**        uint64_t roomHead(int room);                // seq of the next message             **
+**    - Internal:                                                                            **
+**        Room* roomCreate(char *name);               // allocate an empty room              **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NAMESIZE 80             // max characters for a room name, with '\0'
+#define MESSAGELENGTH 80        // max 80 characters for a message
+#define ROOMSIZE 65536          // max rooms
+#define ROOMINDEXSIZE (ROOMSIZE * 2)    // buckets of the name index, at most half full
+#define ROOMLOGSIZE 256         // messages kept in the log of a room
+#define MEMBERINITSIZE 16       // initial size of a member set
+
+typedef struct{
+	time_t time;                // when the sender sends
+	int from;                   // sender location in known user table
+	char message[MESSAGELENGTH + 1];
+} RoomMessage;
+
+typedef struct{
+	char name[NAMESIZE];
+	uint64_t next;                          // seq of the next message
+	pthread_rwlock_t logLock;               // writer: post, readers: read
+	int *member;                            // user locations, in no order
+	int memberCount, memberSize;
+	pthread_mutex_t memberLock;             // for member
+	RoomMessage log[ROOMLOGSIZE];           // seq % ROOMLOGSIZE
+} Room;
+
+static Room *roomTab[ROOMSIZE];             // room id -> room, set once
+static int roomCount;                       // rooms created, under indexLock
+static int roomIndex[ROOMINDEXSIZE];        // room id + 1, 0 empty bucket
+static pthread_rwlock_t indexLock = PTHREAD_RWLOCK_INITIALIZER;    // writer: create, readers: find
+
+
+// function declare
+extern int roomFind(char *name, int create);
+extern char* roomName(int room);
+extern void roomJoin(int room, int loc);
+extern void roomLeave(int room, int loc);
+extern int* roomMembers(int room, int *count);
+extern uint64_t roomPost(int room, int from, time_t time, char *message);
+extern int roomRead(int room, uint64_t seq, int *from, time_t *time, char *message);
+extern uint64_t roomHead(int room);
+extern unsigned int dirHash(char *name);          // external function, FNV-1a (userdir.c)
+extern void* poolAlloc(int size);                 // external function, buffer pools (arena.c)
+static Room* roomCreate(char *name);
+
+
+/****************************************************************
+* Func:   Find a room by name, create it if asked               *
+* Param:  char *name, room name, cut to NAMESIZE - 1 chars      *
+*         int create, 1: create an unknown room                 *
+* Return: int, room id                                          *
+*         -1, unknown room (create 0), or no room left          *
+****************************************************************/
+int roomFind(char *name, int create)
+{
+	char key[NAMESIZE];
+	unsigned int i;
+	int room = -1;
+
+	strncpy(key, name, NAMESIZE - 1);
+	key[NAMESIZE - 1] = '\0';
+	i = dirHash(key) & (ROOMINDEXSIZE - 1);
+
+	pthread_rwlock_rdlock(&indexLock);
+	for(; roomIndex[i] != 0; i = (i + 1) & (ROOMINDEXSIZE - 1))
+	{
+		if(strcmp(roomTab[roomIndex[i] - 1]->name, key) == 0)
+		{
+			room = roomIndex[i] - 1;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&indexLock);
+	if(room != -1 || !create)
+		return room;
+
+	pthread_rwlock_wrlock(&indexLock);
+	for(i = dirHash(key) & (ROOMINDEXSIZE - 1); roomIndex[i] != 0; i = (i + 1) & (ROOMINDEXSIZE - 1))
+	{
+		if(strcmp(roomTab[roomIndex[i] - 1]->name, key) == 0)    // another thread created it meanwhile
+		{
+			room = roomIndex[i] - 1;
+			break;
+		}
+	}
+	if(room == -1 && roomCount < ROOMSIZE && (roomTab[roomCount] = roomCreate(key)) != NULL)
+	{
+		room = roomCount++;
+		roomIndex[i] = room + 1;
+	}
+	pthread_rwlock_unlock(&indexLock);
+
+	return room;
+}
+
+
+/****************************************************************
+* Func:   Name of a room                                        *
+* Param:  int room, room id                                     *
+* Return: char*, room name, never changes                       *
+****************************************************************/
+char* roomName(int room)
+{
+	return roomTab[room]->name;
+}
+
+
+/****************************************************************
+* Func:   Add a member to a room, the caller checked that the   *
+*         user is not a member yet                              *
+* Param:  int room, room id                                     *
+*         int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void roomJoin(int room, int loc)
+{
+	Room *r = roomTab[room];
+
+	pthread_mutex_lock(&r->memberLock);
+	if(r->memberCount == r->memberSize)
+	{
+		r->memberSize = r->memberSize == 0 ? MEMBERINITSIZE : r->memberSize * 2;
+		if((r->member = (int *)realloc(r->member, sizeof(int) * r->memberSize)) == NULL)
+		{
+			printf("Grow room member set\n");
+			exit(1);
+		}
+	}
+	r->member[r->memberCount++] = loc;
+	pthread_mutex_unlock(&r->memberLock);
+}
+
+
+/****************************************************************
+* Func:   Remove a member from a room                           *
+* Param:  int room, room id                                     *
+*         int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void roomLeave(int room, int loc)
+{
+	Room *r = roomTab[room];
+	int i;
+
+	pthread_mutex_lock(&r->memberLock);
+	for(i = 0; i < r->memberCount; i++)
+	{
+		if(r->member[i] == loc)
+		{
+			r->member[i] = r->member[--r->memberCount];    // last one takes the free position
+			break;
+		}
+	}
+	pthread_mutex_unlock(&r->memberLock);
+}
+
+
+/****************************************************************
+* Func:   Copy of the member set of a room, members may join    *
+*         or leave meanwhile                                    *
+* Param:  int room, room id                                     *
+*         int *count, number of members                         *
+* Return: int*, member locations, give it back with poolFree    *
+****************************************************************/
+int* roomMembers(int room, int *count)
+{
+	Room *r = roomTab[room];
+	int *member;
+
+	pthread_mutex_lock(&r->memberLock);
+	*count = r->memberCount;
+	member = (int *)poolAlloc(sizeof(int) * (r->memberCount + 1));
+	memcpy(member, r->member, sizeof(int) * r->memberCount);
+	pthread_mutex_unlock(&r->memberLock);
+
+	return member;
+}
+
+
+/****************************************************************
+* Func:   Append a message to the log of a room, O(1)           *
+* Param:  int room, room id                                     *
+*         int from, sender location                             *
+*         time_t time, when the sender sends                    *
+*         char *message, text to be recorded                    *
+* Return: uint64_t, sequence number of the message              *
+****************************************************************/
+uint64_t roomPost(int room, int from, time_t time, char *message)
+{
+	Room *r = roomTab[room];
+	RoomMessage *post;
+	uint64_t seq;
+	int len = strnlen(message, MESSAGELENGTH);
+
+	pthread_rwlock_wrlock(&r->logLock);
+	seq = r->next;
+	post = &r->log[seq % ROOMLOGSIZE];      // overwrites the oldest one
+	post->from = from;
+	post->time = time;
+	memcpy(post->message, message, len);
+	post->message[len] = '\0';
+	r->next = seq + 1;
+	pthread_rwlock_unlock(&r->logLock);
+
+	return seq;
+}
+
+
+/****************************************************************
+* Func:   Copy a message out of the log of a room               *
+* Param:  int room, room id                                     *
+*         uint64_t seq, sequence number                         *
+*         int *from, sender location                            *
+*         time_t *time, when the sender sent                    *
+*         char *message, MESSAGELENGTH + 1 chars                *
+* Return: 1 success                                             *
+*         0 not posted yet, or already overwritten              *
+****************************************************************/
+int roomRead(int room, uint64_t seq, int *from, time_t *time, char *message)
+{
+	Room *r = roomTab[room];
+	RoomMessage *post;
+
+	pthread_rwlock_rdlock(&r->logLock);
+	if(seq >= r->next || seq + ROOMLOGSIZE < r->next)
+	{
+		pthread_rwlock_unlock(&r->logLock);
+		return 0;
+	}
+	post = &r->log[seq % ROOMLOGSIZE];
+	*from = post->from;
+	*time = post->time;
+	strcpy(message, post->message);
+	pthread_rwlock_unlock(&r->logLock);
+
+	return 1;
+}
+
+
+/****************************************************************
+* Func:   Sequence number of the next message of a room         *
+* Param:  int room, room id                                     *
+* Return: uint64_t, everything before it is posted              *
+****************************************************************/
+uint64_t roomHead(int room)
+{
+	Room *r = roomTab[room];
+	uint64_t seq;
+
+	pthread_rwlock_rdlock(&r->logLock);
+	seq = r->next;
+	pthread_rwlock_unlock(&r->logLock);
+
+	return seq;
+}
+
+
+/****************************************************************
+* Func:   Allocate an empty room                                *
+* Param:  char *name, room name                                 *
+* Return: Room*, new room                                       *
+*         NULL, out of memory                                   *
+****************************************************************/
+Room* roomCreate(char *name)
+{
+	Room *r = (Room *)malloc(sizeof(Room));
+
+	if(r == NULL)
+		return NULL;
+	strcpy(r->name, name);
+	r->next = 0;
+	pthread_rwlock_init(&r->logLock, NULL);
+	r->member = NULL;
+	r->memberCount = r->memberSize = 0;
+	pthread_mutex_init(&r->memberLock, NULL);
+
+	return r;
+}
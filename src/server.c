@@ -1,538 +1,2127 @@
-/********************************************************************************************************
-*********************************************************************************************************
-**  Created by Yiheng Gao, 4/16/2018, for project 3                                                    **
-**                                                                                                     **
-**  Server for network communication using sockets                                                     **
-**                                                                                                     **
-**  Functions:                                                                                         **
-**    - Internal:                                                                                      **
-**        int serverInit(int port)              // Initial server                                      **
-**        void* handleClient(void *)	        // Thread handle function                              **
-**        void recordMessage(int loc, char *message, char *from, char *time)                           **
-**                                              // Record the message to recipient message table       **
-**        int recordUser(int sd, char *name)    // Record the user info to known user table            **
-**        int userLoc(char *name)               // Find the user location in known user table          **
-**        char* getKnownUserName()              // Package known user name into a string               **
-**        char* getActiveUserName()             // Package currently connected user name into a string **
-**        void getTime();                       // Get system time                                     **
-**        char* getMyMessage(int loc);          // Package a user message into a string                **
-**                                                                                                     **
-*********************************************************************************************************
-********************************************************************************************************/
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <string.h>
-#include <pthread.h>
-#include <semaphore.h>
-
-#define NAMESIZE 80				// max characters for a name
-#define MESSAGESIZE 10			// max 10 messages for a user
-#define MESSAGELENGTH 80        // max 80 characters for a message
-#define USERSIZE 100            // max 100 known users in the system
-#define BUFSIZE 80
-#define HOST_NAME_LIMIT 80
-
-
-// function declare
-extern int writeStream(int sd, char *content);    // external function
-extern int readStream(int sd, char *content);     // external function
-
-static int serverInit(int port);                  // initial server
-static void* handleClient(void *);			      // thread handle function, each active client has a thread
-static void recordMessage(int loc, char *message, char *from, char *time);    // record recipient's message
-static int recordUser(int sd, char *name);        // record user information (if user is unknown)
-static int userLoc(char *name);                   // find the user location in known user table
-static char* getKnownUserName();                  // package known user name into a string so that the server could send to client
-static char* getActiveUserName();                 // package currently connected user into a string
-static void getTime();                            // obtain system time
-static char* getMyMessage(int loc);               // package a user's message into a string
-
-
-typedef struct{
-	char name[NAMESIZE];
-	int sd;
-	char *from[MESSAGESIZE];        // record who send the message
-	char *time[MESSAGESIZE];        // record the time message send
-	char *message[MESSAGESIZE];     // message content
-	int messageCount;
-} UserInfo;
-
-typedef struct{
-	UserInfo user[USERSIZE];
-	int count;
-} UserTable;
-
-UserTable userTab;          // known user table
-
-sem_t user_count;           // semaphore for UserTable.count
-sem_t user_each[USERSIZE];  // semaphore for UserTable.user[i]
-
-
-/************************************************************************
-* Func:   Initial server, running server, create thread for each client *
-* Param:  int argc, arguments count                                     *
-*         char *argv[], arguments value                                 *
-* Return: 0 normal exit                                                 *
-************************************************************************/
-int main(int argc, char *argv[])
-{
-	int sd;
-	
-	int sd_current;
-	int *sd_client;
-	int addrlen;
-	struct sockaddr_in pin;
-	pthread_t tid;			 // thread id
-	pthread_attr_t attr;
-	
-	// check for command line arguments
-	if (argc != 2)
-	{
-		printf("Usage: server port\n");
-		exit(1);
-	}
-	
-	sd = serverInit(atoi(argv[1]));
-
-	// wait for a client to connect
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);    // use detached threads
-	addrlen = sizeof(pin);
-	while(1)
-	{
-		if ((sd_current = accept(sd, (struct sockaddr *) &pin, (socklen_t *) &addrlen)) == -1)
-		{
-			perror("Error on accept call\n");
-			exit(1);
-		}
-		
-		sd_client = (int *)(malloc(sizeof(sd_current)));
-		*sd_client = sd_current;
-		
-		pthread_create(&tid, &attr, handleClient, sd_client);       // create thread for each client
-	}
-	
-	// close socket
-	close(sd);
-}
-
-/*********************************************
-** Function:  Process client requirement    **
-** Parameter: socket description(void *)    **
-** Return:    None                          **
-*********************************************/
-void* handleClient(void *arg)
-{
-	char *name = (char *)malloc(sizeof(char) * NAMESIZE);
-	char time[20];              // system time, format: 2018/04/15 08:20 PM
-	int sd = *((int *)arg);     // get sd from arg
-	free(arg);
-
-	int loc;
-	char command[2];       		// format: "2'\0'"
-	
-	readStream(sd, name);       // read a message from the client
-	getTime(time);              // obtain system time	
-	
-	sem_wait(&user_count);
-	loc = userLoc(name);        // find user location in known user table
-	if(loc != -1)	            // known user
-	{
-		sem_wait(&user_each[loc]);
-		if(userTab.user[loc].sd == -1)    // duplicate check, -1 means non active user
-		{
-			userTab.user[loc].sd = sd;    // update sd
-			sem_post(&user_each[loc]);
-			
-			printf("%s, Connection by known user %s\n", time, name);
-		}
-		else                              // duplicate log in, error!
-		{
-			sem_post(&user_each[loc]);
-			
-			// error handle!
-			writeStream(sd, "E");		  // Error occur, connection failed!
-			printf("%s, %s duplicate log in, force out.\n", time, name);
-			close(sd);
-		}
-	}
-	else                                  // unknown user
-	{
-		loc = recordUser(sd, name);       // record the unknown user as known user
-		printf("%s, Connection by unknown user %s\n", time, name);
-	}
-	sem_post(&user_count);
-	
-	writeStream(sd, "S");                 // log in success
-	
-	// interact with users
-	readStream(sd, command);
-	while(command[0] != '7')              // 7. Exit
-	{
-		char *tmp; 
-		getTime(time);
-		switch(command[0])
-		{
-			case '1':                     // display the names of all known users
-				sem_wait(&user_count);
-				tmp = getKnownUserName(); // get known users
-				sem_post(&user_count);
-				
-				writeStream(sd, tmp);     // send to client
-				free(tmp);
-
-				printf("%s, %s displays all known users.\n", time, name);
-
-				break;
-			
-			case '2':                         // display the names of all currently connected users
-				sem_wait(&user_count);
-				tmp = getActiveUserName();    // get currently connected users
-				sem_post(&user_count);
-				
-				writeStream(sd, tmp);         // send to client
-				free(tmp);
-
-				printf("%s, %s displays all connected users\n", time, name);
-				break;
-				
-			case '3':                         // send a text message to a particular user
-			{
-				char *toUser = (char *)malloc(sizeof(char) * NAMESIZE);
-				char *message = (char *)malloc(sizeof(char) * MESSAGELENGTH);
-				
-			    readStream(sd, toUser);    // get receiver's name
-				readStream(sd, message);   // message content
-	
-				// find user, if not exist, then record
-				sem_wait(&user_count);
-				int location = userLoc(toUser);                // find the recipient
-				if(location == -1)                             // unkown user
-				{
-					location = recordUser(-1, toUser);         // not active at present
-				}
-				sem_post(&user_count);
-
-				sem_wait(&user_each[location]);
-				recordMessage(location, message, name, time);  // record the message to recipient
-				sem_post(&user_each[location]);
-									
-				printf("%s, %s posts a message for %s\n", time, name, toUser);
-				
-				free(toUser);      
-				free(message);
-				break;
-			}
-			
-			case '4':                           // send a text message to all currently connected users
-			{
-				char *message = (char *)malloc(sizeof(char) * MESSAGELENGTH);
-				
-				readStream(sd, message);        // read message
-	
-				sem_wait(&user_count);
-				int tCount = userTab.count;
-				sem_post(&user_count);
-				int i;
-				for(i = 0; i < tCount; i++)     // record the message into each active user
-				{
-					sem_wait(&user_each[i]);
-					if(userTab.user[i].sd != -1)
-						recordMessage(i, message, name, time);
-					sem_post(&user_each[i]);
-				}
-									
-				printf("%s, %s posts a message for currently connected users\n", time, name);
-				     
-				free(message);
-				break;
-			}
-			
-			case '5':                           // send a text message to all known users
-			{
-				char *message = (char *)malloc(sizeof(char) * MESSAGELENGTH);
-				
-				readStream(sd, message);
-	
-				sem_wait(&user_count);
-				int tCount = userTab.count;
-				sem_post(&user_count);
-				int i;
-				for(i = 0; i < tCount; i++)     // record the message into all users
-				{
-					sem_wait(&user_each[i]);
-					recordMessage(i, message, name, time);
-					sem_post(&user_each[i]);
-				}
-									
-				printf("%s, %s posts a message for all known users\n", time, name);
-				     
-				free(message);
-				break;
-			}
-			
-			case '6':                           // get my messages
-				sem_wait(&user_each[loc]);
-				tmp = getMyMessage(loc);        // obtain my messages from known user table
-				sem_post(&user_each[loc]);
-				
-				writeStream(sd, tmp);           // send to client
-				
-				free(tmp);
-				printf("%s, %s gets messages\n", time, name);
-				break;
-			
-			default:
-				break;
-		}
-		readStream(sd, command);                // read next client request
-	}
-	
-	// user exit
-	sem_wait(&user_each[loc]);
-	userTab.user[loc].sd = -1;    // update sd (non active)
-	sem_post(&user_each[loc]);
-	
-	getTime(time);
-	printf("%s, %s exits\n", time, name);
-	free(name);
-	
-	close(sd);                    // close socket
-}
-
-/****************************************************************
-* Func:   Find user location in known user table (userTab)      *
-* Param:  char *name, user name                                 *
-* Return: int, user location (known user)                       *
-*         -1, unknown user                                      *
-****************************************************************/
-int userLoc(char *name)
-{
-	int i = 0;           // i means location
-
-	while(i < userTab.count)
-	{
-		if(strcmp(userTab.user[i].name, name) == 0)
-		{
-			sem_post(&user_count);
-			return i;    // known
-		}
-		i++;
-	}
-
-	return -1;           // unknown
-}
-
-/****************************************************************
-* Func:   Record a message to recipient's message table         *
-* Param:  int loc, location for recipient                       *
-*         char *message, text to be recorded                    *
-*         char *from, sender's name                             *
-*         char *time, when is the sender send                   *
-* Return: none                                                  *
-****************************************************************/
-void recordMessage(int loc, char *message, char *from, char *time)
-{
-	// parameter check
-	if(loc >= USERSIZE || message == NULL)
-		return;
-	
-	// 10 max message for a user
-	int messageCount = userTab.user[loc].messageCount;
-	if(messageCount >= MESSAGESIZE)
-		return;
-	
-	userTab.user[loc].messageCount++;
-	userTab.user[loc].from[messageCount] = (char *)malloc(sizeof(char) * (NAMESIZE+1));
-	userTab.user[loc].message[messageCount] = (char *)malloc(sizeof(char) * (MESSAGELENGTH+1));
-	userTab.user[loc].time[messageCount] = (char *)malloc(sizeof(char) * (19+1));
-	
-	strcpy(userTab.user[loc].from[messageCount], from);
-	strcpy(userTab.user[loc].message[messageCount], message);
-	strcpy(userTab.user[loc].time[messageCount], time);
-}
-
-
-/****************************************************************
-* Func:   Record unknown user                                   *
-* Param:  int sd, socket description                            *
-*         char *name, unknown user name                         *
-* Return: int, the location for unknown user                    *
-****************************************************************/
-int recordUser(int sd, char *name)
-{
-	int loc = userTab.count;
-	if(loc >= USERSIZE)
-		return -1;
-	
-	strcpy(userTab.user[userTab.count].name, name);
-	userTab.user[userTab.count].sd = sd;
-	userTab.count++;
-	
-	return loc;
-}
-
-
-/****************************************************************
-* Func:   Package all known user name into a string             *
-* Param:  none                                                  *
-* Return: char*, known user name                                *
-****************************************************************/
-char* getKnownUserName()
-{
-	char *allName = (char *)malloc(sizeof(char) * (NAMESIZE * userTab.count));
-	int i, offset = 0;
-	
-	for(i = 0; i < userTab.count; i++)
-	{
-		sprintf(allName+offset, "%s", userTab.user[i].name);
-		offset += strlen(userTab.user[i].name);
-		sprintf(allName+offset, "\n");
-		offset++;
-	}
-	
-	return allName;
-}
-
-/****************************************************************
-* Func:   Package all active user name into a string            *
-* Param:  none                                                  *
-* Return: char*, active user name                               *
-****************************************************************/
-char* getActiveUserName()
-{
-	char *activeName = (char *)malloc(sizeof(char) * (NAMESIZE * userTab.count));
-	int i, offset = 0;
-	
-	for(i = 0; i < userTab.count; i++)
-	{
-		if(userTab.user[i].sd != -1)
-		{
-			sprintf(activeName+offset, "%s", userTab.user[i].name);
-			offset += strlen(userTab.user[i].name);
-			sprintf(activeName+offset, "\n");
-			offset++;
-		}
-	}
-	
-	return activeName;
-}
-
-/****************************************************************
-* Func:   Obtain system time and transfer into specific format  *
-* Param:  char *t, required time format                         *
-* Return: none                                                  *
-****************************************************************/
-void getTime(char *t)
-{
-	time_t timep;
-	struct tm *p_tm;
-	timep = time(NULL);
-	p_tm = localtime(&timep);
-	
-	if(p_tm->tm_hour <= 12)    // Format: MM/DD/YYYY HH:MM AM
-		sprintf(t, "%d/%d/%d,%d:%d AM", p_tm->tm_mon+1, p_tm->tm_mday, p_tm->tm_year+1900, p_tm->tm_hour, p_tm->tm_min);
-	else
-		sprintf(t, "%d/%d/%d,%d:%d PM", p_tm->tm_mon+1, p_tm->tm_mday, p_tm->tm_year+1900, p_tm->tm_hour-12, p_tm->tm_min);
-}
-
-/****************************************************************
-* Func:   Package all messages into a string                    *
-* Param:  int loc, user location                                *
-* Return: char*, all user messages                              *
-****************************************************************/
-char* getMyMessage(int loc)
-{
-	char *message = (char *)malloc(sizeof(char) * (MESSAGESIZE*(MESSAGELENGTH+NAMESIZE+20)));
-	int i, offset = 0;
-	
-	if(userTab.user[loc].messageCount == 0)      // no message
-	{
-		message[0] = '\0';
-		return message;
-	}
-	
-	for(i = 0; i < userTab.user[loc].messageCount; i++)
-	{
-		// get messages
-		sprintf(message+offset, "%s, %s, %s", userTab.user[loc].from[i], userTab.user[loc].time[i], userTab.user[loc].message[i]);
-		offset += strlen(userTab.user[loc].from[i]) + strlen(userTab.user[loc].time[i]) + strlen(userTab.user[loc].message[i]) + 4;
-		sprintf(message+offset, "\n");
-		offset++;
-
-		// clear messages
-		free(userTab.user[loc].from[i]);
-		free(userTab.user[loc].time[i]);
-		free(userTab.user[loc].message[i]);
-	}
-	userTab.user[loc].messageCount = 0;
-	
-	return message;
-}
-
-/****************************************************************
-* Func:   Initial server                                        *
-* Param:  int port, port for the server                         *
-* Return: int, socket description                               *
-****************************************************************/
-int serverInit(int port)
-{
-	int sd;
-	char host[HOST_NAME_LIMIT];          // host name, max: 80 characters
-	struct sockaddr_in sin;
-	
-	
-	// create an internet domain stream stream socket
-	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)    // IPv4, TCP
-	{
-		perror("Error creating socket\n");
-		exit(1);
-	}
-	
-	// complete the socket structure
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;    // any address on this host
-	sin.sin_port = htons(port);          // convert to network byte order
-	
-	// bind the socket to the address and port number
-	if (bind(sd, (struct sockaddr *) &sin, sizeof(sin)) == -1)
-	{
-		perror("Error on bind call\n");
-		exit(1);
-	}
-	
-	// set queuesize of pending connections
-	if (listen(sd, SOMAXCONN) == -1)
-	{
-		perror("Error on listen call\n");
-		exit(1);
-	}
-	
-	// announce server is running
-	gethostname(host, HOST_NAME_LIMIT);
-	printf("Server is running on %s: %d\n", host, port);
-	
-	// Initialize semaphores
-	int i;
-	if(sem_init(&user_count, 0, 1) == -1)
-	{
-		printf("Init user_count semaphore\n");
-		exit(1);
-	}
-	for(i = 0; i < USERSIZE; i++)
-	{
-		if(sem_init(&user_each[i], 0, 1) == -1)
-		{
-			printf("Initial user_each semaphores\n");
-			exit(1);
-		}
-	}
-	
-	return sd;
+/********************************************************************************************************
+*********************************************************************************************************
+**  Created by Yiheng Gao, 4/16/2018, for project 3                                                    **
+**                                                                                                     **
+**  Server for network communication using sockets                                                     **
+**                                                                                                     **
+**  Functions:                                                                                         **
+**    - Internal:                                                                                      **
+**        int serverInit(int port, int reusePort)                                                      **
+**                                              // Initial server, one listener of a shard             **
+**        void handleClient(int sd, char *command)                                                     **
+**                                              // Serve one client until it exits                     **
+**        void* clientThread(void *arg)         // Client thread of the pool, one client at a time     **
+**        void clientHand(int sd)               // Hand a client to an idle or a new client thread     **
+**        int serverAdmit(int sd)               // Admit a connection, or turn it away busy            **
+**        void serverLeave()                    // A connection is closed                              **
+**        int userLogin(int sd, char *login, char *name)                                               **
+**                                              // Log a user in, record the user if unknown           **
+**        int hasOption(char *options, char *option)                                                   **
+**                                              // Check a log in option                               **
+**        void userLogout(int loc, char *name)  // Log a user out                                      **
+**        int commandArgs(char command)         // Number of frames following a command                **
+**        void serveCommand(int sd, int loc, char *name, char *request, char **args)                   **
+**                                              // Process one client request, send the reply          **
+**        int sendDirect(int loc, char *name, char *toUser, char *message, time_t now)                 **
+**                                              // Record a message for a particular user              **
+**        char* sendBatch(int loc, char *name, char *batch, time_t now)                                **
+**                                              // Record a batch of direct messages                   **
+**        int recordMessage(int loc, char *message, int from, time_t time)                             **
+**                                              // Record the message to recipient message table       **
+**        int joinRoom(int loc, char *request)  // Join a room, created by its first member            **
+**        int leaveRoom(int loc, char *request) // Leave a room                                        **
+**        int postRoom(int loc, char *room, char *message, time_t now)                                 **
+**                                              // Post a message to a room, fan out to its members    **
+**        char* roomPage(int loc, char *request)// Messages of a room from a cursor                    **
+**        int seatFind(int loc, int room)       // Seat of a user in a room                            **
+**        int recordUser(int sd, char *name, int *isNew)                                               **
+**                                              // Record the user info to known user table            **
+**        int userLoc(char *name)               // Find the user location in known user table          **
+**        NameList* listCreate(int size, int names)                                                    **
+**                                              // Empty user list with room for names                 **
+**        void listAdd(NameList *list, char *name)// Append a name, room is checked by caller          **
+**        void knownAppend(char *name)          // Append a new user to the known user list            **
+**        void activeAdd(int loc)               // Mark a user connected in the presence bitmap        **
+**        void activeRemove(int loc)            // Mark a user not connected in the presence bitmap    **
+**        NameList* listTake(char which, int *len, int *count)                                         **
+**                                              // Hold the current known/connected user list          **
+**        void listRelease(void *list)          // Drop a hold, free a replaced list                   **
+**        void sendList(int sd, char which)     // Send a user list as it is, no copy                  **
+**        char* listPage(char *request)         // Page of a user list, names with a prefix            **
+**        time_t getTime(char *t);              // Get system time                                     **
+**        void formatTime(time_t timep, char *t)                                                       **
+**                                              // Transfer a time into specific format                **
+**        void sendMyMessage(int loc, int sd, int opcode)                                              **
+**                                              // Send user messages gathered from where they are     **
+**        void sendFetch(int loc, int sd, char *request)                                               **
+**                                              // Send user messages from a cursor, held until acked  **
+**        void ackMessage(int loc, char *request)                                                      **
+**                                              // Release fetched messages below a cursor             **
+**        int nextBroadcast(int loc, uint64_t *seq, uint64_t head, int *from, time_t *time,            **
+**                          char *message)      // Next broadcast for a user from the broadcast log    **
+**        void keepBroadcast(int loc)           // Move unread broadcasts into the mailbox, those fit  **
+**        void pushSubscribe(int loc)           // Push new messages to a user from now on             **
+**        void pushUnsubscribe(int loc)         // Stop pushing to a user                              **
+**        void pushMessage(int loc)             // Push pending messages to a subscribed user          **
+**        void replyUnlocked(int loc, int sd, struct iovec *iov, int count)                            **
+**                                              // Send a reply out of the user lock, records held     **
+**        void pushLate(int loc)                // Push what arrived while a reply was out             **
+**        void pushBroadcast()                  // Push a new broadcast to every subscribed user       **
+**        void pushNotify(int loc)              // Push now, or post it to the shard of the user       **
+**        void userLock(int loc)                // Lock a user, count the wait if contended            **
+**        void tableLock()                      // Lock known user table to record, count the wait     **
+**        char* getStats()                      // Package server statistics into a string             **
+**        int replayUser(char *name)            // Record a user found in the journal                  **
+**        int replayMail(int to, int from, time_t time, char *message, uint64_t *pos)                  **
+**                                              // Put a message found in the journal in a mailbox     **
+**                                                                                                     **
+*********************************************************************************************************
+********************************************************************************************************/
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define NAMESIZE 80				// max characters for a name
+#define MESSAGESIZE 10			// default: max 10 messages for a user
+#define BCASTSIZE 4096          // broadcasts kept in the broadcast log, see broadcast.c
+#define MESSAGELENGTH 80        // max 80 characters for a message
+#define USERPAGEBITS 10         // known user table grows by pages of 1024 users
+#define USERPAGESIZE (1 << USERPAGEBITS)
+#define USERPAGES 1024          // max 1024 pages
+#define USERSIZE (USERPAGES * USERPAGESIZE)    // max 1048576 known users in the system
+#define USER(loc) (userTab.page[(loc) >> USERPAGEBITS][(loc) & (USERPAGESIZE - 1)])
+#define SD(loc) (userTab.sd[(loc) >> USERPAGEBITS][(loc) & (USERPAGESIZE - 1)])
+#define MAILBOX(loc) (userTab.mailbox[(loc) >> USERPAGEBITS][(loc) & (USERPAGESIZE - 1)])
+#define MAILBOXREAD(loc) atomic_load_explicit((Mailbox * _Atomic *)&MAILBOX(loc), memory_order_acquire)    // a sender may allocate it meanwhile
+#define PRESENTWORDS (USERSIZE / 64)    // connected user bitmap, one bit for each user
+#define SUMMARYWORDS (PRESENTWORDS / 64)    // one bit for each bitmap word that is not 0
+#define BUFSIZE 80
+#define FRAMESIZE 1000          // 999 characters max for a request frame, plus '\0'
+#define BATCHSIZE 65536         // max characters for a request frame carrying a batch
+#define HOST_NAME_LIMIT 80
+#define PUSHINITSIZE 64         // initial size of the subscribed user list
+#define MAXCONNECTIONS 4096     // default: max open connections, more are turned away busy
+#define CLIENTSTACKSIZE (256 << 10)    // stack of a client thread, big buffers are on the heap
+#define IDLETIMEOUT 60          // default: seconds without a read before an idle connection is pinged
+#define KEEPALIVEPROBES 4       // unanswered TCP keepalive probes before a peer counts as gone
+#define OP_DATA 0               // v2 frame type of replies, see communicate.c
+#define OP_PUSH 1               // v2 frame type of pushed messages, see communicate.c
+#define LISTINITSIZE 4096       // initial characters of a user list
+#define LISTINITNAMES 256       // initial names of a user list
+#define LISTPAGEMAX 1000        // max names in a reply to 'l'
+#define FETCHMAX 1000           // max messages in a reply to 'f'
+#define ROOMLOGSIZE 256         // messages kept in the log of a room, see room.c
+#define ROOMPAGEMAX 1000        // max messages in a reply to 'g'
+#define ROOMLINESIZE 208        // max characters of a line in a reply to 'g'
+#define ROOMJOINMAX 100         // max rooms a user is in
+#define SEATINITSIZE 4          // initial size of the room seats of a user
+#define STATS_USERLOCK 0        // lock wait histograms, see stats.c
+#define STATS_TABLELOCK 1
+
+
+typedef struct Mailbox Mailbox;     // lock-free message ring of a user, see mailbox.c
+
+#define MAIL_OK 0               // message recorded
+#define MAIL_DROPPED 1          // message recorded, oldest message dropped
+#define MAIL_FULL -1            // mailbox full, message rejected
+#define MAIL_NOMEM -2           // no memory for a mailbox
+
+
+typedef struct{
+	atomic_int refs;            // 1 while it is the current list, plus 1 for each reply being sent
+	char *text;                 // "name\n" for each user, what '1' and '2' send
+	int len;                    // characters in text
+	int size;
+	int *start;                 // start of each name in text
+	int count;                  // names
+	int names;                  // room in start
+	atomic_uint_fast64_t extent;    // count << 32 | len, what holders may read
+} NameList;                     // text is only appended to, a holder sends its first len characters
+
+typedef struct{
+	char seq[24];               // "position " before a fetched message
+	char stamp[24];             // ", time, " between sender name and text
+	char text[MESSAGELENGTH+1]; // copy of a broadcast, mailbox texts are sent from their cells
+} Delivery;                     // what sendMyMessage gathers around one message
+
+
+// function declare
+extern int writeStream(int sd, char *content);    // external function
+extern int readStream(int sd, char *content);     // external function
+extern void streamSetVersion(int sd, int version);    // external function, switch frame format
+extern void streamClose(int sd);                  // external function, release buffers and close sd
+extern void streamCork(int sd);                   // external function, coalesce replies
+extern int writePayload(int sd, int opcode, char *content, int len, void (*release)(void *arg), void *arg);    // external function, any size
+extern int writePayloadV(int sd, int opcode, struct iovec *iov, int count, void (*release)(void *arg), void *arg);    // external function
+extern void streamChunk(int sd);                  // external function, large replies in fragments
+extern void streamCompress(int sd);               // external function, compress large frames
+extern int pushFrame(int sd, int opcode, char *content, int len);    // external function, write from another thread
+extern int pushFrameV(int sd, int opcode, struct iovec *iov, int count);    // external function
+extern void streamStats(void (*count)(int in, int out));    // external function, count bytes read/written
+extern int readFrame(int sd, int *opcode, int *flags, char *content, int size);    // external function
+extern void reactorRun(int sd, int workers);      // external function, epoll event loop (reactor.c)
+extern void reactorShards(int *sd, int shards);   // external function, SO_REUSEPORT event loops (reactor.c)
+extern int reactorPush(int loc, char *name);      // external function (reactor.c)
+extern void reactorIdle(int seconds);             // external function, idle timeout of the event loops (reactor.c)
+extern int dirFind(char *name);                   // external function, user name index (userdir.c)
+extern void dirInsert(char *name, int loc);       // external function, user name index (userdir.c)
+extern void mailConfig(int size, int drop);       // external function, mailbox ring (mailbox.c)
+extern int mailPut(Mailbox **box, int from, time_t time, char *message, uint64_t *at);    // external function (mailbox.c)
+extern int mailClaim(Mailbox *box, uint64_t *first, int more);    // external function, read in place (mailbox.c)
+extern char* mailAt(Mailbox *box, uint64_t pos, int *from, time_t *time, int *len);    // external function (mailbox.c)
+extern void mailRelease(Mailbox *box, uint64_t upTo);    // external function (mailbox.c)
+extern int mailCapacity();                        // external function (mailbox.c)
+extern int mailCount(Mailbox *box);               // external function (mailbox.c)
+extern uint64_t mailTail(Mailbox *box);           // external function (mailbox.c)
+extern uint64_t bcastPost(int from, time_t time, int activeOnly, char *message);    // external function (broadcast.c)
+extern int bcastRead(uint64_t seq, int *from, time_t *time, int *activeOnly, char *message);    // external function (broadcast.c)
+extern uint64_t bcastHead();                      // external function (broadcast.c)
+extern int roomFind(char *name, int create);      // external function, chat rooms (room.c)
+extern char* roomName(int room);                  // external function (room.c)
+extern void roomJoin(int room, int loc);          // external function (room.c)
+extern void roomLeave(int room, int loc);         // external function (room.c)
+extern int* roomMembers(int room, int *count);    // external function (room.c)
+extern uint64_t roomPost(int room, int from, time_t time, char *message);    // external function (room.c)
+extern int roomRead(int room, uint64_t seq, int *from, time_t *time, char *message);    // external function (room.c)
+extern uint64_t roomHead(int room);               // external function (room.c)
+extern void logInit(char *file);                  // external function, asynchronous log (log.c)
+extern void journalOpen(char *path, int (*addUser)(char *name),
+                        int (*addMail)(int to, int from, time_t time, char *message, uint64_t *pos));    // external function, replay (journal.c)
+extern void journalUser(int loc, uint64_t cursor, char *name);    // external function (journal.c)
+extern void journalMail(int to, int from, uint64_t pos, time_t time, char *message);    // external function (journal.c)
+extern void journalTake(int loc, uint64_t tail, uint64_t cursor);    // external function (journal.c)
+extern void journalCast(uint64_t seq, int from, time_t time, int activeOnly, char *message);    // external function (journal.c)
+extern void* poolAlloc(int size);                 // external function, reply buffers (arena.c)
+extern void poolFree(void *buffer);               // external function (arena.c)
+extern void epochEnter();                         // external function, lock-free read section (epoch.c)
+extern void epochExit();                          // external function (epoch.c)
+extern void epochRetire(void *object, void (*release)(void *object));    // external function (epoch.c)
+extern void logLine(const char *format, ...);     // external function (log.c)
+extern time_t logTime();                          // external function, coarse clock (log.c)
+extern void statsInit();                          // external function, statistics (stats.c)
+extern long statsClock();                         // external function (stats.c)
+extern void statsCommand(char command, long nanos);    // external function (stats.c)
+extern void statsLockWait(int lock, long nanos);  // external function (stats.c)
+extern void statsBytes(int in, int out);          // external function (stats.c)
+extern void statsConnection(int delta);           // external function (stats.c)
+extern void statsBusy();                          // external function (stats.c)
+extern char* statsReport(int knownUsers, long mailTotal, int mailMax, int mailUsers);    // external function (stats.c)
+
+static int serverInit(int port, int reusePort);   // initial server
+static void handleClient(int sd, char *command);  // serve one client, on a client thread
+static void* clientThread(void *arg);             // client thread of the pool
+static void clientHand(int sd);                   // hand a client to a client thread
+int serverAdmit(int sd);                          // admit a connection or turn it away, shared with reactor.c
+void serverLeave();                               // a connection is closed, shared with reactor.c
+int userLogin(int sd, char *login, char *name);   // log a user in, shared with reactor.c
+static int hasOption(char *options, char *option);    // check a log in option
+void userLogout(int loc, char *name);             // log a user out, shared with reactor.c
+int commandArgs(char command);                    // frames following a command, shared with reactor.c
+void serveCommand(int sd, int loc, char *name, char *request, char **args);    // process a request, shared with reactor.c
+static int sendDirect(int loc, char *name, char *toUser, char *message, time_t now);    // record a direct message
+static char* sendBatch(int loc, char *name, char *batch, time_t now);    // record a batch of direct messages
+static int recordMessage(int loc, char *message, int from, time_t time);      // record recipient's message
+static int joinRoom(int loc, char *request);      // join a room
+static int leaveRoom(int loc, char *request);     // leave a room
+static int postRoom(int loc, char *room, char *message, time_t now);    // post to a room, fan out to its members
+static char* roomPage(int loc, char *request);    // messages of a room from a cursor
+static int seatFind(int loc, int room);           // seat of a user in a room
+static int recordUser(int sd, char *name, int *isNew);    // record user information (if user is unknown)
+static int userLoc(char *name);                   // find the user location in known user table
+static NameList* listCreate(int size, int names);    // empty user list
+static void listAdd(NameList *list, char *name);  // append a name to a user list
+static void knownAppend(char *name);              // append a new user to the known user list
+static void activeAdd(int loc);                   // mark a user connected in the presence bitmap
+static void activeRemove(int loc);                // mark a user not connected in the presence bitmap
+static NameList* listTake(char which, int *len, int *count);    // hold the current known or connected user list
+static void listRelease(void *list);              // drop a hold on a user list
+static void sendList(int sd, char which);         // send a user list without copying it
+static char* listPage(char *request);             // page of a user list, names with a prefix
+static time_t getTime(char *t);                   // obtain system time
+static void formatTime(time_t timep, char *t);    // transfer a time into specific format
+static void sendMyMessage(int loc, int sd, int opcode);    // send a user's messages, no copy of mailbox records
+static void sendFetch(int loc, int sd, char *request);    // send a user's messages from a cursor, held until acked
+static void ackMessage(int loc, char *request);   // release fetched messages below a cursor
+static int nextBroadcast(int loc, uint64_t *seq, uint64_t head, int *from, time_t *time, char *message);    // next broadcast for a user
+static void keepBroadcast(int loc);               // move unread broadcasts into the mailbox, as many as fit
+static void pushSubscribe(int loc);               // push new messages to a user from now on
+static void pushUnsubscribe(int loc);             // stop pushing to a user
+void pushMessage(int loc);                        // push pending messages to a subscribed user, shared with reactor.c
+static void replyUnlocked(int loc, int sd, struct iovec *iov, int count);    // send a reply out of the user lock
+static void pushLate(int loc);                    // push what arrived while a reply was out
+static void pushBroadcast();                      // push a new broadcast to every subscribed user
+static void pushNotify(int loc);                  // push, from this thread or the shard of the user
+static void userLock(int loc);                    // lock a user, count the wait if contended
+static void tableLock();                          // lock known user table to record a user, count the wait
+static char* getStats();                          // package server statistics into a string
+static int replayUser(char *name);                // record a user found in the journal
+static int replayMail(int to, int from, time_t time, char *message, uint64_t *pos);    // put a journaled message in a mailbox
+
+
+typedef struct{
+	int room;                       // room id, see room.c
+	uint64_t cursor;                // next message of the room to read
+} RoomSeat;                         // a room a user is in
+
+typedef struct{
+	char name[NAMESIZE];
+	int nameLen;                    // characters in name, a delivery sends it without strlen
+	uint64_t cursor;                // next broadcast to read, see broadcast.c
+	uint64_t sessionStart;          // first broadcast while connected, '4' before it is not for this user
+	int push;                       // 1: messages are pushed to sd as they arrive ("PUSH" log in option)
+	int pushSlot;                   // position in the subscribed user list
+	int replying;                   // 1: a '6' or 'f' reply is sent out of the lock, its records held
+	int pushLate;                   // 1: a push came meanwhile, sent once the reply is out
+	RoomSeat *seat;                 // rooms the user is in, under lock
+	int seatCount, seatSize;
+	pthread_mutex_t lock;           // for sd, push and reading messages
+} UserInfo;
+
+// Fields read for many users at a time are kept apart from UserInfo, in arrays of their own:
+// a scan reads 8 bytes or 1 bit for each user instead of a whole UserInfo
+typedef struct{
+	UserInfo *page[USERPAGES];      // allocated when the first user of a page is recorded
+	int *sd[USERPAGES];             // SD(loc), -1 not connected, under the user lock
+	Mailbox **mailbox[USERPAGES];   // MAILBOX(loc), lock-free, allocated by first sender
+	uint64_t present[PRESENTWORDS]; // bit of loc set: connected, under active_lock
+	uint64_t summary[SUMMARYWORDS]; // bit w set: present[w] is not 0, under active_lock
+	atomic_int count;               // users below count are complete
+} UserTable;
+
+UserTable userTab;          // known user table, USER(loc) for a user
+
+pthread_mutex_t user_lock = PTHREAD_MUTEX_INITIALIZER;     // record a new user; lookups and
+                                                            // user lists take no lock, see epoch.c
+
+int *pushUser;              // subscribed users, a broadcast is pushed to each of them
+int pushCount, pushSize;
+pthread_mutex_t push_lock = PTHREAD_MUTEX_INITIALIZER;     // for pushUser
+
+_Atomic(NameList *) knownList;     // names of known users in table order, appended by recordUser
+
+atomic_uint_fast64_t activeVersion;    // log ins and log outs so far
+_Atomic(NameList *) activeList;        // names of connected users, built again by '2' after a log in/out
+atomic_uint_fast64_t activeBuilt;      // activeVersion when activeList was built
+pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;   // for userTab.present, building activeList
+
+atomic_int openCount;       // open connections, logged in or not
+int maxConnections = MAXCONNECTIONS;    // more are turned away with a busy reply
+int idleTimeout = IDLETIMEOUT;          // seconds, 0: idle connections are kept, no keepalive
+
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;       // a client is waiting for a thread
+	int *sd;                    // accepted clients waiting for a thread, a ring of maxConnections
+	int head;
+	int count;
+	int idle;                   // threads waiting for a client
+	int threads;                // threads started, at most maxConnections
+} ClientPool;
+
+ClientPool clientPool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};    // thread per client mode
+
+
+/************************************************************************
+* Func:   Initial server, running server, a client thread for each client *
+* Param:  int argc, arguments count                                     *
+*         char *argv[], arguments value                                 *
+* Return: 0 normal exit                                                 *
+************************************************************************/
+int main(int argc, char *argv[])
+{
+	int sd;
+	
+	int sd_current;
+	int addrlen;
+	struct sockaddr_in pin;
+	struct rlimit files;
+	int workers = 0;         // 0: thread per client, otherwise epoll event loop with fixed workers
+	int shards = 0;          // 0: one listener, otherwise one SO_REUSEPORT listener and event loop a shard
+	int *listener;
+	int i, port;
+	char host[HOST_NAME_LIMIT];    // host name, max: 80 characters
+	int mailSize = MESSAGESIZE;
+	int dropOldest = 0;
+	int opt, usage = 0;
+	char *logFile = NULL;    // NULL: log to stdout
+	char *journalFile = NULL;    // NULL: no journal, nothing survives a restart
+	
+	// check for command line arguments
+	while((opt = getopt(argc, argv, "e:r:c:m:dl:j:t:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'e':        // event driven mode, number of worker threads
+				if((workers = atoi(optarg)) <= 0)
+					usage = 1;
+				break;
+			case 'r':        // sharded event loops, 0: one for each core
+				if((shards = atoi(optarg)) <= 0)
+					shards = sysconf(_SC_NPROCESSORS_ONLN);
+				break;
+			case 'c':        // max open connections
+				if((maxConnections = atoi(optarg)) <= 0)
+					usage = 1;
+				break;
+			case 'm':        // max messages for a user
+				if((mailSize = atoi(optarg)) <= 0)
+					usage = 1;
+				break;
+			case 'd':        // full mailbox drops oldest message instead of rejecting new one
+				dropOldest = 1;
+				break;
+			case 'l':        // log file, rotated by log.c
+				logFile = optarg;
+				break;
+			case 'j':        // journal files prefix, see journal.c
+				journalFile = optarg;
+				break;
+			case 't':        // idle timeout in seconds, 0: none
+				if((idleTimeout = atoi(optarg)) < 0)
+					usage = 1;
+				break;
+			default:
+				usage = 1;
+				break;
+		}
+	}
+	if (usage || argc - optind != 1 || (workers > 0 && shards > 0))
+	{
+		printf("Usage: server [-e workers | -r shards] [-c max connections] [-m mailbox size] [-d] [-l log file] [-j journal] [-t idle seconds] port\n");
+		exit(1);
+	}
+	
+	mailConfig(mailSize, dropOldest);
+	reactorIdle(idleTimeout);
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < (rlim_t)maxConnections + 64)
+	{
+		files.rlim_cur = (rlim_t)maxConnections + 64 < files.rlim_max ? (rlim_t)maxConnections + 64 : files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);    // room for the connections, journal and log files
+	}
+	clientPool.sd = (int *)malloc(sizeof(int) * maxConnections);
+	logInit(logFile);           // request lines are written by a background thread
+	statsInit();
+	streamStats(statsBytes);    // bytes read/written by communicate.c
+	knownList = listCreate(LISTINITSIZE, LISTINITNAMES);
+	activeList = listCreate(LISTINITSIZE, LISTINITNAMES);
+	if(journalFile != NULL)
+		journalOpen(journalFile, replayUser, replayMail);    // users and pending messages are back
+	port = atoi(argv[optind]);
+	
+	if(shards > 0)
+	{
+		listener = (int *)malloc(sizeof(int) * shards);
+		for(i = 0; i < shards; i++)
+			listener[i] = serverInit(port, 1);    // the kernel spreads connections over them
+		gethostname(host, HOST_NAME_LIMIT);
+		logLine("Server is running on %s: %d", host, port);
+		reactorShards(listener, shards);    // never returns
+	}
+	
+	sd = serverInit(port, 0);
+	gethostname(host, HOST_NAME_LIMIT);    // announce server is running
+	logLine("Server is running on %s: %d", host, port);
+	
+	if(workers > 0)
+	{
+		reactorRun(sd, workers);    // never returns
+	}
+
+	// wait for a client to connect
+	addrlen = sizeof(pin);
+	while(1)
+	{
+		if ((sd_current = accept(sd, (struct sockaddr *) &pin, (socklen_t *) &addrlen)) == -1)
+		{
+			if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+				continue;        // transient, keep serving other clients
+			perror("Error on accept call\n");
+			exit(1);
+		}
+		
+		if(serverAdmit(sd_current) == 0)    // or turned away busy
+			clientHand(sd_current);         // a client thread serves it
+	}
+	
+	// close socket
+	close(sd);
+}
+
+/*********************************************
+** Function:  Process client requirement    **
+** Parameter: socket description,           **
+**            command buffer (BATCHSIZE)    **
+** Return:    None                          **
+*********************************************/
+void handleClient(int sd, char *command)
+{
+	char name[NAMESIZE];
+	char login[FRAMESIZE];      // user name and log in options
+
+	int loc;
+	char args[2][FRAMESIZE];    // recipient and/or message
+	
+	// read a message from the client, reply 'E' or 'S'
+	if(readStream(sd, login) == -1 || (loc = userLogin(sd, login, name)) == -1)
+	{
+		streamClose(sd);
+		return;
+	}
+	
+	// replies to pipelined requests are sent together, once no more requests are buffered
+	streamCork(sd);
+	
+	// interact with users
+	while(readFrame(sd, NULL, NULL, command, BATCHSIZE) != -1 && command[0] != '7')    // 7. Exit, or connection lost
+	{
+		char *argv[2] = {args[0], args[1]};
+		int i, argCount = commandArgs(command[0]);
+		
+		// read the rest of the request, e.g. recipient and message
+		for(i = 0; i < argCount && readStream(sd, args[i]) == 0; i++);
+		if(i < argCount)                  // connection lost in the middle of a request
+			break;
+		
+		serveCommand(sd, loc, name, command, argv);    // reply queued while more requests wait
+	}
+	
+	userLogout(loc, name);                // user exit
+	
+	streamClose(sd);                      // close socket
+}
+
+/****************************************************************
+* Func:   Client thread of the pool: serve one client, then     *
+*         wait for the next one                                 *
+* Param:  void *arg, unused                                     *
+* Return: none, never returns                                   *
+****************************************************************/
+void* clientThread(void *arg)
+{
+	char *command = (char *)malloc(sizeof(char) * BATCHSIZE);    // format: "2'\0'", or "b\n..." for a batch
+	int sd;
+	
+	while(1)
+	{
+		pthread_mutex_lock(&clientPool.lock);
+		clientPool.idle++;
+		while(clientPool.count == 0)
+			pthread_cond_wait(&clientPool.ready, &clientPool.lock);
+		clientPool.idle--;
+		sd = clientPool.sd[clientPool.head];
+		clientPool.head = (clientPool.head + 1) % maxConnections;
+		clientPool.count--;
+		pthread_mutex_unlock(&clientPool.lock);
+		
+		handleClient(sd, command);
+		serverLeave();
+	}
+	
+	return NULL;
+}
+
+/****************************************************************
+* Func:   Hand an admitted client to an idle client thread, or  *
+*         start one; if that fails the client waits for one     *
+* Param:  int sd, socket description of the client              *
+* Return: none                                                  *
+****************************************************************/
+void clientHand(int sd)
+{
+	pthread_t tid;
+	pthread_attr_t attr;
+	
+	pthread_mutex_lock(&clientPool.lock);
+	clientPool.sd[(clientPool.head + clientPool.count++) % maxConnections] = sd;    // admitted: fits
+	if(clientPool.idle >= clientPool.count)
+	{
+		pthread_cond_signal(&clientPool.ready);
+	}
+	else if(clientPool.threads < maxConnections)
+	{
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_attr_setstacksize(&attr, CLIENTSTACKSIZE);
+		if(pthread_create(&tid, &attr, clientThread, NULL) == 0)
+			clientPool.threads++;
+		else
+			logLine("Create client thread, %d threads serve %d clients", clientPool.threads, atomic_load(&openCount));
+		pthread_attr_destroy(&attr);
+	}
+	pthread_mutex_unlock(&clientPool.lock);
+}
+
+/****************************************************************
+* Func:   Admit a new connection and turn TCP keepalive on, or  *
+*         turn it away with a busy reply ("E\nBUSY") when       *
+*         maxConnections are open                               *
+* Param:  int sd, accepted socket                               *
+* Return: 0 admitted, call serverLeave once it is closed        *
+*         -1 turned away, sd is closed                          *
+****************************************************************/
+int serverAdmit(int sd)
+{
+	char discard[FRAMESIZE];
+	int on = 1, interval = idleTimeout / KEEPALIVEPROBES > 0 ? idleTimeout / KEEPALIVEPROBES : 1;
+	
+	if(atomic_fetch_add(&openCount, 1) < maxConnections)
+	{
+		if(idleTimeout > 0)           // a peer gone without a FIN or RST makes reads fail, no timer of ours
+		{
+			setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+			setsockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE, &idleTimeout, sizeof(idleTimeout));
+			setsockopt(sd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+			on = KEEPALIVEPROBES;
+			setsockopt(sd, IPPROTO_TCP, TCP_KEEPCNT, &on, sizeof(on));
+		}
+		return 0;
+	}
+	atomic_fetch_sub(&openCount, 1);
+	
+	writeStream(sd, "E\nBUSY");           // the client reads it as its log in reply
+	shutdown(sd, SHUT_WR);
+	fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+	while(recv(sd, discard, sizeof(discard), 0) > 0);    // a log in left unread turns the close into a reset
+	streamClose(sd);
+	statsBusy();
+	
+	return -1;
+}
+
+/****************************************************************
+* Func:   A connection admitted by serverAdmit is closed        *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void serverLeave()
+{
+	atomic_fetch_sub(&openCount, 1);
+}
+
+/****************************************************************
+* Func:   Log a user in, record the user if unknown, reply 'E'  *
+*         or 'S' and switch to the negotiated frame format      *
+* Param:  int sd, socket description                            *
+*         char *login, log in frame: user name, then one log in *
+*                      option per line, "V2" asks for v2 frames *
+*                      "PUSH" (with "V2") for pushed messages,  *
+*                      "CHUNK" (with "V2") for large replies in *
+*                      fragments, "LZ" (with "V2") for large    *
+*                      frames compressed                        *
+*         char *name, user name, NAMESIZE chars                 *
+* Return: int, user location in known user table                *
+*         -1, duplicate log in or known user table is full      *
+****************************************************************/
+int userLogin(int sd, char *login, char *name)
+{
+	char time[20];              // system time, format: 2018/04/15 08:20 PM
+	char *option;
+	int loc;
+	
+	option = strchr(login, '\n');            // old clients send the name only
+	if(option != NULL)
+		*option++ = '\0';
+	strncpy(name, login, NAMESIZE - 1);
+	name[NAMESIZE - 1] = '\0';
+	
+	int isNew = 0;
+	
+	getTime(time);              // obtain system time	
+	
+	loc = userLoc(name);        // find user location in known user table
+	if(loc == -1)               // unknown user
+		loc = recordUser(sd, name, &isNew);    // record the unknown user as known user
+	
+	if(loc == -1)                         // known user table is full, error!
+	{
+		logLine("%s, %s log in, known user table is full.", time, name);
+	}
+	else if(isNew)
+	{
+		statsConnection(1);
+		logLine("%s, Connection by unknown user %s", time, name);
+	}
+	else	                              // known user
+	{
+		userLock(loc);
+		if(SD(loc) == -1)                 // duplicate check, -1 means non active user
+		{
+			SD(loc) = sd;                 // update sd
+			USER(loc).sessionStart = bcastHead();
+			activeAdd(loc);
+			pthread_mutex_unlock(&USER(loc).lock);
+			statsConnection(1);
+			
+			logLine("%s, Connection by known user %s", time, name);
+		}
+		else                              // duplicate log in, error!
+		{
+			pthread_mutex_unlock(&USER(loc).lock);
+			
+			logLine("%s, %s duplicate log in, force out.", time, name);
+			loc = -1;
+		}
+	}
+	
+	if(loc == -1)
+	{
+		writeStream(sd, "E");             // Error occur, connection failed!
+	}
+	else if(hasOption(option, "V2"))      // log in success, binary frames from now on
+	{
+		int push = hasOption(option, "PUSH");    // messages pushed
+		int chunk = hasOption(option, "CHUNK");  // large replies in fragments
+		int lz = hasOption(option, "LZ");        // large frames compressed
+		char reply[24];
+		
+		sprintf(reply, "S\nV2%s%s%s", push ? "\nPUSH" : "", chunk ? "\nCHUNK" : "", lz ? "\nLZ" : "");
+		writeStream(sd, reply);
+		streamSetVersion(sd, 2);
+		if(chunk)
+			streamChunk(sd);
+		if(lz)
+			streamCompress(sd);
+		if(push)
+		{
+			pushSubscribe(loc);
+			pushMessage(loc);             // what arrived while the user was away
+		}
+	}
+	else
+	{
+		writeStream(sd, "S");             // log in success
+	}
+	
+	return loc;
+}
+
+/****************************************************************
+* Func:   Check a log in option                                 *
+* Param:  char *options, one option per line (may be NULL)      *
+*         char *option, option to look for                      *
+* Return: 1 option is present                                   *
+*         0 not present                                         *
+****************************************************************/
+int hasOption(char *options, char *option)
+{
+	int len = strlen(option);
+	
+	while(options != NULL && *options != '\0')
+	{
+		if(strncmp(options, option, len) == 0 && (options[len] == '\n' || options[len] == '\0'))
+			return 1;
+		if((options = strchr(options, '\n')) != NULL)
+			options++;
+	}
+	
+	return 0;
+}
+
+/****************************************************************
+* Func:   Log a user out, mark the user as non active           *
+* Param:  int loc, user location                                *
+*         char *name, user name                                 *
+* Return: none                                                  *
+****************************************************************/
+void userLogout(int loc, char *name)
+{
+	char time[20];
+	int push;
+	long start = statsClock();
+	
+	userLock(loc);
+	SD(loc) = -1;                 // update sd (non active)
+	push = USER(loc).push;
+	USER(loc).push = 0;           // nothing is pushed to the closing sd from now on
+	keepBroadcast(loc);           // '4' posted while connected must survive the log out,
+	activeRemove(loc);            // done before the same user can log in again
+	pthread_mutex_unlock(&USER(loc).lock);
+	if(push)
+		pushUnsubscribe(loc);
+	statsConnection(-1);
+	statsCommand('7', statsClock() - start);    // 7. Exit, or connection lost
+	
+	getTime(time);
+	logLine("%s, %s exits", time, name);
+}
+
+/****************************************************************
+* Func:   Number of frames following a command                  *
+* Param:  char command, client request                          *
+* Return: int, 2 for '3' (recipient, message) and 'r' (room,    *
+*         message), 1 for '4'/'5' (message), 0 otherwise        *
+****************************************************************/
+int commandArgs(char command)
+{
+	switch(command)
+	{
+		case '3':
+		case 'r':
+			return 2;
+		case '4':
+		case '5':
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/****************************************************************
+* Func:   Process one client request                            *
+* Param:  int sd, socket description of the requesting user     *
+*         int loc, location for the requesting user             *
+*         char *name, requesting user name                      *
+*         char *request, command frame, '1'..'6', 'b' and a     *
+*                        batch of direct messages, 'l' and a    *
+*                        list page request, 'f' and a cursor    *
+*                        fetch, 'a' and an ack, 'j'/'x' and a   *
+*                        room, 'r' post to a room, 'g' and a    *
+*                        room page request, 's' stats           *
+*         char **args, frames following the command, see        *
+*                      commandArgs()                            *
+* Return: none, the reply (if any) is written to sd             *
+****************************************************************/
+void serveCommand(int sd, int loc, char *name, char *request, char **args)
+{
+	char time[20];
+	char *tmp = NULL;
+	time_t now;
+	uint64_t seq;
+	long start = statsClock();
+	
+	now = getTime(time);
+	switch(request[0])
+	{
+		case '1':                     // display the names of all known users
+			sendList(sd, '1');        // current known user list, no table lock
+
+			logLine("%s, %s displays all known users.", time, name);
+
+			break;
+		
+		case '2':                         // display the names of all currently connected users
+			sendList(sd, '2');
+
+			logLine("%s, %s displays all connected users", time, name);
+			break;
+		
+		case 'l':                         // page of the known or connected users, names with a prefix
+			tmp = listPage(request);
+			
+			logLine("%s, %s lists users", time, name);
+			break;
+			
+		case '3':                         // send a text message to a particular user
+			sendDirect(loc, name, args[0], args[1], now);    // receiver's name, message content
+			break;
+		
+		case 'b':                         // batch of messages for particular users, one frame
+			tmp = sendBatch(loc, name, request + 1, now);
+			break;
+		
+		case '4':                           // send a text message to all currently connected users
+			seq = bcastPost(loc, now, 1, args[0]);    // stored once, connected users read it from the log
+			journalCast(seq, loc, now, 1, args[0]);
+			pushBroadcast();
+			logLine("%s, %s posts a message for currently connected users", time, name);
+			break;
+		
+		case '5':                           // send a text message to all known users
+			seq = bcastPost(loc, now, 0, args[0]);    // stored once, every known user reads it from the log
+			journalCast(seq, loc, now, 0, args[0]);
+			pushBroadcast();
+			logLine("%s, %s posts a message for all known users", time, name);
+			break;
+		
+		case '6':                           // get my messages
+			userLock(loc);                  // a sender may be pushing them at the same time
+			sendMyMessage(loc, sd, OP_DATA);    // sent from the mailbox records, held until sent
+			pushLate(loc);
+			pthread_mutex_unlock(&USER(loc).lock);
+			
+			logLine("%s, %s gets messages", time, name);
+			break;
+		
+		case 'f':                           // fetch my messages from a cursor, they stay until acked
+			userLock(loc);
+			sendFetch(loc, sd, request);
+			pushLate(loc);
+			pthread_mutex_unlock(&USER(loc).lock);
+			
+			logLine("%s, %s fetches messages", time, name);
+			break;
+		
+		case 'a':                           // ack fetched messages, free them
+			ackMessage(loc, request);
+			break;
+		
+		case 'j':                           // join a room
+			if(joinRoom(loc, request) == -1)
+				logLine("%s, %s can not join a room", time, name);
+			else
+				logLine("%s, %s joins room %s", time, name, request + 2);
+			break;
+		
+		case 'x':                           // leave a room
+			if(leaveRoom(loc, request) == 1)
+				logLine("%s, %s leaves room %s", time, name, request + 2);
+			break;
+		
+		case 'r':                           // send a text message to the members of a room
+			if(postRoom(loc, args[0], args[1], now) == -1)
+				logLine("%s, %s posts a message for room %s, not a member, message rejected.", time, name, args[0]);
+			else
+				logLine("%s, %s posts a message for room %s", time, name, args[0]);
+			break;
+		
+		case 'g':                           // page of the messages of a room
+			tmp = roomPage(loc, request);
+			
+			logLine("%s, %s reads a room", time, name);
+			break;
+		
+		case 's':                           // server statistics, admin
+			tmp = getStats();
+			
+			logLine("%s, %s gets statistics", time, name);
+			break;
+		
+		default:
+			break;
+	}
+	if(tmp != NULL)                   // send to client, tmp is given back once sent
+		writePayload(sd, OP_DATA, tmp, strlen(tmp), poolFree, tmp);
+	statsCommand(request[0], statsClock() - start);
+}
+
+/****************************************************************
+* Func:   Record a message for a particular user, record the    *
+*         recipient if unknown                                  *
+* Param:  int loc, sender's location                            *
+*         char *name, sender's name                             *
+*         char *toUser, receiver's name (may be cut)            *
+*         char *message, message content                        *
+*         time_t now, when the sender sends                     *
+* Return: MAIL_OK, MAIL_DROPPED, MAIL_FULL or MAIL_NOMEM        *
+****************************************************************/
+int sendDirect(int loc, char *name, char *toUser, char *message, time_t now)
+{
+	char time[20];
+	int isNew, result;
+	int location;
+	
+	formatTime(now, time);
+	if(strlen(toUser) >= NAMESIZE)
+		toUser[NAMESIZE - 1] = '\0';            // name is 80 characters maximum
+	
+	// find user, if not exist, then record
+	location = userLoc(toUser);                // find the recipient
+	if(location == -1)                         // unkown user
+	{
+		location = recordUser(-1, toUser, &isNew);    // not active at present
+	}
+	if(location == -1)
+	{
+		logLine("%s, %s posts a message for %s, known user table is full.", time, name, toUser);
+		return MAIL_NOMEM;
+	}
+	
+	// record the message to recipient, lock-free
+	if((result = recordMessage(location, message, loc, now)) == MAIL_FULL)
+		logLine("%s, %s posts a message for %s, mailbox is full, message rejected.", time, name, toUser);
+	else
+		logLine("%s, %s posts a message for %s", time, name, toUser);
+	
+	return result;
+}
+
+/****************************************************************
+* Func:   Record a batch of direct messages                     *
+* Param:  int loc, sender's location                            *
+*         char *name, sender's name                             *
+*         char *batch, "\nrecipient\nmessage" repeated          *
+*         time_t now, when the sender sends                     *
+* Return: char*, reply: number of recorded messages             *
+****************************************************************/
+char* sendBatch(int loc, char *name, char *batch, time_t now)
+{
+	char *reply = (char *)poolAlloc(sizeof(char) * 12);
+	char *toUser, *message;
+	int recorded = 0;
+	
+	while(*batch == '\n')
+	{
+		toUser = batch + 1;
+		if((message = strchr(toUser, '\n')) == NULL)    // recipient without message
+			break;
+		*message++ = '\0';
+		if((batch = strchr(message, '\n')) != NULL)
+			*batch = '\0';
+		
+		if(sendDirect(loc, name, toUser, message, now) >= MAIL_OK)
+			recorded++;
+		
+		if(batch == NULL)                      // last message
+			break;
+		*batch = '\n';                         // points to the next recipient
+	}
+	
+	sprintf(reply, "%d", recorded);
+	return reply;
+}
+
+/****************************************************************
+* Func:   Find user location in known user table (userTab)      *
+* Param:  char *name, user name                                 *
+* Return: int, user location (known user)                       *
+*         -1, unknown user                                      *
+****************************************************************/
+int userLoc(char *name)
+{
+	int loc;
+
+	epochEnter();                         // lookups take no lock
+	loc = dirFind(name);                  // hash index, name -> location
+	epochExit();
+
+	return loc;
+}
+
+/****************************************************************
+* Func:   Record a message to recipient's message table         *
+* Param:  int loc, location for recipient                       *
+*         char *message, text to be recorded                    *
+*         int from, sender's location                           *
+*         time_t time, when is the sender send                  *
+* Return: MAIL_OK, MAIL_DROPPED (oldest message dropped),       *
+*         MAIL_FULL (rejected) or MAIL_NOMEM                    *
+****************************************************************/
+int recordMessage(int loc, char *message, int from, time_t time)
+{
+	int result;
+	uint64_t pos;
+	
+	// parameter check
+	if(loc < 0 || loc >= USERSIZE || message == NULL)
+		return MAIL_NOMEM;
+	
+	// mailConfig max messages for a user, no lock needed
+	if((result = mailPut(&MAILBOX(loc), from, time, message, &pos)) >= MAIL_OK)
+	{
+		journalMail(loc, from, pos, time, message);
+		pushNotify(loc);           // a subscribed recipient gets it right away
+	}
+	
+	return result;
+}
+
+/****************************************************************
+* Func:   Join a room, the room is created by its first member, *
+*         the user reads what is posted from now on             *
+* Param:  int loc, user location                                *
+*         char *request, "j\nroom"                              *
+* Return: int, 1 joined                                         *
+*         0 already a member                                    *
+*         -1 no room name, no room left, or in ROOMJOINMAX      *
+*            rooms already                                      *
+****************************************************************/
+int joinRoom(int loc, char *request)
+{
+	int room, result = 1;
+	
+	if(request[1] != '\n' || request[2] == '\0' || (room = roomFind(request + 2, 1)) == -1)
+		return -1;
+	
+	userLock(loc);
+	if(seatFind(loc, room) != -1)
+	{
+		result = 0;
+	}
+	else if(USER(loc).seatCount == ROOMJOINMAX)
+	{
+		result = -1;
+	}
+	else
+	{
+		if(USER(loc).seatCount == USER(loc).seatSize)
+		{
+			USER(loc).seatSize = USER(loc).seatSize == 0 ? SEATINITSIZE : USER(loc).seatSize * 2;
+			if((USER(loc).seat = (RoomSeat *)realloc(USER(loc).seat, sizeof(RoomSeat) * USER(loc).seatSize)) == NULL)
+			{
+				printf("Grow room seats\n");
+				exit(1);
+			}
+		}
+		USER(loc).seat[USER(loc).seatCount].room = room;
+		USER(loc).seat[USER(loc).seatCount++].cursor = roomHead(room);    // nothing from before
+		roomJoin(room, loc);
+	}
+	pthread_mutex_unlock(&USER(loc).lock);
+	
+	return result;
+}
+	
+/****************************************************************
+* Func:   Leave a room                                          *
+* Param:  int loc, user location                                *
+*         char *request, "x\nroom"                              *
+* Return: int, 1 left                                           *
+*         0 not a member                                        *
+****************************************************************/
+int leaveRoom(int loc, char *request)
+{
+	int room, seat;
+	
+	if(request[1] != '\n' || (room = roomFind(request + 2, 0)) == -1)
+		return 0;
+	
+	userLock(loc);
+	if((seat = seatFind(loc, room)) != -1)
+	{
+		roomLeave(room, loc);
+		USER(loc).seat[seat] = USER(loc).seat[--USER(loc).seatCount];    // last one takes the free position
+	}
+	pthread_mutex_unlock(&USER(loc).lock);
+	
+	return seat != -1;
+}
+	
+/****************************************************************
+* Func:   Post a message to a room, push it to the members that *
+*         are subscribed: the work is the size of the room      *
+* Param:  int loc, sender's location                            *
+*         char *room, room name                                 *
+*         char *message, message content                        *
+*         time_t now, when the sender sends                     *
+* Return: int, 0 posted                                         *
+*         -1 unknown room, or the sender is not a member        *
+****************************************************************/
+int postRoom(int loc, char *room, char *message, time_t now)
+{
+	int id = roomFind(room, 0);
+	int *member;
+	int count, i, seat;
+	
+	if(id == -1)
+		return -1;
+	userLock(loc);
+	seat = seatFind(loc, id);
+	pthread_mutex_unlock(&USER(loc).lock);
+	if(seat == -1)
+		return -1;
+	
+	roomPost(id, loc, now, message);                 // stored once, members read it from the room log
+	member = roomMembers(id, &count);                // copy, members may join/leave meanwhile
+	for(i = 0; i < count; i++)
+		pushNotify(member[i]);
+	poolFree(member);
+	
+	return 0;
+}
+	
+/****************************************************************
+* Func:   Messages of a room from a cursor, the member cursor   *
+*         moves past them                                       *
+* Param:  int loc, user location                                *
+*         char *request, "g\nroom\ncursor\nmax": cursor         *
+*                        empty or left out: where the user      *
+*                        left off, max at most ROOMPAGEMAX      *
+* Return: char*, the cursor to read next and the number of      *
+*         messages after it, then "seq name, time, text" for    *
+*         each message, one per line; "E" not a member          *
+****************************************************************/
+char* roomPage(int loc, char *request)
+{
+	char *field[3] = {"", "", "0"};            // room, cursor, max
+	char *save, *token, *reply;
+	char content[MESSAGELENGTH+1];
+	char time[20];
+	RoomSeat *seat;
+	uint64_t head, seq;
+	time_t timep;
+	int room, max, from, f, replyLen = 48;    // room for the cursor and the count
+	
+	for(f = 0, token = strtok_r(request + 1, "\n", &save); f < 3 && token != NULL; f++, token = strtok_r(NULL, "\n", &save))
+		field[f] = token;
+	max = atoi(field[2]);
+	if(max <= 0 || max > ROOMPAGEMAX)
+		max = ROOMPAGEMAX;
+	room = roomFind(field[0], 0);
+	
+	reply = (char *)poolAlloc(sizeof(char) * (max * ROOMLINESIZE + replyLen));
+	userLock(loc);
+	if(room == -1 || (f = seatFind(loc, room)) == -1)
+	{
+		pthread_mutex_unlock(&USER(loc).lock);
+		strcpy(reply, "E");
+		return reply;
+	}
+	seat = &USER(loc).seat[f];
+	head = roomHead(room);
+	seq = field[1][0] == '\0' ? seat->cursor : strtoull(field[1], NULL, 10);
+	if(seq + ROOMLOGSIZE < head)               // overwritten
+		seq = head - ROOMLOGSIZE;
+	if(seq > head)
+		seq = head;
+	for(; seq < head && max > 0; seq++)
+	{
+		if(!roomRead(room, seq, &from, &timep, content))
+			continue;
+		formatTime(timep, time);
+		replyLen += sprintf(reply + replyLen, "%llu %s, %s, %s\n", (unsigned long long)seq, USER(from).name, time, content);
+		max--;
+	}
+	if(seq > seat->cursor)                     // '6' and pushes go on from here
+		seat->cursor = seq;
+	pthread_mutex_unlock(&USER(loc).lock);
+	
+	reply[replyLen] = '\0';
+	f = sprintf(reply, "%llu\n%llu\n", (unsigned long long)seq, (unsigned long long)(head - seq));
+	memmove(reply + f, reply + 48, replyLen - 48 + 1);
+	
+	return reply;
+}
+	
+/****************************************************************
+* Func:   Seat of a user in a room, caller holds the user lock  *
+* Param:  int loc, user location                                *
+*         int room, room id                                     *
+* Return: int, position in the seats of the user                *
+*         -1, not a member                                      *
+****************************************************************/
+int seatFind(int loc, int room)
+{
+	int i;
+	
+	for(i = 0; i < USER(loc).seatCount; i++)
+	{
+		if(USER(loc).seat[i].room == room)
+			return i;
+	}
+	
+	return -1;
+}
+
+/****************************************************************
+* Func:   Record unknown user                                   *
+* Param:  int sd, socket description                            *
+*         char *name, unknown user name                         *
+*         int *isNew, set to 1 if the user is recorded now,     *
+*                     0 if someone else recorded it first       *
+* Return: int, the location for the user                        *
+*         -1, known user table is full                          *
+****************************************************************/
+int recordUser(int sd, char *name, int *isNew)
+{
+	int loc;
+	
+	tableLock();
+	*isNew = 0;
+	if((loc = dirFind(name)) != -1)       // recorded while waiting for the lock
+	{
+		pthread_mutex_unlock(&user_lock);
+		return loc;
+	}
+	
+	loc = atomic_load_explicit(&userTab.count, memory_order_relaxed);
+	if(loc >= USERSIZE)
+	{
+		pthread_mutex_unlock(&user_lock);
+		return -1;
+	}
+	if(userTab.page[loc >> USERPAGEBITS] == NULL)    // first user of a page
+	{
+		userTab.page[loc >> USERPAGEBITS] = (UserInfo *)calloc(USERPAGESIZE, sizeof(UserInfo));
+		userTab.sd[loc >> USERPAGEBITS] = (int *)calloc(USERPAGESIZE, sizeof(int));
+		userTab.mailbox[loc >> USERPAGEBITS] = (Mailbox **)calloc(USERPAGESIZE, sizeof(Mailbox *));
+		if(userTab.page[loc >> USERPAGEBITS] == NULL || userTab.sd[loc >> USERPAGEBITS] == NULL || userTab.mailbox[loc >> USERPAGEBITS] == NULL)
+		{
+			pthread_mutex_unlock(&user_lock);
+			return -1;
+		}
+	}
+	
+	strcpy(USER(loc).name, name);
+	USER(loc).nameLen = strlen(name);
+	SD(loc) = sd;
+	MAILBOX(loc) = NULL;           // allocated by the first sender
+	USER(loc).cursor = USER(loc).sessionStart = bcastHead();    // no broadcast from before
+	USER(loc).push = USER(loc).replying = USER(loc).pushLate = 0;
+	USER(loc).seat = NULL;
+	USER(loc).seatCount = USER(loc).seatSize = 0;
+	pthread_mutex_init(&USER(loc).lock, NULL);
+	dirInsert(USER(loc).name, loc);       // lookups find the user from now on
+	knownAppend(USER(loc).name);
+	journalUser(loc, USER(loc).cursor, USER(loc).name);    // under user_lock: journaled in table order
+	atomic_store_explicit(&userTab.count, loc + 1, memory_order_release);
+	*isNew = 1;
+	if(sd != -1)                   // logging in
+		activeAdd(loc);
+	
+	pthread_mutex_unlock(&user_lock);
+	return loc;
+}
+
+
+/****************************************************************
+* Func:   Empty user list                                       *
+* Param:  int size, room for characters                         *
+*         int names, room for names                             *
+* Return: NameList*, list held once (the server's hold)         *
+****************************************************************/
+NameList* listCreate(int size, int names)
+{
+	NameList *list = (NameList *)malloc(sizeof(NameList));
+
+	if(list == NULL || (list->text = (char *)malloc(size)) == NULL || (list->start = (int *)malloc(sizeof(int) * names)) == NULL)
+	{
+		printf("Allocate user list\n");
+		exit(1);
+	}
+	atomic_init(&list->refs, 1);
+	atomic_init(&list->extent, 0);
+	list->len = list->count = 0;
+	list->size = size;
+	list->names = names;
+
+	return list;
+}
+
+/****************************************************************
+* Func:   Append a name to a user list and show it to holders,  *
+*         the caller made room                                  *
+* Param:  NameList *list, user list                             *
+*         char *name, user name                                 *
+* Return: none                                                  *
+****************************************************************/
+void listAdd(NameList *list, char *name)
+{
+	int len = strlen(name);
+
+	memcpy(list->text + list->len, name, len);    // after extent, no holder reads it yet
+	list->text[list->len + len] = '\n';
+	list->start[list->count++] = list->len;
+	list->len += len + 1;
+	atomic_store_explicit(&list->extent, (uint64_t)list->count << 32 | list->len, memory_order_release);
+}
+
+/****************************************************************
+* Func:   Append a new user to the known user list. Holders of  *
+*         the list keep their extent, so the list grows in      *
+*         place; a full list is copied into a twice larger one, *
+*         the old one is freed by its last holder. Caller holds *
+*         user_lock                                             *
+* Param:  char *name, user name                                 *
+* Return: none                                                  *
+****************************************************************/
+void knownAppend(char *name)
+{
+	NameList *list = atomic_load_explicit(&knownList, memory_order_relaxed), *old = list;
+	int len = strlen(name) + 1;
+
+	if(list->len + len > list->size || list->count == list->names)
+	{
+		list = listCreate(old->size * 2 + len, old->names * 2);
+		memcpy(list->text, old->text, old->len);
+		memcpy(list->start, old->start, sizeof(int) * old->count);
+		list->len = old->len;
+		list->count = old->count;
+	}
+	listAdd(list, name);
+
+	if(list != old)
+	{
+		atomic_store(&knownList, list);
+		epochRetire(old, listRelease);           // the server's hold, once no reader can take it
+	}
+}
+
+/****************************************************************
+* Func:   Mark a user connected in the presence bitmap, caller  *
+*         holds the user lock (or user_lock for a new user)     *
+* Param:  int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void activeAdd(int loc)
+{
+	pthread_mutex_lock(&active_lock);
+	userTab.present[loc / 64] |= (uint64_t)1 << (loc % 64);
+	userTab.summary[loc / 4096] |= (uint64_t)1 << (loc / 64 % 64);
+	activeVersion++;
+	pthread_mutex_unlock(&active_lock);
+}
+
+/****************************************************************
+* Func:   Mark a user not connected in the presence bitmap,     *
+*         caller holds the user lock                            *
+* Param:  int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void activeRemove(int loc)
+{
+	pthread_mutex_lock(&active_lock);
+	userTab.present[loc / 64] &= ~((uint64_t)1 << (loc % 64));
+	if(userTab.present[loc / 64] == 0)           // last one of its 64 users
+		userTab.summary[loc / 4096] &= ~((uint64_t)1 << (loc / 64 % 64));
+	activeVersion++;
+	pthread_mutex_unlock(&active_lock);
+}
+
+/****************************************************************
+* Func:   Hold the current known or connected user list. The    *
+*         connected user list is built again from the presence  *
+*         bitmap only if users logged in or out since the last  *
+*         time                                                  *
+* Param:  char which, '1' known users, '2' connected users      *
+*         int *len, characters of the list to use               *
+*         int *count, names of the list to use                  *
+* Return: NameList*, held list, see listRelease                 *
+****************************************************************/
+NameList* listTake(char which, int *len, int *count)
+{
+	NameList *list;
+	uint64_t extent;
+
+	if(which == '2' && atomic_load(&activeBuilt) != atomic_load(&activeVersion))
+	{
+		pthread_mutex_lock(&active_lock);
+		if(atomic_load(&activeBuilt) != atomic_load(&activeVersion))    // not built by another thread meanwhile
+		{
+			NameList *old = atomic_load_explicit(&activeList, memory_order_relaxed);
+			int words = (atomic_load(&userTab.count) + 4095) / 4096;
+			int names = 0, s, w;
+			uint64_t summary, bits;
+
+			for(s = 0; s < words; s++)                // 4096 users a summary word: the cost is the
+			{                                         // connected users, not the known ones
+				for(summary = userTab.summary[s]; summary != 0; summary &= summary - 1)    // clear the lowest set bit
+					names += __builtin_popcountll(userTab.present[s * 64 + __builtin_ctzll(summary)]);
+			}
+			list = listCreate(names * NAMESIZE + 1, names + 1);
+			for(s = 0; s < words; s++)
+			{
+				for(summary = userTab.summary[s]; summary != 0; summary &= summary - 1)
+				{
+					w = s * 64 + __builtin_ctzll(summary);
+					for(bits = userTab.present[w]; bits != 0; bits &= bits - 1)
+						listAdd(list, USER(w * 64 + __builtin_ctzll(bits)).name);
+				}
+			}
+			atomic_store(&activeBuilt, atomic_load(&activeVersion));
+			atomic_store(&activeList, list);
+			epochRetire(old, listRelease);       // replies still sending it keep it alive
+		}
+		pthread_mutex_unlock(&active_lock);
+	}
+
+	epochEnter();                                // the list is not freed before the hold is taken
+	list = atomic_load(which == '1' ? &knownList : &activeList);    // seq_cst, see epoch.c
+	atomic_fetch_add_explicit(&list->refs, 1, memory_order_relaxed);
+	epochExit();
+
+	extent = atomic_load_explicit(&list->extent, memory_order_acquire);
+	*len = (int)(extent & 0xffffffff);
+	*count = (int)(extent >> 32);
+
+	return list;
+}
+
+/****************************************************************
+* Func:   Drop a hold on a user list, the last one frees it     *
+* Param:  void *list, held list (NameList *)                    *
+* Return: none                                                  *
+****************************************************************/
+void listRelease(void *list)
+{
+	NameList *l = (NameList *)list;
+
+	if(atomic_fetch_sub_explicit(&l->refs, 1, memory_order_acq_rel) == 1)
+	{
+		free(l->text);
+		free(l->start);
+		free(l);
+	}
+}
+
+/****************************************************************
+* Func:   Send the known or connected user list as it is kept,  *
+*         one name per line, without copying it                 *
+* Param:  int sd, socket description                            *
+*         char which, '1' known users, '2' connected users      *
+* Return: none                                                  *
+****************************************************************/
+void sendList(int sd, char which)
+{
+	int len, count;
+	NameList *list = listTake(which, &len, &count);
+
+	writePayload(sd, OP_DATA, list->text, len, listRelease, list);    // a large list leaves from list->text, held until it is sent
+}
+
+/****************************************************************
+* Func:   Page of the known or connected user list, names with  *
+*         a prefix only                                         *
+* Param:  char *request, "l\nwhich\noffset\nlimit\nprefix":     *
+*                        which '1' known, '2' connected users,  *
+*                        skip offset matching names, then at    *
+*                        most limit names, prefix may be empty  *
+* Return: char*, number of matching names, then the names of    *
+*         the page, one per line                                *
+****************************************************************/
+char* listPage(char *request)
+{
+	char *field[4] = {"1", "0", "", ""};        // which, offset, limit, prefix
+	char *save, *token, *reply, *name;
+	NameList *list;
+	int len, count, offset, limit, prefixLen, nameLen;
+	int i, f, total = 0, replyLen;
+
+
+	for(f = 0, token = strtok_r(request + 1, "\n", &save); f < 4 && token != NULL; f++, token = strtok_r(NULL, "\n", &save))
+		field[f] = token;
+	offset = atoi(field[1]) > 0 ? atoi(field[1]) : 0;
+	limit = atoi(field[2]);
+	if(limit <= 0 || limit > LISTPAGEMAX)
+		limit = LISTPAGEMAX;
+	prefixLen = strlen(field[3]);
+
+	list = listTake(field[0][0] == '2' ? '2' : '1', &len, &count);
+	reply = (char *)poolAlloc(sizeof(char) * (limit * NAMESIZE + 12));
+	replyLen = 12;                               // room for the number of names
+
+	for(i = prefixLen == 0 ? offset : 0; i < count; i++)    // no prefix: the page is a slice
+	{
+		name = list->text + list->start[i];
+		nameLen = (i + 1 < count ? list->start[i + 1] : len) - list->start[i];    // with '\n'
+		if(prefixLen == 0)
+		{
+			if(i >= offset + limit)
+				break;
+			total = count;
+		}
+		else if(nameLen <= prefixLen || memcmp(name, field[3], prefixLen) != 0)
+		{
+			continue;
+		}
+		else if(total++ < offset || total > offset + limit)
+		{
+			continue;
+		}
+		memcpy(reply + replyLen, name, nameLen);
+		replyLen += nameLen;
+	}
+	if(prefixLen == 0)
+		total = count;
+	listRelease(list);
+
+	reply[replyLen] = '\0';
+	i = sprintf(reply, "%d\n", total);
+	memmove(reply + i, reply + 12, replyLen - 12 + 1);
+
+	return reply;
+}
+
+/****************************************************************
+* Func:   Obtain system time and transfer into specific format  *
+* Param:  char *t, required time format                         *
+* Return: time_t, the system time                               *
+****************************************************************/
+time_t getTime(char *t)
+{
+	time_t timep;
+	timep = logTime();          // coarse clock of log.c, no system call
+	formatTime(timep, t);
+	
+	return timep;
+}
+
+/****************************************************************
+* Func:   Transfer a time into specific format                  *
+* Param:  time_t timep, time to transfer                        *
+*         char *t, required time format                         *
+* Return: none                                                  *
+****************************************************************/
+void formatTime(time_t timep, char *t)
+{
+	static __thread time_t cachedMinute = -1;    // the format shows minutes, one localtime_r
+	static __thread char cached[20];             // for each minute in each thread
+	struct tm tm;
+	struct tm *p_tm = &tm;
+	
+	if(timep / 60 == cachedMinute)
+	{
+		strcpy(t, cached);
+		return;
+	}
+	localtime_r(&timep, p_tm);   // localtime is not thread safe
+	
+	if(p_tm->tm_hour <= 12)    // Format: MM/DD/YYYY HH:MM AM
+		sprintf(t, "%d/%d/%d,%d:%d AM", p_tm->tm_mon+1, p_tm->tm_mday, p_tm->tm_year+1900, p_tm->tm_hour, p_tm->tm_min);
+	else
+		sprintf(t, "%d/%d/%d,%d:%d PM", p_tm->tm_mon+1, p_tm->tm_mday, p_tm->tm_year+1900, p_tm->tm_hour-12, p_tm->tm_min);
+	
+	cachedMinute = timep / 60;
+	strcpy(cached, t);
+}
+
+/****************************************************************
+* Func:   Send all messages in one reply (fragments of it with  *
+*         "CHUNK"). Mailbox records are claimed and gathered    *
+*         from their cells, freed for senders once the reply is *
+*         out or copied, fetched ones that were not acked       *
+*         too. Room messages follow, "name in room".            *
+*         Caller holds the user lock, a reply is sent out of it *
+* Param:  int loc, user location                                *
+*         int sd, socket description of the user                *
+*         int opcode, OP_DATA: reply, always sent               *
+*                     OP_PUSH: pushed, only if there is any     *
+* Return: none                                                  *
+****************************************************************/
+void sendMyMessage(int loc, int sd, int opcode)
+{
+	Mailbox *box = MAILBOXREAD(loc);
+	uint64_t head = bcastHead();
+	uint64_t seq = USER(loc).cursor;
+	uint64_t first, pos;
+	int casts = head - seq < BCASTSIZE ? head - seq : BCASTSIZE;
+	int mails = mailClaim(box, &first, mailCapacity());    // fetched ones not acked yet are sent too
+	uint64_t *roomEnd = (uint64_t *)poolAlloc(sizeof(uint64_t) * (USER(loc).seatCount + 1));
+	RoomSeat *seat;
+	Delivery *d;
+	struct iovec *iov;
+	char time[20];
+	char castContent[MESSAGELENGTH+1];
+	char *content = NULL;
+	time_t timep = 0, castTime;
+	int from = 0, castFrom, count = 1, n = 0;    // iov[0] is the frame header
+	int haveCast, len = 0, posts = 0, i;
+	
+	for(i = 0; i < USER(loc).seatCount; i++)    // room messages to send, up to the heads seen now
+	{
+		roomEnd[i] = roomHead(USER(loc).seat[i].room);
+		posts += roomEnd[i] - USER(loc).seat[i].cursor < ROOMLOGSIZE ? roomEnd[i] - USER(loc).seat[i].cursor : ROOMLOGSIZE;
+	}
+	d = (Delivery *)poolAlloc(sizeof(Delivery) * (mails + casts + posts + 1));
+	iov = (struct iovec *)poolAlloc(sizeof(struct iovec) * (4 * (mails + casts) + 6 * posts + 1));
+	
+	// mailbox and broadcast log merged by time, the broadcast cursor moves to head
+	pos = first;
+	if(pos < first + mails)
+		content = mailAt(box, pos, &from, &timep, &len);
+	haveCast = nextBroadcast(loc, &seq, head, &castFrom, &castTime, castContent);
+	while(pos < first + mails || haveCast)
+	{
+		if(pos < first + mails && (!haveCast || timep <= castTime))
+		{
+			formatTime(timep, time);
+			iov[count].iov_base = USER(from).name;
+			iov[count].iov_len = USER(from).nameLen;
+			iov[count+2].iov_base = content;          // in place, held until the frame is out
+			iov[count+2].iov_len = len;
+			if(++pos < first + mails)
+				content = mailAt(box, pos, &from, &timep, &len);
+		}
+		else
+		{
+			formatTime(castTime, time);
+			iov[count].iov_base = USER(castFrom).name;
+			iov[count].iov_len = USER(castFrom).nameLen;
+			strcpy(d[n].text, castContent);           // the log slot may be reused meanwhile
+			iov[count+2].iov_base = d[n].text;
+			iov[count+2].iov_len = strlen(d[n].text);
+			haveCast = nextBroadcast(loc, &seq, head, &castFrom, &castTime, castContent);
+		}
+		iov[count+1].iov_len = sprintf(d[n].stamp, ", %s, ", time);
+		iov[count+1].iov_base = d[n].stamp;
+		iov[count+3].iov_base = "\n";
+		iov[count+3].iov_len = 1;
+		count += 4;
+		n++;
+	}
+	
+	// then the rooms of the user, room by room, each cursor moves to what was the head of its room
+	for(i = 0; i < USER(loc).seatCount; i++)
+	{
+		seat = &USER(loc).seat[i];
+		for(pos = seat->cursor + ROOMLOGSIZE < roomEnd[i] ? roomEnd[i] - ROOMLOGSIZE : seat->cursor; pos < roomEnd[i]; pos++)
+		{
+			if(!roomRead(seat->room, pos, &castFrom, &castTime, d[n].text))    // overwritten meanwhile
+				continue;
+			formatTime(castTime, time);
+			iov[count].iov_base = USER(castFrom).name;
+			iov[count].iov_len = USER(castFrom).nameLen;
+			iov[count+1].iov_base = " in ";
+			iov[count+1].iov_len = 4;
+			iov[count+2].iov_base = roomName(seat->room);
+			iov[count+2].iov_len = strlen(iov[count+2].iov_base);
+			iov[count+3].iov_len = sprintf(d[n].stamp, ", %s, ", time);
+			iov[count+3].iov_base = d[n].stamp;
+			iov[count+4].iov_base = d[n].text;
+			iov[count+4].iov_len = strlen(d[n].text);
+			iov[count+5].iov_base = "\n";
+			iov[count+5].iov_len = 1;
+			count += 6;
+			n++;
+		}
+		seat->cursor = roomEnd[i];
+	}
+	
+	if(opcode == OP_DATA)
+		replyUnlocked(loc, sd, iov, count);
+	else if(count > 1)
+		pushFrameV(sd, OP_PUSH, iov, count);     // never waits for a slow reader
+	mailRelease(box, first + mails);
+	
+	if(mails > 0 || USER(loc).cursor != head)
+		journalTake(loc, mailTail(box), head);
+	USER(loc).cursor = head;
+	poolFree(iov);
+	poolFree(d);
+	poolFree(roomEnd);
+}
+
+/****************************************************************
+* Func:   Send up to max messages from a cursor in one reply,   *
+*         gathered from their cells. They stay held until the   *
+*         client acks them, a client that reconnects fetches    *
+*         them again. Caller holds the user lock, the reply is  *
+*         sent out of it                                        *
+* Param:  int loc, user location                                *
+*         int sd, socket description of the user                *
+*         char *request, "f\ncursor\nmax": position of the      *
+*                        first message wanted (0: the oldest    *
+*                        one), max at most FETCHMAX             *
+* Return: none, the reply is the cursor to fetch next and the   *
+*         number of messages after it, then "position name,     *
+*         time, text" for each message, one per line            *
+****************************************************************/
+void sendFetch(int loc, int sd, char *request)
+{
+	char *field[2] = {"0", "0"};                // cursor, max
+	char *save, *token;
+	char header[48];
+	char time[20];
+	Mailbox *box;
+	Delivery *d;
+	struct iovec *iov;
+	uint64_t cursor, first, end, pos;
+	time_t timep;
+	int max, held, from, len, f, n, count = 2;    // iov[0] is the frame header, iov[1] the reply header
+	
+	for(f = 0, token = strtok_r(request + 1, "\n", &save); f < 2 && token != NULL; f++, token = strtok_r(NULL, "\n", &save))
+		field[f] = token;
+	cursor = strtoull(field[0], NULL, 10);
+	max = atoi(field[1]);
+	if(max <= 0 || max > FETCHMAX)
+		max = FETCHMAX;
+	
+	keepBroadcast(loc);                         // broadcasts get a position, may allocate the mailbox
+	box = MAILBOXREAD(loc);
+	held = mailClaim(box, &first, 0);           // fetched before, not acked yet
+	if(cursor < first)                          // acked already
+		cursor = first;
+	if(cursor > first + held)                   // never sent, or a cursor from before a restart
+		cursor = first + held;
+	if(cursor + max > first + held)             // claim the rest
+		held = mailClaim(box, &first, cursor + max - (first + held));
+	if(cursor < first)                          // none was held, senders dropped the oldest meanwhile
+		cursor = first;
+	end = cursor + max < first + held ? cursor + max : first + held;
+	
+	d = (Delivery *)poolAlloc(sizeof(Delivery) * (end - cursor + 1));
+	iov = (struct iovec *)poolAlloc(sizeof(struct iovec) * (5 * (end - cursor) + 2));
+	for(pos = cursor, n = 0; pos < end; pos++, n++)
+	{
+		iov[count+3].iov_base = mailAt(box, pos, &from, &timep, &len);    // in place, held until acked
+		formatTime(timep, time);
+		iov[count].iov_len = sprintf(d[n].seq, "%llu ", (unsigned long long)pos);
+		iov[count].iov_base = d[n].seq;
+		iov[count+1].iov_base = USER(from).name;
+		iov[count+1].iov_len = USER(from).nameLen;
+		iov[count+2].iov_len = sprintf(d[n].stamp, ", %s, ", time);
+		iov[count+2].iov_base = d[n].stamp;
+		iov[count+3].iov_len = len;
+		iov[count+4].iov_base = "\n";
+		iov[count+4].iov_len = 1;
+		count += 5;
+	}
+	iov[1].iov_len = sprintf(header, "%llu\n%d\n", (unsigned long long)end, (int)(mailTail(box) + mailCount(box) - end));
+	iov[1].iov_base = header;
+	
+	replyUnlocked(loc, sd, iov, count);
+	poolFree(iov);
+	poolFree(d);
+}
+
+/****************************************************************
+* Func:   Free the fetched messages of a user below a cursor,   *
+*         the client has them                                   *
+* Param:  int loc, user location                                *
+*         char *request, "a\ncursor": every held message below  *
+*                        cursor is freed                        *
+* Return: none                                                  *
+****************************************************************/
+void ackMessage(int loc, char *request)
+{
+	Mailbox *box;
+	uint64_t tail;
+	
+	userLock(loc);
+	box = MAILBOXREAD(loc);
+	tail = mailTail(box);
+	mailRelease(box, strtoull(request + 1, NULL, 10));
+	if(mailTail(box) != tail)
+		journalTake(loc, mailTail(box), USER(loc).cursor);
+	pthread_mutex_unlock(&USER(loc).lock);
+}
+
+/****************************************************************
+* Func:   Next broadcast for a user: all '5', '4' only if the   *
+*         user was connected when it was posted                 *
+* Param:  int loc, user location                                *
+*         uint64_t *seq, first broadcast to look at, moved past *
+*                        the one returned                       *
+*         uint64_t head, stop before this broadcast             *
+*         int *from, sender location                            *
+*         time_t *time, when the sender sent                    *
+*         char *message, MESSAGELENGTH + 1 chars                *
+* Return: 1 got a broadcast                                     *
+*         0 no more broadcasts before head                      *
+****************************************************************/
+int nextBroadcast(int loc, uint64_t *seq, uint64_t head, int *from, time_t *time, char *message)
+{
+	int activeOnly;
+	
+	while(*seq < head)
+	{
+		uint64_t current = (*seq)++;
+		
+		// overwritten ones are skipped
+		if(bcastRead(current, from, time, &activeOnly, message) && (!activeOnly || current >= USER(loc).sessionStart))
+			return 1;
+	}
+	
+	return 0;
+}
+
+/****************************************************************
+* Func:   Move unread broadcasts of a user into its mailbox, as *
+*         many as fit: at log out, as the '4' sent while        *
+*         connected can not be told apart from the rest later,  *
+*         and before a fetch, to give them a mailbox position.  *
+*         The rest wait in the broadcast log. Caller holds the  *
+*         user lock                                             *
+* Param:  int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void keepBroadcast(int loc)
+{
+	uint64_t head = bcastHead();
+	uint64_t seq = USER(loc).cursor;
+	uint64_t pos;
+	char content[MESSAGELENGTH+1];
+	time_t timep;
+	int from, result;
+	
+	while(nextBroadcast(loc, &seq, head, &from, &timep, content))
+	{
+		if((result = mailPut(&MAILBOX(loc), from, timep, content, &pos)) == MAIL_FULL)
+		{
+			head = seq - 1;                        // this one and the rest stay in the log
+			break;
+		}
+		if(result >= MAIL_OK)                      // nothing to push
+			journalMail(loc, from, pos, timep, content);
+	}
+	if(USER(loc).cursor != head)
+		journalTake(loc, mailTail(MAILBOXREAD(loc)), head);
+	USER(loc).cursor = head;
+}
+
+/****************************************************************
+* Func:   Push new messages to a user from now on               *
+* Param:  int loc, user location, connected with v2 frames      *
+* Return: none                                                  *
+****************************************************************/
+void pushSubscribe(int loc)
+{
+	pthread_mutex_lock(&push_lock);
+	if(pushCount == pushSize)
+	{
+		pushSize = pushSize == 0 ? PUSHINITSIZE : pushSize * 2;
+		if((pushUser = (int *)realloc(pushUser, sizeof(int) * pushSize)) == NULL)
+		{
+			printf("Grow subscribed user list\n");
+			exit(1);
+		}
+	}
+	USER(loc).pushSlot = pushCount;
+	pushUser[pushCount++] = loc;
+	pthread_mutex_unlock(&push_lock);
+	
+	userLock(loc);
+	USER(loc).push = 1;
+	pthread_mutex_unlock(&USER(loc).lock);
+}
+
+/****************************************************************
+* Func:   Remove a user from the subscribed user list           *
+* Param:  int loc, user location, push already cleared          *
+* Return: none                                                  *
+****************************************************************/
+void pushUnsubscribe(int loc)
+{
+	int last;
+	
+	pthread_mutex_lock(&push_lock);
+	last = pushUser[--pushCount];                // last one takes the free position
+	pushUser[USER(loc).pushSlot] = last;
+	USER(last).pushSlot = USER(loc).pushSlot;
+	pthread_mutex_unlock(&push_lock);
+}
+
+/****************************************************************
+* Func:   Push pending messages (mailbox and broadcasts) to a   *
+*         subscribed, connected user in one frame               *
+* Param:  int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void pushMessage(int loc)
+{
+	// the lock keeps sd open: log out clears push before the sd is closed
+	userLock(loc);
+	if(USER(loc).replying)         // its records are held by the reply, pushed after it
+		USER(loc).pushLate = 1;
+	else if(USER(loc).push)
+		sendMyMessage(loc, SD(loc), OP_PUSH);
+	pthread_mutex_unlock(&USER(loc).lock);
+}
+
+/****************************************************************
+* Func:   Send a reply gathered under the user lock without     *
+*         holding it, so a sender pushing to the user never     *
+*         waits for a client that does not read. The records    *
+*         it is gathered from stay held meanwhile, no push      *
+*         claims or releases them (pushLate). Caller holds the  *
+*         user lock, held again on return                       *
+* Param:  int loc, user location                                *
+*         int sd, socket description of the user                *
+*         struct iovec *iov, reply, iov[0] left for the header  *
+*         int count, number of iovec                            *
+* Return: none                                                  *
+****************************************************************/
+void replyUnlocked(int loc, int sd, struct iovec *iov, int count)
+{
+	USER(loc).replying = 1;
+	pthread_mutex_unlock(&USER(loc).lock);
+	writePayloadV(sd, OP_DATA, iov, count, NULL, NULL);
+	userLock(loc);
+	USER(loc).replying = 0;
+}
+
+/****************************************************************
+* Func:   Push what arrived while a reply was sent out of the   *
+*         lock, see replyUnlocked                               *
+* Param:  int loc, user location, caller holds its lock         *
+* Return: none                                                  *
+****************************************************************/
+void pushLate(int loc)
+{
+	if(USER(loc).pushLate && USER(loc).push)
+		sendMyMessage(loc, SD(loc), OP_PUSH);
+	USER(loc).pushLate = 0;
+}
+
+/****************************************************************
+* Func:   Push a new broadcast to every subscribed user         *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void pushBroadcast()
+{
+	int *subscriber;
+	int count, i;
+	
+	pthread_mutex_lock(&push_lock);
+	if((count = pushCount) == 0)
+	{
+		pthread_mutex_unlock(&push_lock);
+		return;
+	}
+	subscriber = (int *)poolAlloc(sizeof(int) * count);    // copy, users may log in/out meanwhile
+	memcpy(subscriber, pushUser, sizeof(int) * count);
+	pthread_mutex_unlock(&push_lock);
+	
+	for(i = 0; i < count; i++)
+		pushNotify(subscriber[i]);               // '4' or '5' filter of nextBroadcast applies
+	poolFree(subscriber);
+}
+
+/****************************************************************
+* Func:   Push pending messages to a subscribed user: from the  *
+*         calling thread, or in sharded mode from the shard the *
+*         user belongs to                                       *
+* Param:  int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void pushNotify(int loc)
+{
+	if(reactorPush(loc, USER(loc).name) == -1)    // not posted, not sharded or same shard
+		pushMessage(loc);
+}
+
+/****************************************************************
+* Func:   Lock a user (sd, push, reading messages), count the   *
+*         time waited if another thread holds it                *
+* Param:  int loc, user location                                *
+* Return: none                                                  *
+****************************************************************/
+void userLock(int loc)
+{
+	long start;
+	
+	if(pthread_mutex_trylock(&USER(loc).lock) == 0)    // not contended, nothing to count
+		return;
+	
+	start = statsClock();
+	pthread_mutex_lock(&USER(loc).lock);
+	statsLockWait(STATS_USERLOCK, statsClock() - start);
+}
+
+/****************************************************************
+* Func:   Lock the known user table to record a user, count the *
+*         time waited if another thread holds it                *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void tableLock()
+{
+	long start;
+	
+	if(pthread_mutex_trylock(&user_lock) == 0)
+		return;
+	
+	start = statsClock();
+	pthread_mutex_lock(&user_lock);
+	statsLockWait(STATS_TABLELOCK, statsClock() - start);
+}
+
+/****************************************************************
+* Func:   Package server statistics into a string: counters,    *
+*         latency percentiles and mailbox depths                *
+* Param:  none                                                  *
+* Return: char*, statistics                                     *
+****************************************************************/
+char* getStats()
+{
+	long mailTotal = 0;
+	int mailMax = 0, mailUsers = 0;
+	int i, count, depth;
+	
+	count = atomic_load_explicit(&userTab.count, memory_order_acquire);    // no lock, users below count are complete
+	for(i = 0; i < count; i++)                   // reads the mailbox pointers, not the users
+	{
+		if((depth = mailCount(MAILBOXREAD(i))) > 0)
+		{
+			mailTotal += depth;
+			mailUsers++;
+			if(depth > mailMax)
+				mailMax = depth;
+		}
+	}
+	
+	return statsReport(count, mailTotal, mailMax, mailUsers);
+}
+
+/****************************************************************
+* Func:   Record a user found in the journal, at start up       *
+* Param:  char *name, user name                                 *
+* Return: int, the location for the user                        *
+****************************************************************/
+int replayUser(char *name)
+{
+	int isNew;
+	
+	return recordUser(-1, name, &isNew);
+}
+
+/****************************************************************
+* Func:   Put a message found in the journal in a mailbox, at   *
+*         start up, nothing to push                             *
+* Param:  int to, recipient location                            *
+*         int from, sender location                             *
+*         time_t time, when the sender sent                     *
+*         char *message, message text                           *
+*         uint64_t *pos, position in the mailbox                *
+* Return: MAIL_OK, MAIL_DROPPED, MAIL_FULL or MAIL_NOMEM        *
+****************************************************************/
+int replayMail(int to, int from, time_t time, char *message, uint64_t *pos)
+{
+	return mailPut(&MAILBOX(to), from, time, message, pos);
+}
+
+/****************************************************************
+* Func:   Initial server                                        *
+* Param:  int port, port for the server                         *
+*         int reusePort, 1: one of several listeners on port,   *
+*                        SO_REUSEPORT                           *
+* Return: int, socket description                               *
+****************************************************************/
+int serverInit(int port, int reusePort)
+{
+	int sd;
+	int on = 1;
+	struct sockaddr_in sin;
+	
+	
+	// create an internet domain stream stream socket
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)    // IPv4, TCP
+	{
+		perror("Error creating socket\n");
+		exit(1);
+	}
+	
+	// a restart binds again while old connections are in TIME_WAIT
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+		(reusePort && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1))
+	{
+		perror("Error on setsockopt call\n");
+		exit(1);
+	}
+	
+	// complete the socket structure
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;    // any address on this host
+	sin.sin_port = htons(port);          // convert to network byte order
+	
+	// bind the socket to the address and port number
+	if (bind(sd, (struct sockaddr *) &sin, sizeof(sin)) == -1)
+	{
+		perror("Error on bind call\n");
+		exit(1);
+	}
+	
+	// set queuesize of pending connections
+	if (listen(sd, SOMAXCONN) == -1)
+	{
+		perror("Error on listen call\n");
+		exit(1);
+	}
+	
+	return sd;
 }
\ No newline at end of file
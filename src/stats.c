@@ -0,0 +1,346 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Server statistics: per-command counters, latency histograms, bytes, connections          **
+**                                                                                           **
+**  Counters live in STATSSHARDS cache aligned shards, every thread picks one the first      **
+**  time it counts something, so the hot path is a relaxed atomic add on a line hardly ever  **
+**  shared. statsReport sums the shards when the admin command 's' asks for them.            **
+**  Latency histograms are log-linear (HDR style): 4 buckets for each power of two of        **
+**  nanoseconds, 64 ns to 275 s, every bucket within 25% of the values it holds.             **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        void statsInit();                           // start of uptime, call once          **
+**        long statsClock();                          // monotonic time, nanoseconds         **
+**        void statsCommand(char command, long nanos);                                       **
+**                                                    // count a request and its latency     **
+**        void statsLockWait(int lock, long nanos);   // count a wait for a contended lock   **
+**        void statsBytes(int in, int out);           // count bytes read and written        **
+**        void statsConnection(int delta);            // connected users, +1 or -1           **
+**        void statsBusy();                           // count a connection turned away      **
+**        void statsAlloc(int system);                // count an arena or pool allocation   **
+**        char* statsReport(int knownUsers, long mailTotal, int mailMax, int mailUsers);     **
+**                                                    // package statistics into a string    **
+**    - Internal:                                                                            **
+**        StatsShard* statsShard();                   // shard of the calling thread         **
+**        void statsRecord(StatsShard *shard, int hist, long nanos);                         **
+**                                                    // add a latency to a histogram        **
+**        long statsPercentile(uint64_t *bucket, uint64_t count, double p, uint64_t max);    **
+**                                                    // latency at a percentile             **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define STATSSHARDS 64          // counter shards, threads beyond this share them
+#define STATSCOMMANDS "1234567blsfajxrg"    // commands counted, '7' also counts lost connections
+#define NCOMMANDS (sizeof(STATSCOMMANDS) - 1)
+#define STATS_USERLOCK 0        // lock of one user (sd, push, reading messages)
+#define STATS_TABLELOCK 1       // known user table lock
+#define NLOCKS 2
+#define NHISTS (NCOMMANDS + NLOCKS)
+#define HISTMINBITS 6           // first bucket: below 64 ns
+#define HISTSUBBITS 2           // 4 buckets for each power of two
+#define HISTBUCKETS (1 + (38 - HISTMINBITS) * (1 << HISTSUBBITS))    // up to 2^38 ns
+#define CACHELINE 64
+#define REPLYLINE 80            // max characters for one line of the report
+
+typedef struct{
+	atomic_uint_fast64_t bucket[HISTBUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t max;           // nanoseconds
+} Histogram;
+
+typedef struct{
+	_Alignas(CACHELINE) Histogram hist[NHISTS];   // commands, then locks
+	atomic_uint_fast64_t bytesIn;
+	atomic_uint_fast64_t bytesOut;
+	atomic_int_fast64_t connections;
+	atomic_uint_fast64_t busy;              // connections turned away, server full
+	atomic_uint_fast64_t allocs;            // arena and pool allocations, see arena.c
+	atomic_uint_fast64_t systemAllocs;      // those that called malloc
+} StatsShard;
+
+static StatsShard shards[STATSSHARDS];
+static atomic_uint nextShard;
+static __thread StatsShard *myShard;      // shard of this thread
+static time_t startTime;                  // for uptime
+
+
+// function declare
+extern void statsInit();
+extern long statsClock();
+extern void statsCommand(char command, long nanos);
+extern void statsLockWait(int lock, long nanos);
+extern void statsBytes(int in, int out);
+extern void statsConnection(int delta);
+extern void statsBusy();
+extern void statsAlloc(int system);
+extern char* statsReport(int knownUsers, long mailTotal, int mailMax, int mailUsers);
+extern void* poolAlloc(int size);                 // external function (arena.c)
+static StatsShard* statsShard();
+static void statsRecord(StatsShard *shard, int hist, long nanos);
+static long statsPercentile(uint64_t *bucket, uint64_t count, double p, uint64_t max);
+
+
+/****************************************************************
+* Func:   Start counting uptime, call once before any thread    *
+*         counts                                                *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void statsInit()
+{
+	startTime = time(NULL);
+}
+
+
+/****************************************************************
+* Func:   Monotonic time                                        *
+* Param:  none                                                  *
+* Return: long, nanoseconds                                     *
+****************************************************************/
+long statsClock()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+/****************************************************************
+* Func:   Count a request and how long it took                  *
+* Param:  char command, '1'..'7', 'b', 'l', 's', 'f', 'a', 'j', *
+*                       'x', 'r', 'g', others ignored           *
+*         long nanos, time to serve it                          *
+* Return: none                                                  *
+****************************************************************/
+void statsCommand(char command, long nanos)
+{
+	char *found = command == '\0' ? NULL : strchr(STATSCOMMANDS, command);
+
+	if(found != NULL)
+		statsRecord(statsShard(), found - STATSCOMMANDS, nanos);
+}
+
+
+/****************************************************************
+* Func:   Count a wait for a lock that was taken by another     *
+*         thread (uncontended locks are not counted)            *
+* Param:  int lock, STATS_USERLOCK or STATS_TABLELOCK           *
+*         long nanos, time waited                               *
+* Return: none                                                  *
+****************************************************************/
+void statsLockWait(int lock, long nanos)
+{
+	statsRecord(statsShard(), NCOMMANDS + lock, nanos);
+}
+
+
+/****************************************************************
+* Func:   Count bytes read from and written to clients          *
+* Param:  int in, bytes read                                    *
+*         int out, bytes written                                *
+* Return: none                                                  *
+****************************************************************/
+void statsBytes(int in, int out)
+{
+	StatsShard *shard = statsShard();
+
+	if(in > 0)
+		atomic_fetch_add_explicit(&shard->bytesIn, in, memory_order_relaxed);
+	if(out > 0)
+		atomic_fetch_add_explicit(&shard->bytesOut, out, memory_order_relaxed);
+}
+
+
+/****************************************************************
+* Func:   Count a log in (+1) or log out (-1)                   *
+* Param:  int delta, +1 or -1                                   *
+* Return: none                                                  *
+****************************************************************/
+void statsConnection(int delta)
+{
+	atomic_fetch_add_explicit(&statsShard()->connections, delta, memory_order_relaxed);
+}
+
+
+/****************************************************************
+* Func:   Count a connection turned away with a busy reply      *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void statsBusy()
+{
+	atomic_fetch_add_explicit(&statsShard()->busy, 1, memory_order_relaxed);
+}
+
+
+/****************************************************************
+* Func:   Count an allocation from an arena or a buffer pool    *
+* Param:  int system, 1: it had to call malloc                  *
+* Return: none                                                  *
+****************************************************************/
+void statsAlloc(int system)
+{
+	StatsShard *shard = statsShard();
+
+	atomic_fetch_add_explicit(&shard->allocs, 1, memory_order_relaxed);
+	if(system)
+		atomic_fetch_add_explicit(&shard->systemAllocs, 1, memory_order_relaxed);
+}
+
+
+/****************************************************************
+* Func:   Package statistics into a string, one item per line   *
+* Param:  int knownUsers, users in known user table             *
+*         long mailTotal, messages in all mailboxes             *
+*         int mailMax, messages in the fullest mailbox          *
+*         int mailUsers, users with at least one message        *
+* Return: char*, statistics (caller frees with poolFree)        *
+****************************************************************/
+char* statsReport(int knownUsers, long mailTotal, int mailMax, int mailUsers)
+{
+	char *report = (char *)poolAlloc(sizeof(char) * (REPLYLINE * (NHISTS + 7) + 1));
+	struct rusage usage;        // CPU time of the server, e.g. what compression costs
+	uint64_t bucket[HISTBUCKETS];
+	uint64_t bytesIn = 0, bytesOut = 0, allocs = 0, systemAllocs = 0, busy = 0;
+	int64_t connections = 0;
+	int offset = 0, h, s, b;
+
+	for(s = 0; s < STATSSHARDS; s++)
+	{
+		bytesIn += atomic_load_explicit(&shards[s].bytesIn, memory_order_relaxed);
+		bytesOut += atomic_load_explicit(&shards[s].bytesOut, memory_order_relaxed);
+		connections += atomic_load_explicit(&shards[s].connections, memory_order_relaxed);
+		busy += atomic_load_explicit(&shards[s].busy, memory_order_relaxed);
+		allocs += atomic_load_explicit(&shards[s].allocs, memory_order_relaxed);
+		systemAllocs += atomic_load_explicit(&shards[s].systemAllocs, memory_order_relaxed);
+	}
+
+	offset += sprintf(report + offset, "uptime %ld s, connections %ld, turned away %llu, known users %d\n",
+	                  (long)(time(NULL) - startTime), (long)connections, (unsigned long long)busy, knownUsers);
+	offset += sprintf(report + offset, "bytes in %llu, out %llu\n", (unsigned long long)bytesIn, (unsigned long long)bytesOut);
+	getrusage(RUSAGE_SELF, &usage);
+	offset += sprintf(report + offset, "cpu user %.3f s, system %.3f s\n", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+	                  usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+	offset += sprintf(report + offset, "mailbox messages %ld, max %d, users with mail %d\n", mailTotal, mailMax, mailUsers);
+	offset += sprintf(report + offset, "request allocations %llu, from malloc %llu\n", (unsigned long long)allocs, (unsigned long long)systemAllocs);
+	offset += sprintf(report + offset, "count p50 p99 p999 max (us)\n");
+
+	for(h = 0; h < NHISTS; h++)
+	{
+		uint64_t count = 0, max = 0;
+
+		memset(bucket, 0, sizeof(bucket));
+		for(s = 0; s < STATSSHARDS; s++)
+		{
+			Histogram *hist = &shards[s].hist[h];
+			uint64_t m = atomic_load_explicit(&hist->max, memory_order_relaxed);
+
+			for(b = 0; b < HISTBUCKETS; b++)
+				bucket[b] += atomic_load_explicit(&hist->bucket[b], memory_order_relaxed);
+			count += atomic_load_explicit(&hist->count, memory_order_relaxed);
+			if(m > max)
+				max = m;
+		}
+
+		if(h < NCOMMANDS)
+			offset += sprintf(report + offset, "%c: ", STATSCOMMANDS[h]);
+		else
+			offset += sprintf(report + offset, "%s wait: ", h - NCOMMANDS == STATS_USERLOCK ? "user lock" : "table lock");
+		offset += sprintf(report + offset, "%llu %.1f %.1f %.1f %.1f\n", (unsigned long long)count,
+		                  statsPercentile(bucket, count, 0.5, max) / 1e3, statsPercentile(bucket, count, 0.99, max) / 1e3,
+		                  statsPercentile(bucket, count, 0.999, max) / 1e3, max / 1e3);
+	}
+
+	return report;
+}
+
+
+/****************************************************************
+* Func:   Shard of the calling thread, picked on first use      *
+* Param:  none                                                  *
+* Return: StatsShard*, shard to count in                        *
+****************************************************************/
+StatsShard* statsShard()
+{
+	if(myShard == NULL)
+		myShard = &shards[atomic_fetch_add(&nextShard, 1) % STATSSHARDS];
+
+	return myShard;
+}
+
+
+/****************************************************************
+* Func:   Add a latency to a histogram                          *
+* Param:  StatsShard *shard, shard of the calling thread        *
+*         int hist, histogram number                            *
+*         long nanos, latency                                   *
+* Return: none                                                  *
+****************************************************************/
+void statsRecord(StatsShard *shard, int hist, long nanos)
+{
+	Histogram *h = &shard->hist[hist];
+	uint64_t max;
+	int b = 0;
+
+	if(nanos >= (1L << HISTMINBITS))        // bucket: power of two, then the next 2 bits
+	{
+		int exp = 63 - __builtin_clzl(nanos);
+
+		b = 1 + (exp - HISTMINBITS) * (1 << HISTSUBBITS) + ((nanos >> (exp - HISTSUBBITS)) & ((1 << HISTSUBBITS) - 1));
+		if(b >= HISTBUCKETS)
+			b = HISTBUCKETS - 1;
+	}
+
+	atomic_fetch_add_explicit(&h->bucket[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while((uint64_t)nanos > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, nanos, memory_order_relaxed, memory_order_relaxed));
+}
+
+
+/****************************************************************
+* Func:   Latency at a percentile, upper end of its bucket      *
+* Param:  uint64_t *bucket, merged histogram                    *
+*         uint64_t count, values in the histogram               *
+*         double p, 0.5 for p50, 0.99 for p99 ...               *
+*         uint64_t max, largest value, caps the bucket end      *
+* Return: long, nanoseconds (0 if the histogram is empty)       *
+****************************************************************/
+long statsPercentile(uint64_t *bucket, uint64_t count, double p, uint64_t max)
+{
+	uint64_t rank = (uint64_t)(count * p), seen = 0;
+	long end;
+	int b, exp, sub;
+
+	if(count == 0)
+		return 0;
+
+	for(b = 0; b < HISTBUCKETS - 1; b++)
+	{
+		seen += bucket[b];
+		if(seen > rank)
+			break;
+	}
+	if(b == 0)
+	{
+		end = 1L << HISTMINBITS;
+	}
+	else
+	{
+		exp = HISTMINBITS + (b - 1) / (1 << HISTSUBBITS);
+		sub = (b - 1) % (1 << HISTSUBBITS);
+		end = (1L << exp) + ((long)(sub + 1) << (exp - HISTSUBBITS));
+	}
+
+	return (uint64_t)end > max ? (long)max : end;
+}
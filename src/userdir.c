@@ -0,0 +1,161 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Hash index for the known user table: user name -> user location                          **
+**                                                                                           **
+**  Open addressing with linear probing, the table doubles once it is half full. Each        **
+**  bucket keeps the hash of the name so probing only calls strcmp on a real candidate.      **
+**  Names are not copied, the caller keeps them alive (they live in the user table).         **
+**  Lookups take no lock: a bucket is filled before its location is published, and a grown   **
+**  table is published in one pointer store, the old one is freed through epoch.c once no    **
+**  lookup can still be reading it. The caller serializes inserts (one writer).              **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - External:                                                                            **
+**        int dirFind(char *name);                    // find user location, -1 unknown      **
+**                                                    // caller is inside epochEnter/Exit    **
+**        void dirInsert(char *name, int loc);        // add a name that is not indexed yet  **
+**        unsigned int dirHash(char *name);           // FNV-1a hash of a name, also picks   **
+**                                                    // the shard of a user (reactor.c)     **
+**    - Internal:                                                                            **
+**        DirTable* dirGrow(DirTable *old);           // double the table and rehash         **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#define DIRINITSIZE 256         // initial number of buckets, power of 2
+
+typedef struct{
+	unsigned int hash;          // hash of name, saves a strcmp on most collisions
+	atomic_int loc;             // user location, -1 empty bucket, set last
+	char *name;                 // user name, owned by the user table
+} DirEntry;
+
+typedef struct{
+	unsigned int size;          // number of buckets, power of 2
+	DirEntry bucket[];
+} DirTable;
+
+static _Atomic(DirTable *) userDir;    // name index of known user table, replaced when it grows
+static unsigned int dirCount;          // number of names, writer only
+
+
+// function declare
+extern int dirFind(char *name);
+extern void dirInsert(char *name, int loc);
+extern unsigned int dirHash(char *name);
+extern void epochRetire(void *object, void (*release)(void *object));    // external function (epoch.c)
+static DirTable* dirGrow(DirTable *old);
+
+
+/****************************************************************
+* Func:   Find a user location by name, no lock; the caller is  *
+*         inside epochEnter/epochExit (or is the writer)        *
+* Param:  char *name, user name                                 *
+* Return: int, user location (known user)                       *
+*         -1, unknown user                                      *
+****************************************************************/
+int dirFind(char *name)
+{
+	DirTable *table = atomic_load(&userDir);    // seq_cst, see epoch.c
+	unsigned int hash, i;
+	int loc;
+
+	if(table == NULL)          // nothing indexed yet
+		return -1;
+
+	hash = dirHash(name);
+	for(i = hash & (table->size - 1); (loc = atomic_load_explicit(&table->bucket[i].loc, memory_order_acquire)) != -1; i = (i + 1) & (table->size - 1))
+	{
+		if(table->bucket[i].hash == hash && strcmp(table->bucket[i].name, name) == 0)
+			return loc;        // known
+	}
+
+	return -1;                 // unknown
+}
+
+
+/****************************************************************
+* Func:   Index a new user name, one writer at a time           *
+* Param:  char *name, user name, must stay valid                *
+*         int loc, user location in known user table            *
+* Return: none                                                  *
+****************************************************************/
+void dirInsert(char *name, int loc)
+{
+	DirTable *table = atomic_load_explicit(&userDir, memory_order_relaxed);
+	unsigned int hash, i;
+
+	if(table == NULL || (dirCount + 1) * 2 > table->size)    // keep load factor at most 1/2
+		table = dirGrow(table);
+
+	hash = dirHash(name);
+	for(i = hash & (table->size - 1); atomic_load_explicit(&table->bucket[i].loc, memory_order_relaxed) != -1; i = (i + 1) & (table->size - 1));
+
+	table->bucket[i].hash = hash;
+	table->bucket[i].name = name;
+	atomic_store_explicit(&table->bucket[i].loc, loc, memory_order_release);    // lookups see a full bucket
+	dirCount++;
+}
+
+
+/****************************************************************
+* Func:   FNV-1a hash of a name                                 *
+* Param:  char *name, user name                                 *
+* Return: unsigned int, hash value                              *
+****************************************************************/
+unsigned int dirHash(char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	while(*name != '\0')
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+/****************************************************************
+* Func:   Double the number of buckets and rehash every name    *
+*         into a new table, publish it, retire the old one      *
+* Param:  DirTable *old, current table (NULL: none yet)         *
+* Return: DirTable*, new table                                  *
+****************************************************************/
+DirTable* dirGrow(DirTable *old)
+{
+	unsigned int size = old == NULL ? DIRINITSIZE : old->size * 2, i, j;
+	DirTable *table = (DirTable *)malloc(sizeof(DirTable) + sizeof(DirEntry) * size);
+
+	if(table == NULL)
+	{
+		printf("Grow user index\n");
+		exit(1);
+	}
+	table->size = size;
+	for(i = 0; i < size; i++)
+		atomic_init(&table->bucket[i].loc, -1);
+
+	for(i = 0; old != NULL && i < old->size; i++)    // cached hash, no need to hash names again
+	{
+		int loc = atomic_load_explicit(&old->bucket[i].loc, memory_order_relaxed);
+
+		if(loc == -1)
+			continue;
+		for(j = old->bucket[i].hash & (size - 1); atomic_load_explicit(&table->bucket[j].loc, memory_order_relaxed) != -1; j = (j + 1) & (size - 1));
+		table->bucket[j].hash = old->bucket[i].hash;
+		table->bucket[j].name = old->bucket[i].name;
+		atomic_init(&table->bucket[j].loc, loc);
+	}
+
+	atomic_store(&userDir, table);
+	if(old != NULL)
+		epochRetire(old, free);    // lookups may still probe it
+
+	return table;
+}
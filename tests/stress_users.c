@@ -0,0 +1,221 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Stress test of user registration against lock-free lookups and user lists                **
+**                                                                                           **
+**  Writers record new users through recordUser, which grows the name index (dirGrow) and    **
+**  the known user list many times, some logging in; the same names are recorded twice, by   **
+**  both writers. Meanwhile readers look names up with userLoc and listers hold snapshots    **
+**  of the known and connected user lists. A name recorded is found at its location from     **
+**  then on, a name found is the one at that location, a snapshot is a prefix of the table   **
+**  in table order. Meant for the Tsan build type, where ctest also catches data races.      **
+**  server.c is built into this test, its main is not run.                                   **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        void* writer(void *arg);                    // record every WRITERS-th name        **
+**        void* reader(void *arg);                    // look up names while they come       **
+**        void* lister(void *arg);                    // check user list snapshots           **
+**        void checkKnown(int *last);                 // one snapshot of known users         **
+**        void checkActive();                         // one snapshot of connected users     **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#define main serverMain         // the server's main is not run, its user table is
+#include "../src/server.c"
+#undef main
+
+#define USERS 30000             // names for 7 times dirGrow from 256 buckets
+#define WRITERS 2
+#define READERS 3
+#define LISTERS 2
+
+#define CHECK(cond) do{ if(!(cond)){ printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); atomic_fetch_add(&failures, 1); } }while(0)
+
+static char (*userName)[NAMESIZE];    // "user%06d" of each index
+static atomic_int *recorded;    // location + 1 once a writer recorded the name, 0 before
+static atomic_int recordedNew;  // recordUser calls that recorded a new user
+static atomic_int writing;      // writers still running
+static atomic_int failures;
+
+
+// function declare
+static void* writer(void *arg);
+static void* reader(void *arg);
+static void* lister(void *arg);
+static void checkKnown(int *last);
+static void checkActive();
+
+
+int main()
+{
+	pthread_t thread[WRITERS + READERS + LISTERS];
+	NameList *list;
+	int len, count, i;
+
+	knownList = listCreate(LISTINITSIZE, LISTINITNAMES);    // as the server's main does
+	activeList = listCreate(LISTINITSIZE, LISTINITNAMES);
+	userName = calloc(USERS, NAMESIZE);
+	recorded = calloc(USERS, sizeof(atomic_int));
+	for(i = 0; i < USERS; i++)
+		sprintf(userName[i], "user%06d", i);
+
+	atomic_store(&writing, WRITERS);
+	for(i = 0; i < WRITERS; i++)
+		pthread_create(&thread[i], NULL, writer, (void *)(intptr_t)i);
+	for(i = 0; i < READERS; i++)
+		pthread_create(&thread[WRITERS + i], NULL, reader, (void *)(intptr_t)i);
+	for(i = 0; i < LISTERS; i++)
+		pthread_create(&thread[WRITERS + READERS + i], NULL, lister, NULL);
+	for(i = 0; i < WRITERS + READERS + LISTERS; i++)
+		pthread_join(thread[i], NULL);
+
+	CHECK(atomic_load(&userTab.count) == USERS && atomic_load(&recordedNew) == USERS);
+	for(i = 0; i < USERS; i++)
+		CHECK(userLoc(userName[i]) == atomic_load(&recorded[i]) - 1);
+	list = listTake('1', &len, &count);
+	CHECK(count == USERS);
+	listRelease(list);
+	list = listTake('2', &len, &count);
+	CHECK(count == USERS / 2);                      // even names logged in
+	listRelease(list);
+
+	if(atomic_load(&failures) > 0)
+	{
+		printf("%d checks failed\n", atomic_load(&failures));
+		return 1;
+	}
+	printf("users stress test passed\n");
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Record every WRITERS-th name, then once more the one  *
+*         before it, which the other writer records; even names *
+*         log in                                                *
+* Param:  void *arg, writer number                              *
+* Return: void*, NULL                                           *
+****************************************************************/
+void* writer(void *arg)
+{
+	int w = (int)(intptr_t)arg, isNew, loc, i, j;
+
+	for(i = w; i < USERS; i += WRITERS)
+	{
+		for(j = i; j >= i - 1 && j >= 0; j--)
+		{
+			loc = recordUser(j % 2 == 0 ? 1000 + j : -1, userName[j], &isNew);
+			CHECK(loc >= 0 && loc < USERS && strcmp(USER(loc).name, userName[j]) == 0);
+			if(isNew)
+				atomic_fetch_add(&recordedNew, 1);
+			atomic_store_explicit(&recorded[j], loc + 1, memory_order_release);
+		}
+	}
+	atomic_fetch_sub(&writing, 1);
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Look names up while writers record them: a recorded   *
+*         name is found at its location, a name found is the    *
+*         one at that location                                  *
+* Param:  void *arg, reader number, seeds its names             *
+* Return: void*, NULL                                           *
+****************************************************************/
+void* reader(void *arg)
+{
+	unsigned int seed = (unsigned int)(intptr_t)arg + 1;
+	int i, known, loc;
+
+	while(atomic_load(&writing) > 0)
+	{
+		i = rand_r(&seed) % USERS;
+		known = atomic_load_explicit(&recorded[i], memory_order_acquire);
+		loc = userLoc(userName[i]);
+		if(known != 0)
+			CHECK(loc == known - 1);
+		else if(loc != -1)                          // recorded, the writer did not return yet
+			CHECK(strcmp(USER(loc).name, userName[i]) == 0);
+		CHECK(userLoc("nobody") == -1);
+	}
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   Take and check snapshots of both user lists while     *
+*         writers record users                                  *
+* Param:  void *arg, none                                       *
+* Return: void*, NULL                                           *
+****************************************************************/
+void* lister(void *arg)
+{
+	int last = 0, round;
+
+	for(round = 0; atomic_load(&writing) > 0; round++)
+	{
+		checkKnown(&last);
+		if(round % 8 == 0)
+			checkActive();
+	}
+	checkKnown(&last);
+
+	return NULL;
+}
+
+
+/****************************************************************
+* Func:   A known user list snapshot holds the users of the     *
+*         table in table order, never fewer than the last one   *
+* Param:  int *last, names of the last snapshot, updated        *
+* Return: none                                                  *
+****************************************************************/
+void checkKnown(int *last)
+{
+	NameList *list;
+	int len, count, lines = 0, i;
+
+	list = listTake('1', &len, &count);
+	CHECK(count >= *last && count <= USERS);
+	for(i = 0; i < count; i++)
+	{
+		int at = list->start[i], nameLen = USER(i).nameLen;
+
+		CHECK(memcmp(list->text + at, USER(i).name, nameLen) == 0 && list->text[at + nameLen] == '\n');
+		CHECK(at + nameLen < len && (i + 1 == count ? at + nameLen + 1 == len : list->start[i + 1] == at + nameLen + 1));
+	}
+	for(i = 0; i < len; i++)
+		lines += list->text[i] == '\n';
+	CHECK(lines == count);
+	*last = count;
+	listRelease(list);
+}
+
+
+/****************************************************************
+* Func:   A connected user list snapshot holds even names only, *
+*         each of them found by userLoc                         *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void checkActive()
+{
+	NameList *list;
+	char name[NAMESIZE];
+	int len, count, lines = 0, i, at;
+
+	list = listTake('2', &len, &count);
+	for(at = 0; at < len; at += strlen(name) + 1)
+	{
+		sscanf(list->text + at, "%79[^\n]", name);
+		CHECK(strncmp(name, "user", 4) == 0 && atoi(name + 4) % 2 == 0 && userLoc(name) != -1);
+		lines++;
+	}
+	CHECK(lines == count);
+	for(i = 0; i < count; i++)
+		CHECK(list->start[i] < len);
+	listRelease(list);
+}
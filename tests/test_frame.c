@@ -0,0 +1,308 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Unit tests of the frame formats of communicate.c                                         **
+**                                                                                           **
+**  Frames go through a socketpair: v1 and v2 headers as they are on the wire, content cut   **
+**  to fit v1, oversize v2 lengths, headers and content torn across reads, and payloads sent **
+**  in fragments. communicate.c is built into this test, so the checks reach its Stream      **
+**  state and internal functions.                                                            **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        void testV1();                              // v1 header, cut to 999, bad lengths  **
+**        void testV2();                              // v2 header, opcode and flags         **
+**        void testOversize();                        // v2 length over V2MAXLENGTH          **
+**        void testTorn();                            // header and content in many reads    **
+**        void testFragments();                       // payload in CHUNKSIZE fragments      **
+**        int rawRead(int sd, char *buffer, int len); // read exactly len bytes              **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include "../src/communicate.c"
+
+#define CHECK(cond) do{ if(!(cond)){ printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); failures++; } }while(0)
+
+static int failures;
+
+
+// function declare
+static void testV1();
+static void testV2();
+static void testOversize();
+static void testTorn();
+static void testFragments();
+static int rawRead(int sd, char *buffer, int len);
+
+
+int main()
+{
+	testV1();
+	testV2();
+	testOversize();
+	testTorn();
+	testFragments();
+
+	if(failures > 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("frame tests passed\n");
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   v1 frames: 3 chars of length, content cut to 999      *
+*         chars, whole lines kept when gathered from pieces; a  *
+*         length with a sign or a letter is a protocol error    *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testV1()
+{
+	char raw[2048], content[FRAMESIZE], big[1500];
+	char *bad[] = {"-10abcdefghijklmnop", "-99x", "+10abcdefghij", "1x0abc", "\t10abcdefghij", " -1"};
+	struct iovec iov[4];
+	int sd[2], op = -1, fl = -1, i;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	CHECK(writeFrame(sd[0], OP_DATA, 0, "hello", 5) == 0);
+	CHECK(rawRead(sd[1], raw, 8) == 8 && memcmp(raw, "  5hello", 8) == 0);
+
+	CHECK(writeFrame(sd[0], OP_PUSH, FLAG_MORE, "", 0) == 0);    // no opcode, no flags in v1
+	CHECK(readFrame(sd[1], &op, &fl, content, sizeof(content)) == 0 && op == OP_DATA && fl == 0);
+
+	memset(big, 'x', sizeof(big));                  // one long line: cut at 999
+	CHECK(writeFrame(sd[0], OP_DATA, 0, big, sizeof(big)) == 0);
+	CHECK(rawRead(sd[1], raw, V1HEADER + V1MAXLENGTH) == V1HEADER + V1MAXLENGTH && memcmp(raw, "999", 3) == 0);
+
+	for(i = 0; i < (int)sizeof(big); i++)           // lines of 100 chars in three pieces
+		big[i] = i % 100 == 99 ? '\n' : 'a' + i % 26;
+	iov[1].iov_base = big;
+	iov[1].iov_len = 450;
+	iov[2].iov_base = big + 450;
+	iov[2].iov_len = 450;
+	iov[3].iov_base = big + 900;
+	iov[3].iov_len = 600;
+	CHECK(writeFrameV(sd[0], OP_DATA, 0, iov, 4) == 0);
+	CHECK(readFrame(sd[1], NULL, NULL, content, sizeof(content)) == 900);
+	CHECK(memcmp(content, big, 900) == 0 && content[899] == '\n');
+
+	CHECK(writeFrame(sd[0], OP_DATA, 0, "abcdef", 6) == 0);    // the reader cuts to its size
+	CHECK(readFrame(sd[1], NULL, NULL, content, 4) == 3 && strcmp(content, "abc") == 0);
+
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+
+	for(i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++)    // a sign or a letter: protocol error
+	{
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+		CHECK(write(sd[0], bad[i], strlen(bad[i])) == (int)strlen(bad[i]));
+		CHECK(streamFill(sd[1]) == (int)strlen(bad[i]));
+		CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -2);
+		CHECK(readFrame(sd[1], NULL, NULL, content, sizeof(content)) == -1);
+		streamClose(sd[0]);
+		streamClose(sd[1]);
+	}
+}
+
+
+/****************************************************************
+* Func:   v2 frames: 4 bytes of length in network byte order,   *
+*         opcode, flags, content of any length                  *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testV2()
+{
+	unsigned char raw[16];
+	char *big = (char *)malloc(200000), *content = (char *)malloc(200001);
+	int sd[2], op = -1, fl = -1;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[0], 2);
+	streamSetVersion(sd[1], 2);
+	CHECK(streamVersion(sd[0]) == 2);
+
+	CHECK(writeFrame(sd[0], OP_PUSH, FLAG_MORE, "hi", 2) == 0);
+	CHECK(rawRead(sd[1], (char *)raw, 8) == 8);
+	CHECK(raw[0] == 0 && raw[1] == 0 && raw[2] == 0 && raw[3] == 2 && raw[4] == OP_PUSH && raw[5] == FLAG_MORE);
+	CHECK(raw[6] == 'h' && raw[7] == 'i');
+
+	CHECK(writeFrame(sd[0], OP_PUSH, FLAG_MORE, "hi", 2) == 0);
+	CHECK(readFrame(sd[1], &op, &fl, content, 16) == 2 && op == OP_PUSH && fl == FLAG_MORE && strcmp(content, "hi") == 0);
+
+	memset(big, 'y', 200000);                       // larger than the receive buffer, it grows
+	big[199999] = 'z';
+	CHECK(writeFrame(sd[0], OP_DATA, 0, big, 200000) == 0);
+	CHECK(readFrame(sd[1], &op, &fl, content, 200001) == 200000 && op == OP_DATA && fl == 0);
+	CHECK(memcmp(content, big, 200000) == 0);
+
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+	free(big);
+	free(content);
+}
+
+
+/****************************************************************
+* Func:   A v2 length over V2MAXLENGTH is a protocol error,     *
+*         the largest one allowed is waited for                 *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testOversize()
+{
+	unsigned char header[V2HEADER] = {0, 0, 0, 0, OP_DATA, 0};
+	uint32_t netLen;
+	char content[16];
+	int sd[2];
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[1], 2);
+	netLen = htonl(V2MAXLENGTH);                    // allowed, not complete yet
+	memcpy(header, &netLen, 4);
+	CHECK(write(sd[0], header, V2HEADER) == V2HEADER);
+	CHECK(streamFill(sd[1]) == V2HEADER);
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -1);
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[1], 2);
+	netLen = htonl(V2MAXLENGTH + 1);
+	memcpy(header, &netLen, 4);
+	CHECK(write(sd[0], header, V2HEADER) == V2HEADER);
+	CHECK(streamFill(sd[1]) == V2HEADER);
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -2);
+	CHECK(readFrame(sd[1], NULL, NULL, content, sizeof(content)) == -1);
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);        // the sign bit is no negative length either
+	streamSetVersion(sd[1], 2);
+	netLen = htonl(0x80000001u);
+	memcpy(header, &netLen, 4);
+	CHECK(write(sd[0], header, V2HEADER) == V2HEADER);
+	CHECK(streamFill(sd[1]) == V2HEADER);
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -2);
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+}
+
+
+/****************************************************************
+* Func:   Frames torn anywhere, header included, come out whole *
+*         once the last byte is read; frames read together come *
+*         out one by one                                        *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testTorn()
+{
+	unsigned char v2[] = {0, 0, 0, 5, OP_PUSH, 0, 'w', 'o', 'r', 'l', 'd'};
+	char v1[] = "  5hello  3abc";
+	char content[16];
+	int sd[2], op, cut, version;
+
+	for(version = 1; version <= 2; version++)
+	{
+		char *frame = version == 1 ? v1 : (char *)v2;
+		int len = version == 1 ? 8 : (int)sizeof(v2);
+
+		for(cut = 1; cut < len; cut++)             // first part, then the rest
+		{
+			socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+			fcntl(sd[1], F_SETFL, O_NONBLOCK);
+			streamSetVersion(sd[1], version);
+			CHECK(write(sd[0], frame, cut) == cut);
+			CHECK(streamFill(sd[1]) == cut);
+			CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -1);
+			CHECK(streamFill(sd[1]) == 0);         // nothing more yet
+			CHECK(write(sd[0], frame + cut, len - cut) == len - cut);
+			CHECK(streamFill(sd[1]) == len - cut);
+			CHECK(streamNext(sd[1], &op, NULL, content, sizeof(content)) == 5);
+			CHECK(strcmp(content, version == 1 ? "hello" : "world") == 0 && op == (version == 1 ? OP_DATA : OP_PUSH));
+			CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -1);
+			streamClose(sd[0]);
+			streamClose(sd[1]);
+		}
+	}
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);        // two frames in one read
+	CHECK(write(sd[0], v1, strlen(v1)) == (int)strlen(v1));
+	CHECK(streamFill(sd[1]) == (int)strlen(v1));
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == 5 && strcmp(content, "hello") == 0);
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == 3 && strcmp(content, "abc") == 0);
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -1);
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+}
+
+
+/****************************************************************
+* Func:   A payload larger than CHUNKSIZE on a chunked sd goes  *
+*         out in fragments cut at line ends, FLAG_MORE on all   *
+*         but the last; the same payload is one frame otherwise *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testFragments()
+{
+	int size = 5 * CHUNKSIZE + 123;
+	char *payload = (char *)malloc(size), *content = (char *)malloc(size + 1);
+	int sd[2], op, fl, len, total = 0, frames = 0, last = 0, i;
+
+	for(i = 0; i < size; i++)                       // lines of 37 chars
+		payload[i] = i % 37 == 36 ? '\n' : '0' + i % 10;
+	payload[size - 1] = '\n';
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[0], 2);
+	streamSetVersion(sd[1], 2);
+	streamChunk(sd[0]);
+	CHECK(writePayload(sd[0], OP_DATA, payload, size, NULL, NULL) == 0);
+	CHECK(!streamBusy(sd[0]));                      // a blocking sd sends it all before return
+	while(!last && (len = readFrame(sd[1], &op, &fl, content, CHUNKSIZE + 1)) >= 0)
+	{
+		CHECK(len > 0 && len <= CHUNKSIZE && content[len - 1] == '\n');
+		CHECK(memcmp(content, payload + total, len) == 0);
+		total += len;
+		frames++;
+		last = !(fl & FLAG_MORE);
+	}
+	CHECK(total == size && frames == 6);
+
+	streamClose(sd[0]);                             // not chunked: one frame
+	streamClose(sd[1]);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[0], 2);
+	streamSetVersion(sd[1], 2);
+	CHECK(writePayload(sd[0], OP_DATA, payload, size, NULL, NULL) == 0);
+	CHECK(readFrame(sd[1], &op, &fl, content, size + 1) == size && fl == 0 && memcmp(content, payload, size) == 0);
+
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+	free(payload);
+	free(content);
+}
+
+
+/****************************************************************
+* Func:   Read exactly len bytes of a frame as they are on the  *
+*         wire                                                  *
+* Param:  int sd, socket description                            *
+*         char *buffer, len chars                               *
+*         int len, bytes to read                                *
+* Return: int, bytes read, less if the peer closed              *
+****************************************************************/
+int rawRead(int sd, char *buffer, int len)
+{
+	int got = 0, n;
+
+	while(got < len && (n = read(sd, buffer + got, len - got)) > 0)
+		got += n;
+
+	return got;
+}
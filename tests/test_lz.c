@@ -0,0 +1,298 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Unit tests of the LZ4-style frame compression of communicate.c                           **
+**                                                                                           **
+**  lzEncode/lzDecode round trips on text, random bytes, runs of one byte (matches that      **
+**  overlap themselves), literal runs and matches long enough for many length bytes, and     **
+**  many frames through one hash table, including the restart of its base position. The      **
+**  decoder, which reads what comes from the network, is given every prefix of a valid block **
+**  and hand made malformed ones (offset 0 or before the output, lengths past the input,     **
+**  endless length bytes), and random bytes. Last, a compressed frame through a socketpair.  **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        void testRoundTrip();                       // encode, decode, compare             **
+**        void testTable();                           // many frames, one table              **
+**        void testTruncated();                       // every prefix of a block             **
+**        void testMalformed();                       // invalid blocks are rejected         **
+**        void testFrame();                           // FLAG_LZ frames on the wire          **
+**        int roundTrip(Stream *st, unsigned char *src, int len);                            **
+**                                                    // compressed length, -1 mismatch      **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include "../src/communicate.c"
+
+#define CHECK(cond) do{ if(!(cond)){ printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); failures++; } }while(0)
+#define TESTSD 100000           // sd of the Stream used for encoding, no socket behind it
+
+static int failures;
+
+
+// function declare
+static void testRoundTrip();
+static void testTable();
+static void testTruncated();
+static void testMalformed();
+static void testFrame();
+static int roundTrip(Stream *st, unsigned char *src, int len);
+
+
+int main()
+{
+	streamSetVersion(TESTSD, 2);
+	streamCompress(TESTSD);
+
+	testRoundTrip();
+	testTable();
+	testTruncated();
+	testMalformed();
+	testFrame();
+
+	if(failures > 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("lz tests passed\n");
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Round trips: repeated text shrinks, random bytes grow *
+*         by the bound at most, one byte repeated overlaps the  *
+*         match, long literal runs and matches take many length *
+*         bytes; every length from LZMIN on                     *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testRoundTrip()
+{
+	Stream *st = streamGet(TESTSD);
+	int size = 100000, len, packed, i;
+	unsigned char *src = (unsigned char *)malloc(size), *dst = (unsigned char *)malloc(size + size / 255 + 16);
+
+	for(i = 0, len = 0; len < size - 64; i++)       // lines of a user list
+		len += sprintf((char *)src + len, "user%06d\n", i % 3000);
+	packed = roundTrip(st, src, len);
+	CHECK(packed > 0 && packed < len / 2);
+
+	srand(7);
+	for(i = 0; i < size; i++)                       // does not repeat itself
+		src[i] = rand();
+	packed = roundTrip(st, src, size);
+	CHECK(packed >= size && packed <= size + size / 255 + 16);
+
+	memset(src, 'a', size);                         // offset 1, one match of 99K
+	packed = roundTrip(st, src, size);
+	CHECK(packed > 0 && packed < 600);
+	for(i = 0; i < size; i++)                       // offset 3
+		src[i] = "abc"[i % 3];
+	CHECK(roundTrip(st, src, size) > 0);
+
+	for(i = 0; i < 1000; i++)                       // 1000 literals, then a match of 3000
+		src[i] = rand();
+	for(i = 1000; i < 4000; i++)
+		src[i] = src[i - 1000];
+	packed = lzEncode(st, src, 4000, dst);
+	CHECK(dst[0] >> 4 == 15 && dst[1] == 255 && dst[2] == 255 && dst[3] == 255 && dst[4] < 255);    // 1000 literals or a few more
+	CHECK(roundTrip(st, src, 4000) > 0 && packed < 1100);
+
+	for(len = LZMIN; len < LZMIN + 300; len++)      // every tail length
+	{
+		for(i = 0; i < len; i++)
+			src[i] = i % 50 < 20 ? 'x' : rand() % 4;
+		CHECK(roundTrip(st, src, len) > 0);
+	}
+
+	free(src);
+	free(dst);
+}
+
+
+/****************************************************************
+* Func:   Frames one after another share the hash table of the  *
+*         sd; entries of earlier frames never match, also after *
+*         the base position starts over near 1 << 30            *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testTable()
+{
+	Stream *st = streamGet(TESTSD);
+	unsigned char src[2000];
+	int frame, i;
+
+	for(frame = 0; frame < 2000; frame++)
+	{
+		for(i = 0; i < (int)sizeof(src); i++)       // repeats within a frame, differs across frames
+			src[i] = (i % (7 + frame % 13)) + frame;
+		if(frame == 1000)
+			st->lzPos = (1u << 30) + 1;             // next frame starts the base over
+		CHECK(roundTrip(st, src, 300 + frame % 1700) > 0);
+		if(frame == 1000)
+			CHECK(st->lzPos == (uint32_t)(300 + frame % 1700));
+	}
+}
+
+
+/****************************************************************
+* Func:   Every prefix of a valid block is rejected, or decodes *
+*         to a prefix of the original content                   *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testTruncated()
+{
+	Stream *st = streamGet(TESTSD);
+	int size = 3000, packed, cut, n, i;
+	unsigned char *src = (unsigned char *)malloc(size), *dst = (unsigned char *)malloc(size + size / 255 + 16);
+	char *out = (char *)malloc(size);
+
+	for(i = 0; i < size; i++)
+		src[i] = i < 400 ? rand() : (i < 1500 ? 'z' : src[i - 977]);
+	packed = lzEncode(st, src, size, dst);
+	CHECK(lzDecode(dst, packed, out, size) == size && memcmp(out, src, size) == 0);
+
+	for(cut = 0; cut < packed; cut++)
+	{
+		unsigned char *copy = (unsigned char *)malloc(cut + 1);    // nothing to read past cut
+
+		memcpy(copy, dst, cut);
+		n = lzDecode(copy, cut, out, size);
+		CHECK(n == -1 || (n >= 0 && n < size && memcmp(out, src, n) == 0));
+		free(copy);
+	}
+
+	CHECK(lzDecode(dst, packed, out, 1000) == 1000 && memcmp(out, src, 1000) == 0);    // cut by the reader
+	CHECK(lzDecode(dst, packed, out, 1) == 1 && out[0] == (char)src[0]);
+
+	free(src);
+	free(dst);
+	free(out);
+}
+
+
+/****************************************************************
+* Func:   Blocks a peer could send that lzEncode never makes    *
+*         are rejected, random bytes never write past the end   *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testMalformed()
+{
+	unsigned char offsetZero[] = {0x10, 'a', 0x00, 0x00};
+	unsigned char offsetBefore[] = {0x10, 'a', 0x02, 0x00};
+	unsigned char literalsPast[] = {0x50, 'a', 'b'};
+	unsigned char halfOffset[] = {0x10, 'a', 0x01};
+	unsigned char literalBytes[] = {0xf0, 255};
+	unsigned char matchBytes[] = {0x1f, 'a', 0x01, 0x00};
+	unsigned char overlap[] = {0x1f, 'a', 0x01, 0x00, 10, 0x00};    // 'a' then 29 more
+	unsigned char *endless, *noise;
+	char out[4096];
+	int i, len, n;
+
+	CHECK(lzDecode(offsetZero, sizeof(offsetZero), out, sizeof(out)) == -1);
+	CHECK(lzDecode(offsetBefore, sizeof(offsetBefore), out, sizeof(out)) == -1);
+	CHECK(lzDecode(literalsPast, sizeof(literalsPast), out, sizeof(out)) == -1);
+	CHECK(lzDecode(halfOffset, sizeof(halfOffset), out, sizeof(out)) == -1);
+	CHECK(lzDecode(literalBytes, 1, out, sizeof(out)) == -1);
+	CHECK(lzDecode(literalBytes, sizeof(literalBytes), out, sizeof(out)) == -1);
+	CHECK(lzDecode(matchBytes, sizeof(matchBytes), out, sizeof(out)) == -1);
+	CHECK(lzDecode(overlap, sizeof(overlap), out, sizeof(out)) == 30 && out[0] == 'a' && out[29] == 'a');
+	CHECK(lzDecode(overlap, sizeof(overlap), out, 8) == 8);    // a match past the reader's size is cut
+	CHECK(lzDecode(overlap, 0, out, sizeof(out)) == 0);
+
+	endless = (unsigned char *)malloc(8192);        // lengths over V2MAXLENGTH
+	endless[0] = 0xf0;
+	memset(endless + 1, 255, 8191);
+	CHECK(lzDecode(endless, 8192, out, sizeof(out)) == -1);
+	endless[0] = 0x0f;
+	endless[1] = 0x01;
+	endless[2] = 0x00;
+	CHECK(lzDecode(endless, 8192, out, sizeof(out)) == -1);    // offset before any output
+	free(endless);
+
+	noise = (unsigned char *)malloc(512);
+	srand(11);
+	for(i = 0; i < 20000; i++)
+	{
+		len = rand() % 512;
+		for(n = 0; n < len; n++)
+			noise[n] = rand() % 4 == 0 ? 255 : rand();
+		n = lzDecode(noise, len, out, sizeof(out));
+		CHECK(n >= -1 && n <= (int)sizeof(out));
+	}
+	free(noise);
+}
+
+
+/****************************************************************
+* Func:   A frame of LZMIN bytes or more goes out with FLAG_LZ  *
+*         when shorter and comes out as it was; a short one is  *
+*         sent as it is; a broken block is a protocol error     *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testFrame()
+{
+	unsigned char header[V2HEADER], bad[V2HEADER + 4] = {0, 0, 0, 4, OP_DATA, FLAG_LZ, 0x10, 'a', 0x00, 0x00};
+	char content[8192], text[4096], plain[4096];
+	uint32_t netLen;
+	int sd[2], op, fl, len = 0, i;
+
+	for(i = 0; len < (int)sizeof(text) - 32; i++)
+		len += sprintf(text + len, "alice, 10/18/2026,9:5 AM, hi %d\n", i % 10);
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[0], 2);
+	streamSetVersion(sd[1], 2);
+	streamCompress(sd[0]);
+	CHECK(writeFrame(sd[0], OP_PUSH, 0, text, len) == 0);
+	CHECK(read(sd[1], header, V2HEADER) == V2HEADER);
+	memcpy(&netLen, header, 4);
+	CHECK(header[4] == OP_PUSH && header[5] == FLAG_LZ && (int)ntohl(netLen) < len / 4);
+	CHECK(read(sd[1], content, ntohl(netLen)) == (int)ntohl(netLen));
+	CHECK(lzDecode((unsigned char *)content, ntohl(netLen), plain, sizeof(plain)) == len && memcmp(plain, text, len) == 0);
+
+	CHECK(writeFrame(sd[0], OP_DATA, 0, text, len) == 0);    // the reader sees the content
+	CHECK(readFrame(sd[1], &op, &fl, content, sizeof(content)) == len && op == OP_DATA && fl == 0);
+	CHECK(memcmp(content, text, len) == 0);
+
+	CHECK(writeFrame(sd[0], OP_DATA, 0, text, LZMIN - 1) == 0);    // too short to try
+	CHECK(read(sd[1], header, V2HEADER) == V2HEADER && header[5] == 0);
+	CHECK(read(sd[1], content, LZMIN - 1) == LZMIN - 1);
+
+	CHECK(write(sd[0], bad, sizeof(bad)) == (int)sizeof(bad));
+	CHECK(streamFill(sd[1]) == (int)sizeof(bad));
+	CHECK(streamNext(sd[1], NULL, NULL, content, sizeof(content)) == -2);
+
+	streamClose(sd[0]);
+	streamClose(sd[1]);
+}
+
+
+/****************************************************************
+* Func:   Compress content, decompress it, compare              *
+* Param:  Stream *st, buffers with a hash table                 *
+*         unsigned char *src, content, LZMIN bytes or more      *
+*         int len, length of the content                        *
+* Return: int, length of the compressed content                 *
+*         -1 not the same content after the round trip          *
+****************************************************************/
+int roundTrip(Stream *st, unsigned char *src, int len)
+{
+	unsigned char *dst = (unsigned char *)malloc(len + len / 255 + 16);
+	char *out = (char *)malloc(len + 1);
+	int packed, n;
+
+	packed = lzEncode(st, src, len, dst);
+	n = lzDecode(dst, packed, out, len + 1);
+	if(n != len || memcmp(out, src, len) != 0)
+		packed = -1;
+	free(dst);
+	free(out);
+
+	return packed;
+}
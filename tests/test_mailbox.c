@@ -0,0 +1,250 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Unit tests of the mailbox ring of mailbox.c                                              **
+**                                                                                           **
+**  One thread: order and contents of messages, positions as the ring wraps around many      **
+**  times, claimed records read in place and released oldest first, rejecting a new message  **
+**  or dropping the oldest one when the ring is full, and held records that are never        **
+**  dropped.                                                                                 **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        void testEmpty();                           // no mailbox yet                      **
+**        void testWrap();                            // FIFO order across many rounds       **
+**        void testClaim();                           // claim, read in place, release       **
+**        void testReject();                          // full ring rejects new messages      **
+**        void testDrop();                            // full ring drops the oldest          **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CAPACITY 4              // records in each ring of this test
+#define MESSAGELENGTH 80        // max 80 characters for a message, see mailbox.c
+#define MAIL_OK 0
+#define MAIL_DROPPED 1
+#define MAIL_FULL -1
+
+#define CHECK(cond) do{ if(!(cond)){ printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); failures++; } }while(0)
+
+typedef struct Mailbox Mailbox;
+
+static int failures;
+
+
+// function declare
+extern void mailConfig(int size, int drop);    // external function (mailbox.c)
+extern int mailPut(Mailbox **box, int from, time_t time, char *message, uint64_t *at);    // external function (mailbox.c)
+extern int mailGet(Mailbox *box, int *from, time_t *time, char *message);    // external function (mailbox.c)
+extern int mailCount(Mailbox *box);            // external function (mailbox.c)
+extern uint64_t mailTail(Mailbox *box);        // external function (mailbox.c)
+extern int mailClaim(Mailbox *box, uint64_t *first, int more);    // external function (mailbox.c)
+extern char* mailAt(Mailbox *box, uint64_t pos, int *from, time_t *time, int *len);    // external function (mailbox.c)
+extern void mailRelease(Mailbox *box, uint64_t upTo);    // external function (mailbox.c)
+static void testEmpty();
+static void testWrap();
+static void testClaim();
+static void testReject();
+static void testDrop();
+
+
+int main()
+{
+	mailConfig(CAPACITY, 0);
+	testEmpty();
+	testWrap();
+	testClaim();
+	testReject();
+	mailConfig(CAPACITY, 1);
+	testDrop();
+
+	if(failures > 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("mailbox tests passed\n");
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   A user nobody sent to has no mailbox                  *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testEmpty()
+{
+	Mailbox *box = NULL;
+	char message[MESSAGELENGTH + 1];
+	uint64_t first = 1;
+	int from;
+	time_t time;
+
+	CHECK(mailGet(NULL, &from, &time, message) == 0);
+	CHECK(mailCount(NULL) == 0 && mailTail(NULL) == 0);
+	CHECK(mailClaim(NULL, &first, CAPACITY) == 0 && first == 0);
+	mailRelease(NULL, 10);
+
+	CHECK(mailPut(&box, 7, 100, "first", &first) == MAIL_OK && box != NULL && first == 0);
+	CHECK(mailGet(box, &from, &time, message) == 1 && from == 7 && time == 100 && strcmp(message, "first") == 0);
+	CHECK(mailGet(box, &from, &time, message) == 0 && mailCount(box) == 0 && mailTail(box) == 1);
+}
+
+
+/****************************************************************
+* Func:   Messages come out in order with their sender and time *
+*         as positions go round the ring many times, at every   *
+*         fill level; long messages are cut to MESSAGELENGTH    *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testWrap()
+{
+	Mailbox *box = NULL;
+	char text[MESSAGELENGTH + 1], message[MESSAGELENGTH + 1], longText[200];
+	uint64_t pos, next = 0;
+	int put = 0, got = 0, from, fill, i;
+	time_t time;
+
+	for(fill = 1; fill <= CAPACITY; fill++)
+	{
+		for(i = 0; i < 5 * CAPACITY; i++)          // keep fill messages queued
+		{
+			while(put - got < fill)
+			{
+				sprintf(text, "message %d", put);
+				CHECK(mailPut(&box, put, put * 10, text, &pos) == MAIL_OK && pos == next);
+				next++;
+				put++;
+			}
+			CHECK(mailCount(box) == fill && mailTail(box) == (uint64_t)got);
+			sprintf(text, "message %d", got);
+			CHECK(mailGet(box, &from, &time, message) == 1 && from == got && time == got * 10 && strcmp(message, text) == 0);
+			got++;
+		}
+	}
+	while(mailGet(box, NULL, NULL, NULL))
+		got++;
+	CHECK(got == put && mailCount(box) == 0);
+
+	memset(longText, 'x', sizeof(longText) - 1);
+	longText[sizeof(longText) - 1] = '\0';
+	CHECK(mailPut(&box, 1, 1, longText, NULL) == MAIL_OK);
+	CHECK(mailGet(box, NULL, NULL, message) == 1 && strlen(message) == MESSAGELENGTH);
+}
+
+
+/****************************************************************
+* Func:   Claimed records stay in their cells, count as queued  *
+*         and are claimed again until released oldest first;    *
+*         claims run across the end of the ring                 *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testClaim()
+{
+	Mailbox *box = NULL;
+	char text[MESSAGELENGTH + 1], *content;
+	uint64_t first, pos;
+	int from, len, i;
+	time_t time;
+
+	for(i = 0; i < 3; i++)                          // positions 3.. wrap at CAPACITY
+		mailPut(&box, 0, 0, "skip", NULL);
+	while(mailGet(box, NULL, NULL, NULL));
+	for(i = 0; i < CAPACITY; i++)
+	{
+		sprintf(text, "claim %d", i);
+		CHECK(mailPut(&box, i, i, text, &pos) == MAIL_OK && pos == (uint64_t)(3 + i));
+	}
+
+	CHECK(mailClaim(box, &first, 2) == 2 && first == 3);
+	content = mailAt(box, 4, &from, &time, &len);
+	CHECK(from == 1 && time == 1 && len == 7 && memcmp(content, "claim 1", 7) == 0);
+	CHECK(mailCount(box) == CAPACITY && mailTail(box) == 3);
+	CHECK(mailClaim(box, &first, 0) == 2 && first == 3);    // nothing more, the held ones
+	CHECK(mailClaim(box, &first, 10) == CAPACITY && first == 3);    // the rest, across the end
+	content = mailAt(box, 6, &from, &time, &len);
+	CHECK(from == 3 && memcmp(content, "claim 3", 7) == 0);
+	CHECK(mailGet(box, NULL, NULL, NULL) == 0);     // nothing left to dequeue
+
+	mailRelease(box, 5);                            // oldest two
+	CHECK(mailTail(box) == 5 && mailCount(box) == 2);
+	CHECK(mailClaim(box, &first, 0) == 2 && first == 5);
+	CHECK(mailPut(&box, 9, 9, "after", &pos) == MAIL_OK && pos == 7);
+	CHECK(mailClaim(box, &first, 1) == 3 && first == 5);
+	mailRelease(box, 100);                          // beyond the held ones: all of them
+	CHECK(mailTail(box) == 8 && mailCount(box) == 0);
+	CHECK(mailClaim(box, &first, 1) == 0 && first == 8);
+}
+
+
+/****************************************************************
+* Func:   A full ring rejects the new message, also when its    *
+*         records are held                                      *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testReject()
+{
+	Mailbox *box = NULL;
+	char message[MESSAGELENGTH + 1];
+	uint64_t first;
+	int i;
+
+	for(i = 0; i < CAPACITY; i++)
+		CHECK(mailPut(&box, i, i, "keep", NULL) == MAIL_OK);
+	CHECK(mailPut(&box, 9, 9, "new", NULL) == MAIL_FULL && mailCount(box) == CAPACITY);
+	CHECK(mailGet(box, NULL, NULL, message) == 1 && strcmp(message, "keep") == 0);
+	CHECK(mailPut(&box, 9, 9, "new", NULL) == MAIL_OK);
+
+	CHECK(mailClaim(box, &first, CAPACITY) == CAPACITY);
+	CHECK(mailPut(&box, 9, 9, "new", NULL) == MAIL_FULL);
+	mailRelease(box, first + 1);
+	CHECK(mailPut(&box, 9, 9, "new", NULL) == MAIL_OK);
+}
+
+
+/****************************************************************
+* Func:   A full ring in drop mode drops the oldest message for *
+*         the new one, never a held record                      *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testDrop()
+{
+	Mailbox *box = NULL;
+	char text[MESSAGELENGTH + 1], message[MESSAGELENGTH + 1], *content;
+	uint64_t first, pos;
+	int from, len, i;
+	time_t time;
+
+	for(i = 0; i < CAPACITY + 2; i++)
+	{
+		sprintf(text, "drop %d", i);
+		CHECK(mailPut(&box, i, i, text, &pos) == (i < CAPACITY ? MAIL_OK : MAIL_DROPPED) && pos == (uint64_t)i);
+	}
+	CHECK(mailCount(box) == CAPACITY && mailTail(box) == 2);
+	CHECK(mailGet(box, &from, &time, message) == 1 && from == 2 && strcmp(message, "drop 2") == 0);
+
+	CHECK(mailPut(&box, 6, 6, "drop 6", NULL) == MAIL_OK);
+	CHECK(mailClaim(box, &first, 2) == 2 && first == 3);    // oldest two held
+	CHECK(mailPut(&box, 7, 7, "drop 7", NULL) == MAIL_FULL);
+	content = mailAt(box, 3, &from, &time, &len);
+	CHECK(from == 3 && memcmp(content, "drop 3", len) == 0);
+	mailRelease(box, first + 2);                    // 5 and 6 left
+	CHECK(mailPut(&box, 7, 7, "drop 7", &pos) == MAIL_OK && pos == 7);
+	CHECK(mailPut(&box, 8, 8, "drop 8", &pos) == MAIL_OK && pos == 8);
+	CHECK(mailPut(&box, 9, 9, "drop 9", &pos) == MAIL_DROPPED && pos == 9);
+	for(i = 6; i <= 9; i++)                         // 5 was dropped
+	{
+		sprintf(text, "drop %d", i);
+		CHECK(mailGet(box, &from, NULL, message) == 1 && from == i && strcmp(message, text) == 0);
+	}
+	CHECK(mailCount(box) == 0);
+}
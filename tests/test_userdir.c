@@ -0,0 +1,145 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Unit tests of the user name index of userdir.c                                           **
+**                                                                                           **
+**  One writer: every name indexed so far is found with its location after each time the     **
+**  table doubles, names never indexed are not, names that share a bucket or differ in one   **
+**  character are told apart.                                                                **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        void testEmpty();                           // nothing indexed yet                 **
+**        void testGrow();                            // lookups across many dirGrow         **
+**        void testCollide();                         // names in the same bucket            **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAMESIZE 80             // max characters for a name
+#define USERS 40000             // enough names for 8 times dirGrow from 256 buckets
+#define DIRINITSIZE 256         // initial number of buckets, see userdir.c
+
+#define CHECK(cond) do{ if(!(cond)){ printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); failures++; } }while(0)
+
+static char (*name)[NAMESIZE];  // names indexed, the index does not copy them
+static int count;               // names indexed so far
+static int failures;
+
+
+// function declare
+extern int dirFind(char *name);                // external function (userdir.c)
+extern void dirInsert(char *name, int loc);    // external function (userdir.c)
+extern unsigned int dirHash(char *name);       // external function (userdir.c)
+extern void epochEnter();                      // external function (epoch.c)
+extern void epochExit();                       // external function (epoch.c)
+static void testEmpty();
+static void testGrow();
+static void testCollide();
+
+
+int main()
+{
+	name = calloc(USERS + DIRINITSIZE, NAMESIZE);
+
+	testEmpty();
+	testGrow();
+	testCollide();
+
+	if(failures > 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("userdir tests passed\n");
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   Lookups before the first name is indexed              *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testEmpty()
+{
+	epochEnter();
+	CHECK(dirFind("nobody") == -1);
+	CHECK(dirFind("") == -1);
+	epochExit();
+	CHECK(dirHash("") == 2166136261u);              // FNV-1a offset basis
+	CHECK(dirHash("a") == 0xe40c292cu);
+}
+
+
+/****************************************************************
+* Func:   Index USERS names; right before and after each time   *
+*         the table doubles, every name so far is found         *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testGrow()
+{
+	char other[NAMESIZE];
+	int size = DIRINITSIZE, grows = 0, i;
+
+	for(count = 0; count < USERS; count++)
+	{
+		sprintf(name[count], "user%06d", count);
+		dirInsert(name[count], count);
+		CHECK(dirFind(name[count]) == count);
+
+		if((count + 2) * 2 > size || (count + 1) * 2 > size)    // the next insert grows, or this one did
+		{
+			if((count + 1) * 2 > size)
+			{
+				size *= 2;
+				grows++;
+			}
+			epochEnter();
+			for(i = 0; i <= count; i++)
+				CHECK(dirFind(name[i]) == i);
+			sprintf(other, "user%06d", count + 1);    // the next one, not yet
+			CHECK(dirFind(other) == -1);
+			epochExit();
+		}
+	}
+	CHECK(grows >= 8);
+
+	epochEnter();
+	CHECK(dirFind("user") == -1 && dirFind("user0000001") == -1 && dirFind("User000001") == -1);
+	for(i = 0; i < USERS; i += 997)
+		CHECK(dirFind(name[i]) == i);
+	epochExit();
+}
+
+
+/****************************************************************
+* Func:   Names whose hashes pick the same bucket are all found *
+*         by probing, and a missing name in that run is not     *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testCollide()
+{
+	char probe[NAMESIZE];
+	unsigned int mask = 255, bucket;
+	int same = 0, first = count, i;
+
+	bucket = dirHash("collide") & mask;             // same low bits: a run in every table size
+	for(i = 0; same < 16; i++)
+	{
+		sprintf(probe, "c%d", i);
+		if((dirHash(probe) & mask) != bucket)
+			continue;
+		strcpy(name[count], probe);
+		dirInsert(name[count], count);
+		count++;
+		same++;
+	}
+	for(i = first; i < count; i++)
+		CHECK(dirFind(name[i]) == i);
+	CHECK(dirFind("collide") == -1);
+}
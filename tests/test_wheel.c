@@ -0,0 +1,252 @@
+/**********************************************************************************************
+***********************************************************************************************
+**  Unit tests of the timing wheel of reactor.c                                              **
+**                                                                                           **
+**  A shard with a wheel and no epoll instance: the slot a connection lands in, taking it    **
+**  out from the front, the middle and the end of a slot, due seconds a turn or more ahead,  **
+**  slots handled as the clock passes them (across the end of the wheel), a connection that  **
+**  read meanwhile moving to its new second, and a silent one pinged. reactor.c is built     **
+**  into this test; what it calls in server.c, log.c and arena.c is stubbed below.           **
+**                                                                                           **
+**  Functions:                                                                               **
+**    - Internal:                                                                            **
+**        void testSlots();                           // slot of a due second, cancel        **
+**        void testExpire();                          // slots up to now, turns, reads       **
+**        void testPing();                            // silent connection is pinged         **
+**        Connection* newConn(int sd);                // idle connection, not in the wheel   **
+**        int inSlot(Shard *s, Connection *conn, uint64_t due);                              **
+**                                                    // connection is in the slot of due    **
+**                                                                                           **
+***********************************************************************************************
+**********************************************************************************************/
+#include "../src/reactor.c"
+
+#define TIMEOUT 10              // idle seconds of this test
+
+#define CHECK(cond) do{ if(!(cond)){ printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); failures++; } }while(0)
+
+static int failures;
+
+
+// function declare
+extern int streamFill(int sd);                 // external function from communicate.c
+extern void streamSetVersion(int sd, int version);    // external function from communicate.c
+extern int readFrame(int sd, int *opcode, int *flags, char *content, int size);    // external function from communicate.c
+static void testSlots();
+static void testExpire();
+static void testPing();
+static Connection* newConn(int sd);
+static int inSlot(Shard *s, Connection *conn, uint64_t due);
+
+
+int main()
+{
+	idleTimeout = TIMEOUT;
+	testSlots();
+	testExpire();
+	testPing();
+
+	if(failures > 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("wheel tests passed\n");
+	return 0;
+}
+
+
+/****************************************************************
+* Func:   A connection lands in the slot of due % WHEELSLOTS,   *
+*         seconds a turn apart share a slot; cancel takes it    *
+*         out of any position, twice is harmless                *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testSlots()
+{
+	Shard s;
+	Connection *a = newConn(-1), *b = newConn(-1), *c = newConn(-1);
+	uint64_t tick = 1000;
+
+	memset(&s, 0, sizeof(s));
+	pthread_mutex_init(&s.wheelLock, NULL);
+	s.wheel = (Connection **)calloc(WHEELSLOTS, sizeof(Connection *));
+	s.wheelTick = tick;
+
+	wheelSet(&s, a, tick + 5);
+	wheelSet(&s, b, tick + 5 + WHEELSLOTS);         // a turn later, same slot
+	wheelSet(&s, c, tick + 5 + 3 * WHEELSLOTS);
+	CHECK((tick + 5) % WHEELSLOTS == (tick + 5 + WHEELSLOTS) % WHEELSLOTS);
+	CHECK(inSlot(&s, a, tick + 5) && inSlot(&s, b, tick + 5) && inSlot(&s, c, tick + 5));
+	CHECK(s.wheel[(tick + 5) % WHEELSLOTS] == c && c->wheelNext == b && b->wheelNext == a && a->wheelNext == NULL);
+	CHECK(a->due == tick + 5 && b->due == tick + 5 + WHEELSLOTS);
+
+	wheelCancel(&s, b);                             // middle
+	CHECK(b->due == 0 && c->wheelNext == a && a->wheelPrev == c);
+	wheelCancel(&s, b);
+	wheelCancel(&s, c);                             // front
+	CHECK(s.wheel[(tick + 5) % WHEELSLOTS] == a && a->wheelPrev == NULL);
+	wheelCancel(&s, a);                             // last one
+	CHECK(s.wheel[(tick + 5) % WHEELSLOTS] == NULL);
+
+	wheelSet(&s, a, tick + WHEELSLOTS - 1);         // the slot before the current one
+	wheelSet(&s, b, tick + 1);
+	CHECK(inSlot(&s, a, tick + WHEELSLOTS - 1) && inSlot(&s, b, tick + 1) && !inSlot(&s, a, tick + 1));
+	wheelCancel(&s, a);
+	wheelCancel(&s, b);
+
+	free(s.wheel);
+	free(a);
+	free(b);
+	free(c);
+}
+
+
+/****************************************************************
+* Func:   wheelExpire handles every slot from wheelTick to now, *
+*         leaves those due a turn later, moves one that read    *
+*         meanwhile to its new second and looks again next      *
+*         second at one being served                            *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testExpire()
+{
+	Shard s;
+	Connection *later = newConn(-1), *reader = newConn(-1), *busy = newConn(-1), *ahead = newConn(-1);
+	uint64_t now = wheelClock(), start = now - 20, tick;
+
+	memset(&s, 0, sizeof(s));
+	pthread_mutex_init(&s.wheelLock, NULL);
+	s.wheel = (Connection **)calloc(WHEELSLOTS, sizeof(Connection *));
+	s.wheelTick = start;                            // 20 seconds to catch up
+
+	wheelSet(&s, later, start + 10 + WHEELSLOTS);   // slot passed, a turn too early
+	wheelSet(&s, reader, start + 10);
+	atomic_store(&reader->seen, now);               // read right now
+	wheelSet(&s, busy, start + 15);
+	atomic_store(&busy->sched, RUN_QUEUED);         // silent, but queued to be served
+	wheelSet(&s, ahead, now + 5);
+
+	wheelExpire(&s);
+	tick = s.wheelTick;                             // now, or a second later if the clock moved
+	CHECK(tick >= now && tick <= wheelClock());
+	CHECK(inSlot(&s, later, start + 10 + WHEELSLOTS));
+	CHECK(reader->due == now + TIMEOUT && inSlot(&s, reader, now + TIMEOUT));
+	CHECK(busy->due == tick + 1 && inSlot(&s, busy, tick + 1));    // looked at every second since
+	CHECK(ahead->due == now + 5 && inSlot(&s, ahead, now + 5));
+	CHECK(atomic_load(&busy->sched) == RUN_QUEUED && atomic_load(&reader->sched) == RUN_IDLE);
+
+	s.wheelTick = tick - 1;                         // the last second again, nothing new is due
+	wheelExpire(&s);
+	CHECK(inSlot(&s, reader, now + TIMEOUT) && inSlot(&s, later, start + 10 + WHEELSLOTS));
+
+	wheelCancel(&s, later);
+	wheelCancel(&s, reader);
+	wheelCancel(&s, busy);
+	wheelCancel(&s, ahead);
+	free(s.wheel);
+	free(later);
+	free(reader);
+	free(busy);
+	free(ahead);
+}
+
+
+/****************************************************************
+* Func:   A silent v2 connection is pinged once its slot comes  *
+*         round, and gets half the timeout to answer            *
+* Param:  none                                                  *
+* Return: none                                                  *
+****************************************************************/
+void testPing()
+{
+	Shard s;
+	Connection *conn;
+	char content[16];
+	uint64_t now = wheelClock();
+	int sd[2], op = -1;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, sd);
+	streamSetVersion(sd[0], 2);
+	streamSetVersion(sd[1], 2);
+	conn = newConn(sd[0]);
+	conn->state = CONN_COMMAND;
+	atomic_store(&conn->seen, now - TIMEOUT - 1);
+
+	memset(&s, 0, sizeof(s));
+	pthread_mutex_init(&s.wheelLock, NULL);
+	s.wheel = (Connection **)calloc(WHEELSLOTS, sizeof(Connection *));
+	s.wheelTick = now - 2;
+	wheelSet(&s, conn, now - 1);
+
+	wheelExpire(&s);
+	CHECK(conn->pinged == 1 && atomic_load(&conn->sched) == RUN_IDLE);
+	CHECK(conn->due == s.wheelTick + TIMEOUT / 2 && inSlot(&s, conn, conn->due));
+	CHECK(readFrame(sd[1], &op, NULL, content, sizeof(content)) == 0 && op == OP_PING);
+
+	wheelCancel(&s, conn);
+	free(s.wheel);
+	free(conn);
+	close(sd[0]);
+	close(sd[1]);
+}
+
+
+/****************************************************************
+* Func:   A logged in connection waiting for events, not in the *
+*         wheel                                                 *
+* Param:  int sd, socket description, -1: none                  *
+* Return: Connection*, new connection                           *
+****************************************************************/
+Connection* newConn(int sd)
+{
+	Connection *conn = (Connection *)calloc(1, sizeof(Connection));
+
+	conn->sd = sd;
+	conn->state = CONN_COMMAND;
+	atomic_init(&conn->sched, RUN_IDLE);
+	atomic_init(&conn->seen, 0);
+
+	return conn;
+}
+
+
+/****************************************************************
+* Func:   Whether a connection is linked in the slot of a due   *
+*         second                                                *
+* Param:  Shard *s, owner of the wheel                          *
+*         Connection *conn, connection to look for              *
+*         uint64_t due, second of the slot                      *
+* Return: int, 1 found                                          *
+*         0 not in that slot                                    *
+****************************************************************/
+int inSlot(Shard *s, Connection *conn, uint64_t due)
+{
+	Connection *c;
+
+	for(c = s->wheel[due % WHEELSLOTS]; c != NULL; c = c->wheelNext)
+	{
+		if(c == conn)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+// stubs of what reactor.c calls outside the wheel, never reached by these tests
+int userLogin(int sd, char *login, char *name) { return -1; }
+void userLogout(int loc, char *name) {}
+int commandArgs(char command) { return 0; }
+void serveCommand(int sd, int loc, char *name, char *request, char **args) {}
+void logLine(const char *format, ...) {}
+Arena* arenaCreate(int size) { return NULL; }
+void* arenaAlloc(Arena *arena, int size) { return malloc(size); }
+void arenaReset(Arena *arena) {}
+void arenaDestroy(Arena *arena) {}
+void pushMessage(int loc) {}
+unsigned int dirHash(char *name) { return 0; }
+int serverAdmit(int sd) { return 1; }
+void serverLeave() {}